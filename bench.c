@@ -0,0 +1,641 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "smoldtb.h"
+
+/* Benchmarks for smoldtb, built and run by `make bench`. Each corpus is a synthetic blob
+ * generated in memory, and its results are printed as one line of JSON.
+ */
+
+#define SAMPLE_COUNT 256
+#define PATH_MAX_LEN 160
+#define MIN_RUN_NS 200000000ull
+
+struct blob_writer
+{
+    uint8_t* structs;
+    size_t struct_size;
+    size_t struct_cap;
+    char* strings;
+    uint32_t strings_size;
+    uint32_t strings_cap;
+    uint32_t node_count;
+    uint32_t prop_count;
+};
+
+struct corpus
+{
+    const char* name;
+    void (*generate)(struct blob_writer* w);
+};
+
+size_t bytes_allocated = 0;
+
+void bench_on_error(const char* why)
+{
+    printf("smol-dtb error: %s\r\n", why);
+    exit(1);
+}
+
+void* bench_malloc(uint32_t length)
+{
+    bytes_allocated += length;
+    return malloc(length);
+}
+
+void bench_free(void* ptr, uint32_t length)
+{
+    (void)length;
+    free(ptr);
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void* grow(void* buffer, size_t* cap, size_t needed)
+{
+    if (needed <= *cap)
+        return buffer;
+    while (*cap < needed)
+        *cap = *cap ? *cap * 2 : 4096;
+    buffer = realloc(buffer, *cap);
+    if (buffer == NULL)
+    {
+        printf("out of memory\r\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+void put_bytes(struct blob_writer* w, const void* data, size_t length)
+{
+    const size_t padded = (length + 3) & ~(size_t)3;
+    w->structs = grow(w->structs, &w->struct_cap, w->struct_size + padded);
+    if (length > 0)
+        memcpy(w->structs + w->struct_size, data, length);
+    memset(w->structs + w->struct_size + length, 0, padded - length);
+    w->struct_size += padded;
+}
+
+void put_cell(struct blob_writer* w, uint32_t value)
+{
+    const uint8_t bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+    put_bytes(w, bytes, 4);
+}
+
+//the corpora only use a few property names, so a linear search is enough to deduplicate them.
+uint32_t string_offset(struct blob_writer* w, const char* name)
+{
+    for (uint32_t i = 0; i < w->strings_size; i += strlen(w->strings + i) + 1)
+    {
+        if (strcmp(w->strings + i, name) == 0)
+            return i;
+    }
+
+    const uint32_t offset = w->strings_size;
+    size_t cap = w->strings_cap;
+    w->strings = grow(w->strings, &cap, offset + strlen(name) + 1);
+    w->strings_cap = cap;
+    strcpy(w->strings + offset, name);
+    w->strings_size += strlen(name) + 1;
+    return offset;
+}
+
+void begin_node(struct blob_writer* w, const char* name)
+{
+    put_cell(w, 1);
+    put_bytes(w, name, strlen(name) + 1);
+    w->node_count++;
+}
+
+void end_node(struct blob_writer* w)
+{
+    put_cell(w, 2);
+}
+
+void prop(struct blob_writer* w, const char* name, const void* data, uint32_t length)
+{
+    put_cell(w, 3);
+    put_cell(w, length);
+    put_cell(w, string_offset(w, name));
+    put_bytes(w, data, length);
+    w->prop_count++;
+}
+
+void prop_cells(struct blob_writer* w, const char* name, const uint32_t* cells, uint32_t count)
+{
+    put_cell(w, 3);
+    put_cell(w, count * 4);
+    put_cell(w, string_offset(w, name));
+    for (uint32_t i = 0; i < count; i++)
+        put_cell(w, cells[i]);
+    w->prop_count++;
+}
+
+void prop_cell(struct blob_writer* w, const char* name, uint32_t value)
+{
+    prop_cells(w, name, &value, 1);
+}
+
+void prop_string(struct blob_writer* w, const char* name, const char* str)
+{
+    prop(w, name, str, strlen(str) + 1);
+}
+
+/* Returns the finished blob, which the caller frees. */
+uint8_t* finish_blob(struct blob_writer* w, uint32_t* size)
+{
+    put_cell(w, 9);
+    const uint32_t header_size = 40;
+    const uint32_t rsvmap_size = 16;
+    const uint32_t structs_offset = header_size + rsvmap_size;
+    const uint32_t strings_offset = structs_offset + (uint32_t)w->struct_size;
+    *size = (strings_offset + w->strings_size + 7) & ~7u;
+
+    uint8_t* blob = calloc(1, *size);
+    const uint32_t header[10] = { 0xD00DFEED, *size, structs_offset, strings_offset, header_size, 17, 16, 0,
+        w->strings_size, (uint32_t)w->struct_size };
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        for (uint32_t b = 0; b < 4; b++)
+            blob[i * 4 + b] = header[i] >> (24 - b * 8);
+    }
+    memcpy(blob + structs_offset, w->structs, w->struct_size);
+    memcpy(blob + strings_offset, w->strings, w->strings_size);
+    return blob;
+}
+
+void begin_root(struct blob_writer* w)
+{
+    begin_node(w, "");
+    prop_cell(w, "#address-cells", 2);
+    prop_cell(w, "#size-cells", 2);
+    prop_string(w, "compatible", "bench,board");
+    begin_node(w, "chosen");
+    prop_string(w, "bootargs", "console=ttyS0");
+    end_node(w);
+    begin_node(w, "interrupt-controller@c000000");
+    prop_string(w, "compatible", "bench,intc");
+    prop_cell(w, "#interrupt-cells", 1);
+    prop(w, "interrupt-controller", NULL, 0);
+    prop_cell(w, "phandle", 1);
+    end_node(w);
+}
+
+void device_props(struct blob_writer* w, uint32_t index, uint64_t base)
+{
+    char compat[40];
+    const int len = snprintf(compat, sizeof(compat), "bench,dev%u", index % 16);
+    memcpy(compat + len + 1, "bench,generic", 14);
+    prop(w, "compatible", compat, len + 15);
+    const uint32_t reg[4] = { base >> 32, (uint32_t)base, 0, 0x1000 };
+    prop_cells(w, "reg", reg, 4);
+    prop_cell(w, "interrupts", index % 1024);
+    prop_string(w, "status", "okay");
+}
+
+/* A flat '/soc' with 20k devices, like a large SoC. */
+void gen_wide_soc(struct blob_writer* w)
+{
+    begin_root(w);
+    begin_node(w, "soc");
+    prop_cell(w, "#address-cells", 2);
+    prop_cell(w, "#size-cells", 2);
+    prop(w, "ranges", NULL, 0);
+    prop_cell(w, "interrupt-parent", 1);
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+        char name[32];
+        const uint64_t base = 0x10000000ull + (uint64_t)i * 0x1000;
+        snprintf(name, sizeof(name), "dev@%llx", (unsigned long long)base);
+        begin_node(w, name);
+        device_props(w, i, base);
+        end_node(w);
+    }
+    end_node(w);
+    end_node(w);
+}
+
+//the parent address in 'ranges' has 2 cells below the root, and 3 below another bridge.
+void pci_bridge(struct blob_writer* w, uint32_t depth, uint32_t* count, uint32_t parent_cells)
+{
+    const uint32_t host_ranges[7] = { 0x02000000, 0, 0x40000000, 0, 0x40000000, 0, 0x10000000 };
+    const uint32_t bridge_ranges[8] = { 0x02000000, 0, 0x40000000, 0x02000000, 0, 0x40000000, 0, 0x10000000 };
+    prop_string(w, "device_type", "pci");
+    prop_cell(w, "#address-cells", 3);
+    prop_cell(w, "#size-cells", 2);
+    prop_cells(w, "ranges", parent_cells == 3 ? bridge_ranges : host_ranges, 5 + parent_cells);
+    for (uint32_t dev = 0; dev < 4; dev++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "pci@%x,0", dev);
+        begin_node(w, name);
+        const uint32_t reg[5] = { dev << 11, 0, 0, 0, 0 };
+        prop_cells(w, "reg", reg, 5);
+        if (depth > 1)
+            pci_bridge(w, depth - 1, count, 3);
+        else
+        {
+            prop_string(w, "compatible", (*count)++ % 2 ? "bench,nvme" : "bench,nic");
+            prop_cell(w, "interrupts", dev + 1);
+        }
+        end_node(w);
+    }
+}
+
+/* Four PCI host bridges, each with bridges nested six deep (about 22k nodes). */
+void gen_deep_pci(struct blob_writer* w)
+{
+    begin_root(w);
+    uint32_t count = 0;
+    for (uint32_t host = 0; host < 4; host++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "pcie@%x", 0x30000000 + host * 0x1000000);
+        begin_node(w, name);
+        prop_string(w, "compatible", "bench,pcie-host");
+        const uint32_t reg[4] = { 0, 0x30000000 + host * 0x1000000, 0, 0x1000000 };
+        prop_cells(w, "reg", reg, 4);
+        prop_cell(w, "interrupt-parent", 1);
+        pci_bridge(w, 6, &count, 2);
+        end_node(w);
+    }
+    end_node(w);
+}
+
+/* 50k nodes with scattered 32-bit phandles, each referring to another node. */
+void gen_sparse_phandles(struct blob_writer* w)
+{
+    begin_root(w);
+    uint32_t index = 0;
+    for (uint32_t bus = 0; bus < 500; bus++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "bus@%x", bus);
+        begin_node(w, name);
+        prop_string(w, "compatible", "simple-bus");
+        prop_cell(w, "#address-cells", 1);
+        prop_cell(w, "#size-cells", 1);
+        prop(w, "ranges", NULL, 0);
+        for (uint32_t i = 0; i < 100; i++, index++)
+        {
+            snprintf(name, sizeof(name), "node@%x", i);
+            begin_node(w, name);
+            const uint32_t reg[2] = { i * 0x100, 0x100 };
+            prop_cells(w, "reg", reg, 2);
+            //multiplying by an odd constant is a bijection, so the handles are distinct.
+            uint32_t handle = (index + 2) * 2654435761u;
+            if (handle == 0 || handle == ~0u || handle == 1)
+                handle = index + 2;
+            prop_cell(w, "phandle", handle);
+            prop_cell(w, "bench,link", (((index * 7919) % 50000) + 2) * 2654435761u);
+            end_node(w);
+        }
+        end_node(w);
+    }
+    end_node(w);
+}
+
+/* 16 PCI hosts with a 1024 entry 'interrupt-map' each, and 640 devices below each one. */
+void gen_interrupt_map(struct blob_writer* w)
+{
+    begin_root(w);
+    uint32_t* map = malloc(256 * 4 * 6 * sizeof(uint32_t));
+    for (uint32_t host = 0; host < 16; host++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "pcie@%x", 0x40000000 + host * 0x100000);
+        begin_node(w, name);
+        prop_string(w, "compatible", "bench,pcie-host");
+        prop_string(w, "device_type", "pci");
+        prop_cell(w, "#address-cells", 3);
+        prop_cell(w, "#size-cells", 2);
+        prop_cell(w, "#interrupt-cells", 1);
+        const uint32_t mask[4] = { 0xff00, 0, 0, 7 };
+        prop_cells(w, "interrupt-map-mask", mask, 4);
+        uint32_t cells = 0;
+        for (uint32_t slot = 0; slot < 256; slot++)
+        {
+            for (uint32_t pin = 1; pin <= 4; pin++)
+            {
+                map[cells++] = slot << 8;
+                map[cells++] = 0;
+                map[cells++] = 0;
+                map[cells++] = pin;
+                map[cells++] = 1;
+                map[cells++] = 32 + (slot + pin) % 64;
+            }
+        }
+        prop_cells(w, "interrupt-map", map, cells);
+        for (uint32_t dev = 0; dev < 640; dev++)
+        {
+            snprintf(name, sizeof(name), "dev@%x,%x", dev / 8, dev % 8);
+            begin_node(w, name);
+            const uint32_t reg[5] = { (dev % 256) << 8, 0, 0, 0, 0 };
+            prop_cells(w, "reg", reg, 5);
+            prop_string(w, "compatible", "bench,pci-dev");
+            prop_cell(w, "interrupts", dev % 4 + 1);
+            end_node(w);
+        }
+        end_node(w);
+    }
+    free(map);
+    end_node(w);
+}
+
+/* 100k nodes: 100 buses of 1000 devices, with phandles and references between them. */
+void gen_large_mixed(struct blob_writer* w)
+{
+    begin_root(w);
+    for (uint32_t bus = 0; bus < 100; bus++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "bus@%x", 0x80000000u + bus * 0x100000);
+        begin_node(w, name);
+        prop_string(w, "compatible", "simple-bus");
+        prop_cell(w, "#address-cells", 2);
+        prop_cell(w, "#size-cells", 2);
+        prop(w, "ranges", NULL, 0);
+        prop_cell(w, "interrupt-parent", 1);
+        for (uint32_t i = 0; i < 1000; i++)
+        {
+            const uint32_t index = bus * 1000 + i;
+            const uint64_t base = 0x80000000ull + bus * 0x100000 + i * 0x100;
+            snprintf(name, sizeof(name), "dev@%llx", (unsigned long long)base);
+            begin_node(w, name);
+            device_props(w, index, base);
+            if (index % 4 == 0)
+                prop_cell(w, "phandle", index + 2);
+            else
+                prop_cell(w, "clocks", (index & ~3u) + 2);
+            end_node(w);
+        }
+        end_node(w);
+    }
+    end_node(w);
+}
+
+const struct corpus corpora[] =
+{
+    { "wide_soc", gen_wide_soc },
+    { "deep_pci", gen_deep_pci },
+    { "sparse_phandles", gen_sparse_phandles },
+    { "interrupt_map", gen_interrupt_map },
+    { "large_mixed", gen_large_mixed },
+};
+
+struct samples
+{
+    dtb_node* nodes[SAMPLE_COUNT];
+    uint32_t node_count;
+    char paths[SAMPLE_COUNT][PATH_MAX_LEN];
+    uint32_t handles[SAMPLE_COUNT];
+    uint32_t handle_count;
+    const char* compatibles[8];
+    uint32_t compatible_count;
+};
+
+void collect_nodes(dtb_node* node, dtb_node** all, uint32_t* count)
+{
+    for (dtb_node* child = dtb_get_child(node); child != NULL; child = dtb_get_sibling(child))
+    {
+        all[(*count)++] = child;
+        collect_nodes(child, all, count);
+    }
+}
+
+void build_path(dtb_node* node, char* path)
+{
+    if (dtb_get_parent(node) == NULL)
+        return;
+    build_path(dtb_get_parent(node), path);
+    dtb_node_stat stat;
+    dtb_stat_node(node, &stat);
+    strcat(path, "/");
+    strcat(path, stat.name);
+}
+
+/* Picks nodes spread evenly over the tree, and the paths, phandles and compatible strings
+ * to look up.
+ */
+void collect_samples(dtb_state* state, uint32_t node_count, struct samples* samples)
+{
+    dtb_node** all = malloc(node_count * sizeof(dtb_node*));
+    uint32_t count = 0;
+    collect_nodes(dtb_find_ex(state, "/"), all, &count);
+
+    samples->node_count = samples->handle_count = samples->compatible_count = 0;
+    for (uint32_t i = 0; i < SAMPLE_COUNT && count > 0; i++)
+    {
+        dtb_node* node = all[(uint64_t)i * count / SAMPLE_COUNT];
+        samples->paths[samples->node_count][0] = 0;
+        build_path(node, samples->paths[samples->node_count]);
+        samples->nodes[samples->node_count++] = node;
+    }
+    //phandles can be sparse, so they're picked from all of the nodes that have one.
+    uint32_t* handles = malloc(node_count * sizeof(uint32_t));
+    uint32_t handle_count = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        dtb_prop* prop = dtb_find_prop(all[i], "phandle");
+        if (prop != NULL && dtb_read_prop_cell_array(prop, 1, &handles[handle_count]) == 1)
+            handle_count++;
+    }
+    for (uint32_t i = 0; i < SAMPLE_COUNT && i < handle_count; i++)
+        samples->handles[samples->handle_count++] = handles[(uint64_t)i * handle_count / SAMPLE_COUNT];
+    free(handles);
+    for (uint32_t i = 0; i < samples->node_count && samples->compatible_count < 8; i++)
+    {
+        const char* compat = dtb_read_prop_string(dtb_find_prop(samples->nodes[i], "compatible"), 0);
+        bool seen = compat == NULL;
+        for (uint32_t c = 0; c < samples->compatible_count && !seen; c++)
+            seen = strcmp(samples->compatibles[c], compat) == 0;
+        if (!seen)
+            samples->compatibles[samples->compatible_count++] = compat;
+    }
+    free(all);
+}
+
+volatile uintptr_t sink;
+
+/* Each of these does one round of lookups and returns how many calls it made. */
+uint32_t run_find(dtb_state* state, struct samples* samples)
+{
+    for (uint32_t i = 0; i < samples->node_count; i++)
+        sink += (uintptr_t)dtb_find_ex(state, samples->paths[i]);
+    return samples->node_count;
+}
+
+uint32_t run_find_compatible(dtb_state* state, struct samples* samples)
+{
+    uint32_t calls = 0;
+    for (uint32_t i = 0; i < samples->compatible_count; i++)
+    {
+        dtb_node* node = NULL;
+        do
+        {
+            node = dtb_find_compatible_ex(state, node, samples->compatibles[i]);
+            sink += (uintptr_t)node;
+            calls++;
+        }
+        while (node != NULL);
+    }
+    return calls;
+}
+
+uint32_t run_find_phandle(dtb_state* state, struct samples* samples)
+{
+    for (uint32_t i = 0; i < samples->handle_count; i++)
+        sink += (uintptr_t)dtb_find_phandle_ex(state, samples->handles[i]);
+    return samples->handle_count;
+}
+
+uint32_t run_read_cells(dtb_state* state, struct samples* samples)
+{
+    (void)state;
+    uint32_t calls = 0;
+    uint32_t cells[64];
+    for (uint32_t i = 0; i < samples->node_count; i++)
+    {
+        dtb_prop* prop = dtb_find_prop(samples->nodes[i], "reg");
+        if (prop != NULL && dtb_read_prop_cell_array(prop, 1, NULL) <= 64)
+        {
+            sink += dtb_read_prop_cell_array(prop, 1, cells) + cells[0];
+            calls++;
+        }
+    }
+    return calls;
+}
+
+/* Returns the average time of a lookup in nanoseconds, or -1 if there was nothing to look up. */
+double time_lookups(uint32_t (*run)(dtb_state*, struct samples*), dtb_state* state, struct samples* samples)
+{
+    uint64_t calls = 0;
+    const uint64_t start = now_ns();
+    uint64_t elapsed = 0;
+    while (elapsed < MIN_RUN_NS / 4)
+    {
+        const uint32_t round = run(state, samples);
+        if (round == 0)
+            return -1;
+        calls += round;
+        elapsed = now_ns() - start;
+    }
+    return (double)elapsed / calls;
+}
+
+void print_latency(const char* name, double ns)
+{
+    if (ns < 0)
+        printf(", \"%s\": null", name);
+    else
+        printf(", \"%s\": %.1f", name, ns);
+}
+
+void run_corpus(const struct corpus* corpus, dtb_ops ops, const char* write_dir)
+{
+    struct blob_writer w = { 0 };
+    corpus->generate(&w);
+    uint32_t blob_size;
+    uint8_t* blob = finish_blob(&w, &blob_size);
+    free(w.structs);
+    free(w.strings);
+
+    if (write_dir != NULL)
+    {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s/%s.dtb", write_dir, corpus->name);
+        FILE* file = fopen(filename, "wb");
+        if (file == NULL || fwrite(blob, 1, blob_size, file) != blob_size)
+            printf("Could not write %s\r\n", filename);
+        if (file != NULL)
+            fclose(file);
+    }
+
+    //the fastest of several runs, which is the least disturbed by the rest of the system.
+    uint64_t best = ~0ull;
+    size_t init_bytes = 0;
+    uint32_t runs = 0;
+    const uint64_t start = now_ns();
+    while (runs < 3 || now_ns() - start < MIN_RUN_NS)
+    {
+        bytes_allocated = 0;
+        const uint64_t begin = now_ns();
+        dtb_state* state = dtb_init_ex((uintptr_t)blob, ops);
+        const uint64_t end = now_ns();
+        init_bytes = bytes_allocated;
+        dtb_deinit(state);
+        if (end - begin < best)
+            best = end - begin;
+        runs++;
+    }
+
+    dtb_state* state = dtb_init_ex((uintptr_t)blob, ops);
+    struct samples* samples = malloc(sizeof(struct samples));
+    collect_samples(state, w.node_count, samples);
+    const double find_ns = time_lookups(run_find, state, samples);
+    const double compat_ns = time_lookups(run_find_compatible, state, samples);
+    const double phandle_ns = time_lookups(run_find_phandle, state, samples);
+    const double cells_ns = time_lookups(run_read_cells, state, samples);
+    dtb_deinit(state);
+
+    printf("{\"corpus\": \"%s\", \"nodes\": %u, \"props\": %u, \"blob_bytes\": %u, \"init_us\": %.1f, "
+        "\"init_mb_s\": %.1f, \"init_bytes_per_node\": %.1f", corpus->name, w.node_count, w.prop_count,
+        blob_size, best / 1000.0, blob_size / (best / 1000.0), (double)init_bytes / w.node_count);
+    print_latency("find_ns", find_ns);
+    print_latency("find_compatible_ns", compat_ns);
+    print_latency("find_phandle_ns", phandle_ns);
+    print_latency("read_cells_ns", cells_ns);
+    printf("}\n");
+    fflush(stdout);
+    free(samples);
+    free(blob);
+}
+
+void show_usage()
+{
+    printf("Usage: \
+            benchfdt [--write <directory>] [corpus names...] \
+            \
+            Generates synthetic device trees and prints one line of JSON per corpus with parse \
+            throughput, memory use and lookup times. --write also saves each generated blob. \
+            \r\n");
+}
+
+int main(int argc, char** argv)
+{
+    dtb_ops ops = { 0 };
+    ops.malloc = bench_malloc;
+    ops.free = bench_free;
+    ops.on_error = bench_on_error;
+
+    const char* write_dir = NULL;
+    int first_name = 1;
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        show_usage();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--write") == 0)
+    {
+        write_dir = argv[2];
+        mkdir(write_dir, 0755);
+        first_name = 3;
+    }
+
+    for (uint32_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+    {
+        bool selected = first_name >= argc;
+        for (int n = first_name; n < argc && !selected; n++)
+            selected = strcmp(argv[n], corpora[i].name) == 0;
+        if (selected)
+            run_corpus(&corpora[i], ops, write_dir);
+    }
+    return 0;
+}
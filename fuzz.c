@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smoldtb.h"
+
+/* A differential test for smoldtb, built and run by `make fuzz`. Each blob is parsed with
+ * `dtb_init_checked()` and walked with the streaming cursor at the same time, which reads the
+ * blob directly and acts as the reference: every node, property, cell read, path, phandle and
+ * compatible lookup of the parsed tree has to agree with it. Blobs the parser rejects only need
+ * to not crash. Define `SMOLDTB_LIBFUZZER` (and build with `-fsanitize=fuzzer`) to get a
+ * libFuzzer entry point instead of `main()`.
+ */
+
+#define MAX_REPORTS 8
+#define MAX_PATH_CHECKS 512
+#define MAX_COMPATIBLES 64
+#define PATH_BUFFER_LEN 512
+
+struct open_node
+{
+    dtb_node* node;
+    uint32_t prop_index;
+    uint32_t child_count;
+    bool has_status;
+    bool status_okay;
+    bool has_compatible;
+};
+
+struct handle_entry
+{
+    uint32_t handle;
+    uint32_t order; //the position in the tree, the earliest entry for a handle wins.
+    dtb_node* node;
+};
+
+struct compat_entry
+{
+    const char* str;
+    dtb_node* node;
+};
+
+struct walk
+{
+    dtb_state* state;
+    const char* blob_name;
+    uint32_t mismatches;
+
+    dtb_node** nodes; //in tree order, the same order the cursor visits them.
+    uint32_t node_count;
+    struct open_node* stack;
+    uint32_t depth;
+    struct handle_entry* handles;
+    uint32_t handle_count;
+    uint32_t handle_capacity;
+    struct compat_entry* compats;
+    uint32_t compat_count;
+    uint32_t compat_capacity;
+};
+
+size_t blobs_tested = 0;
+size_t blobs_accepted = 0;
+size_t reports_left = MAX_REPORTS; //per input file, so a broken lookup doesn't flood the output.
+
+void* fuzz_malloc(uint32_t length)
+{
+    return malloc(length);
+}
+
+void fuzz_free(void* ptr, uint32_t length)
+{
+    (void)length;
+    free(ptr);
+}
+
+void mismatch(struct walk* walk, const char* what, const char* name)
+{
+    walk->mismatches++;
+    if (reports_left > 0 && reports_left--)
+        printf("mismatch in %s: %s (%s)\r\n", walk->blob_name, what, name ? name : "");
+}
+
+uint32_t read_be32(const void* ptr)
+{
+    const uint8_t* bytes = ptr;
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+//the tree is walked depth-first, the same way the cursor visits the blob.
+dtb_node* next_in_tree(dtb_node* node)
+{
+    if (dtb_get_child(node) != NULL)
+        return dtb_get_child(node);
+    while (node != NULL && dtb_get_sibling(node) == NULL)
+        node = dtb_get_parent(node);
+    return node != NULL ? dtb_get_sibling(node) : NULL;
+}
+
+void* grow_array(void* array, uint32_t count, uint32_t* capacity, size_t size)
+{
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? *capacity * 2 : 64;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        printf("out of memory\r\n");
+        exit(1);
+    }
+    return array;
+}
+
+//the first non-empty string in the value has to be terminated, and be "okay" or "ok".
+bool status_okay(const dtb_prop* prop)
+{
+    const char* value = (const char*)prop->first_cell;
+    uint32_t start = 0;
+    while (start < prop->length && value[start] == 0)
+        start++;
+    const size_t len = strnlen(value + start, prop->length - start);
+    if (start + len >= prop->length)
+        return false;
+    return strcmp(value + start, "okay") == 0 || strcmp(value + start, "ok") == 0;
+}
+
+#ifdef SMOLDTB_PRUNE_DISABLED
+/* Reads ahead over a node's properties to see if the parser would have left it out. */
+bool node_pruned(const dtb_cursor* cursor)
+{
+    dtb_cursor peek = *cursor;
+    dtb_cursor_event event;
+    while (dtb_cursor_next(&peek, &event) && event.type == DTB_EVENT_PROP)
+    {
+        if (strcmp(event.name, "status") == 0)
+            return !status_okay(&event.prop);
+    }
+    return false;
+}
+
+void skip_subtree(dtb_cursor* cursor, uint32_t depth)
+{
+    dtb_cursor_event event;
+    while (dtb_cursor_next(cursor, &event) && !(event.type == DTB_EVENT_END_NODE && event.depth == depth))
+        ;
+}
+#endif
+
+void check_cells(struct walk* walk, dtb_prop* parsed, const dtb_prop* raw, const char* name)
+{
+    const uint32_t cell_count = raw->length / 4;
+    uint32_t* cells = malloc((cell_count + 1) * sizeof(uint32_t));
+    for (uint32_t width = 1; width <= 3; width++)
+    {
+        const uint32_t count = dtb_read_prop_cell_array(parsed, width, cells);
+        if (count != cell_count / width)
+        {
+            mismatch(walk, "cell count", name);
+            break;
+        }
+        for (uint32_t i = 0; i < count * width; i++)
+        {
+            if (cells[i] != read_be32((const uint8_t*)raw->first_cell + i * 4))
+            {
+                mismatch(walk, "cell value", name);
+                break;
+            }
+        }
+    }
+    free(cells);
+}
+
+void record_prop(struct walk* walk, struct open_node* owner, const dtb_prop* raw, const char* name)
+{
+    dtb_node* node = owner->node;
+    if ((strcmp(name, "phandle") == 0 || strcmp(name, "linux,phandle") == 0) && raw->length == 4)
+    {
+        const uint32_t handle = read_be32(raw->first_cell);
+        if (handle != 0 && handle != ~0u)
+        {
+            walk->handles = grow_array(walk->handles, walk->handle_count, &walk->handle_capacity,
+                sizeof(struct handle_entry));
+            walk->handles[walk->handle_count].handle = handle;
+            walk->handles[walk->handle_count].order = walk->handle_count;
+            walk->handles[walk->handle_count++].node = node;
+        }
+    }
+
+    /* Only a node's first 'compatible' is used. Each string in it has to be terminated within
+     * the property, and empty strings don't count.
+     */
+    if (strcmp(name, "compatible") == 0 && !owner->has_compatible)
+    {
+        owner->has_compatible = true;
+        const char* data = (const char*)raw->first_cell;
+        uint32_t start = 0;
+        for (uint32_t i = 0; i < raw->length; i++)
+        {
+            if (data[i] != 0)
+                continue;
+            if (i > start)
+            {
+                walk->compats = grow_array(walk->compats, walk->compat_count, &walk->compat_capacity,
+                    sizeof(struct compat_entry));
+                walk->compats[walk->compat_count].str = data + start;
+                walk->compats[walk->compat_count++].node = node;
+            }
+            start = i + 1;
+        }
+    }
+}
+
+/* Walks the blob with a cursor and the parsed tree side by side, comparing their contents. */
+void compare_structure(struct walk* walk, uintptr_t blob)
+{
+    dtb_cursor cursor;
+    if (!dtb_cursor_init(&cursor, blob))
+    {
+        mismatch(walk, "cursor rejected a parsed blob", NULL);
+        return;
+    }
+
+    uint32_t stack_capacity = 0;
+    uint32_t node_capacity = 0;
+    dtb_node* expected = dtb_find_ex(walk->state, "/");
+    dtb_cursor_event event;
+    while (true)
+    {
+        //the cursor stops at the end of the node it started in, but the parser keeps any nodes
+        //after the root as its siblings, so the walk carries on from there.
+        if (!dtb_cursor_next(&cursor, &event))
+        {
+            cursor.finished = false;
+            if (walk->depth != 0 || expected == NULL || !dtb_cursor_next(&cursor, &event))
+                break;
+        }
+
+        struct open_node* top = walk->depth > 0 ? &walk->stack[walk->depth - 1] : NULL;
+        if (event.type == DTB_EVENT_BEGIN_NODE)
+        {
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (walk->depth > 0 && node_pruned(&cursor))
+            {
+                skip_subtree(&cursor, event.depth);
+                continue;
+            }
+#endif
+            if (expected == NULL || expected->name != event.name)
+            {
+                mismatch(walk, "node missing or out of order", event.name);
+                return;
+            }
+            if (dtb_get_parent(expected) != (top ? top->node : NULL))
+                mismatch(walk, "parent", event.name);
+            if (top != NULL)
+                top->child_count++;
+
+            walk->stack = grow_array(walk->stack, walk->depth, &stack_capacity, sizeof(struct open_node));
+            walk->stack[walk->depth].node = expected;
+            walk->stack[walk->depth].prop_index = 0;
+            walk->stack[walk->depth].child_count = 0;
+            walk->stack[walk->depth].has_status = false;
+            walk->stack[walk->depth++].has_compatible = false;
+            walk->nodes = grow_array(walk->nodes, walk->node_count, &node_capacity, sizeof(dtb_node*));
+            walk->nodes[walk->node_count++] = expected;
+            expected = next_in_tree(expected);
+        }
+        else if (event.type == DTB_EVENT_PROP && top != NULL)
+        {
+            //the parser ignores properties that come after a node's children.
+            if (top->child_count > 0)
+                continue;
+
+            dtb_prop* parsed = dtb_get_prop(top->node, top->prop_index++);
+            if (parsed == NULL || parsed->name != event.name || parsed->length != event.prop.length
+                || (parsed->length > 0 && memcmp(parsed->first_cell, event.prop.first_cell, parsed->length) != 0))
+            {
+                mismatch(walk, "property", event.name);
+                continue;
+            }
+
+            dtb_prop* first = parsed;
+            for (uint32_t i = 0; i + 1 < top->prop_index; i++)
+            {
+                if (strcmp(dtb_get_prop(top->node, i)->name, event.name) == 0)
+                {
+                    first = dtb_get_prop(top->node, i);
+                    break;
+                }
+            }
+            if (dtb_find_prop(top->node, event.name) != first)
+                mismatch(walk, "dtb_find_prop()", event.name);
+            if (!top->has_status && strcmp(event.name, "status") == 0)
+            {
+                top->has_status = true;
+                top->status_okay = status_okay(&event.prop);
+            }
+            check_cells(walk, parsed, &event.prop, event.name);
+            record_prop(walk, top, &event.prop, event.name);
+        }
+        else if (event.type == DTB_EVENT_END_NODE && top != NULL)
+        {
+            dtb_node_stat stat;
+            dtb_stat_node(top->node, &stat);
+            if (stat.prop_count != top->prop_index || stat.child_count != top->child_count)
+                mismatch(walk, "property or child count", stat.name);
+
+            //a node is available if neither it nor any of its parents has a status other than okay.
+            bool available = true;
+            for (uint32_t i = 0; i < walk->depth; i++)
+                available = available && (!walk->stack[i].has_status || walk->stack[i].status_okay);
+            if (dtb_is_available(top->node) != available)
+                mismatch(walk, "dtb_is_available()", stat.name);
+            walk->depth--;
+        }
+    }
+
+    if (walk->depth != 0)
+        mismatch(walk, "cursor ended inside a node", NULL);
+    if (expected != NULL)
+        mismatch(walk, "node the cursor didn't find", expected->name);
+}
+
+/* The node `dtb_find()` should return for the path to `node`: the first child at each level with
+ * the same full name (or the same unit name, if the node's name has no unit address).
+ */
+dtb_node* first_match(dtb_node* node)
+{
+    dtb_node* parent = dtb_get_parent(node);
+    if (parent == NULL)
+        return node;
+    //an earlier sibling with the same name as a parent hides it, so the lookup carries on in there.
+    dtb_node* scope = first_match(parent);
+    if (scope == NULL)
+        return NULL;
+
+    const char* at = strchr(node->name, '@');
+    for (dtb_node* child = dtb_get_child(scope); child != NULL; child = dtb_get_sibling(child))
+    {
+        if (at != NULL && strcmp(child->name, node->name) == 0)
+            return child;
+        const size_t unit_len = strcspn(child->name, "@");
+        if (at == NULL && unit_len == strlen(node->name) && strncmp(child->name, node->name, unit_len) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+bool build_path(dtb_node* node, char* path, size_t* len)
+{
+    if (dtb_get_parent(node) == NULL)
+        return true;
+    if (!build_path(dtb_get_parent(node), path, len))
+        return false;
+    const size_t name_len = strlen(node->name);
+    if (name_len == 0 || strchr(node->name, '/') != NULL || *len + name_len + 2 > PATH_BUFFER_LEN)
+        return false;
+    path[(*len)++] = '/';
+    memcpy(path + *len, node->name, name_len + 1);
+    *len += name_len;
+    return true;
+}
+
+void compare_paths(struct walk* walk, uintptr_t blob)
+{
+    const uint32_t step = walk->node_count / MAX_PATH_CHECKS + 1;
+    for (uint32_t i = 1; i < walk->node_count; i += step)
+    {
+        //paths are looked up from the first root, so nodes after it can't be found by one.
+        dtb_node* node = walk->nodes[i];
+        dtb_node* root = node;
+        while (dtb_get_parent(root) != NULL)
+            root = dtb_get_parent(root);
+        char path[PATH_BUFFER_LEN] = "";
+        size_t len = 0;
+        if (root != walk->nodes[0] || !build_path(node, path, &len))
+            continue;
+
+        dtb_node* expected = first_match(node);
+        if (dtb_find_ex(walk->state, path) != expected)
+            mismatch(walk, "dtb_find()", path);
+
+#ifndef SMOLDTB_PRUNE_DISABLED
+        //the cursor doesn't prune anything, so it could find a disabled node with the same name.
+        dtb_cursor cursor;
+        dtb_cursor_event found;
+        const bool cursor_found = dtb_cursor_init(&cursor, blob) && dtb_cursor_find(&cursor, path, &found);
+        if (cursor_found != (expected != NULL) || (cursor_found && found.name != expected->name))
+            mismatch(walk, "dtb_cursor_find()", path);
+#else
+        (void)blob;
+#endif
+    }
+}
+
+int handle_less(const void* a, const void* b)
+{
+    const struct handle_entry* x = a;
+    const struct handle_entry* y = b;
+    if (x->handle != y->handle)
+        return x->handle < y->handle ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+void compare_phandles(struct walk* walk)
+{
+    if (walk->handle_count == 0)
+        return;
+    qsort(walk->handles, walk->handle_count, sizeof(struct handle_entry), handle_less);
+    for (uint32_t i = 0; i < walk->handle_count; i++)
+    {
+        //if a handle is used more than once, the first node in the tree has it.
+        const uint32_t handle = walk->handles[i].handle;
+        if (i > 0 && walk->handles[i - 1].handle == handle)
+            continue;
+        if (dtb_find_phandle_ex(walk->state, handle) != walk->handles[i].node)
+            mismatch(walk, "dtb_find_phandle()", walk->handles[i].node->name);
+
+        //the next value up is a handle that isn't in the tree, unless it's the next entry.
+        uint32_t next = i + 1;
+        while (next < walk->handle_count && walk->handles[next].handle == handle)
+            next++;
+        const uint32_t absent = handle + 1;
+        const bool used = next < walk->handle_count && walk->handles[next].handle == absent;
+        if (!used && absent != ~0u && dtb_find_phandle_ex(walk->state, absent) != NULL)
+            mismatch(walk, "dtb_find_phandle() of an unused handle", walk->handles[i].node->name);
+    }
+}
+
+void compare_compatibles(struct walk* walk, uintptr_t blob)
+{
+    const char* checked[MAX_COMPATIBLES];
+    uint32_t checked_count = 0;
+    for (uint32_t i = 0; i < walk->compat_count && checked_count < MAX_COMPATIBLES; i++)
+    {
+        const char* str = walk->compats[i].str;
+        bool seen = false;
+        for (uint32_t c = 0; c < checked_count && !seen; c++)
+            seen = strcmp(checked[c], str) == 0;
+        if (seen)
+            continue;
+        checked[checked_count++] = str;
+
+        //a node is only listed once, even if it has the same string twice.
+        dtb_node* found = NULL;
+        dtb_node* last = NULL;
+        dtb_cursor cursor;
+        dtb_cursor_event event;
+        const bool cursor_ok = dtb_cursor_init(&cursor, blob);
+        for (uint32_t e = i; e < walk->compat_count; e++)
+        {
+            if (walk->compats[e].node == last || strcmp(walk->compats[e].str, str) != 0)
+                continue;
+            last = walk->compats[e].node;
+            found = dtb_find_compatible_ex(walk->state, found, str);
+            if (found != last)
+            {
+                mismatch(walk, "dtb_find_compatible()", str);
+                break;
+            }
+            bool cursor_found = cursor_ok && dtb_cursor_find_compatible(&cursor, str, &event);
+#ifdef SMOLDTB_PRUNE_DISABLED
+            //the cursor reads the blob as it is, so it also finds the nodes that were pruned.
+            while (cursor_found && event.name != last->name && (const char*)event.name < last->name)
+                cursor_found = dtb_cursor_find_compatible(&cursor, str, &event);
+#endif
+            if (!cursor_found || event.name != last->name)
+                mismatch(walk, "dtb_cursor_find_compatible()", str);
+        }
+        if (found == last && dtb_find_compatible_ex(walk->state, found, str) != NULL)
+            mismatch(walk, "dtb_find_compatible() past the last match", str);
+    }
+}
+
+/* Compares everything for one blob, and returns the number of mismatches found. */
+uint32_t compare_blob(const char* name, uint8_t* blob, uint32_t size)
+{
+    dtb_ops ops = { 0 };
+    ops.malloc = fuzz_malloc;
+    ops.free = fuzz_free;
+
+    blobs_tested++;
+    dtb_error error;
+    struct walk walk = { 0 };
+    walk.blob_name = name;
+    walk.state = dtb_init_checked((uintptr_t)blob, size, ops, &error);
+    if (walk.state == NULL)
+        return 0;
+
+    blobs_accepted++;
+    compare_structure(&walk, (uintptr_t)blob);
+    if (walk.mismatches == 0)
+    {
+        compare_paths(&walk, (uintptr_t)blob);
+        compare_phandles(&walk);
+        compare_compatibles(&walk, (uintptr_t)blob);
+    }
+
+    dtb_deinit(walk.state);
+    free(walk.nodes);
+    free(walk.stack);
+    free(walk.handles);
+    free(walk.compats);
+    return walk.mismatches;
+}
+
+#ifdef SMOLDTB_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (size > 0x10000000)
+        return 0;
+    //the parser needs the blob to be aligned, which libFuzzer's buffers aren't guaranteed to be.
+    uint8_t* blob = malloc(size + 8);
+    memcpy(blob, data, size);
+    if (compare_blob("input", blob, size) != 0)
+        abort();
+    free(blob);
+    return 0;
+}
+#else
+uint64_t rng_state;
+
+uint32_t random_u32()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+void write_be32(uint8_t* ptr, uint32_t value)
+{
+    ptr[0] = value >> 24;
+    ptr[1] = value >> 16;
+    ptr[2] = value >> 8;
+    ptr[3] = value;
+}
+
+/* Damages a copy of a blob in a few places: flipped bits, structure tokens and lengths swapped
+ * for other values, and a shrunk 'total_size'.
+ */
+void mutate(uint8_t* blob, uint32_t size)
+{
+    const uint32_t count = random_u32() % 4 + 1;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint32_t cell = (random_u32() % (size / 4)) * 4;
+        switch (random_u32() % 5)
+        {
+        case 0:
+            blob[random_u32() % size] ^= 1 << (random_u32() % 8);
+            break;
+        case 1:
+            write_be32(blob + cell, random_u32() % 10);
+            break;
+        case 2:
+            write_be32(blob + cell, read_be32(blob + cell) + random_u32() % 9 - 4);
+            break;
+        case 3:
+            write_be32(blob + cell, random_u32());
+            break;
+        default:
+            if (size >= 8)
+                write_be32(blob + 4, read_be32(blob + 4) - random_u32() % 64);
+            break;
+        }
+    }
+}
+
+uint8_t* load_file(const char* filename, uint32_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    const long length = ftell(file);
+    rewind(file);
+    uint8_t* blob = length > 0 ? malloc(length + 8) : NULL;
+    if (blob != NULL && fread(blob, 1, length, file) != (size_t)length)
+    {
+        free(blob);
+        blob = NULL;
+    }
+    fclose(file);
+    *size = (uint32_t)length;
+    return blob;
+}
+
+void show_usage()
+{
+    printf("Usage: \
+            fuzzfdt [--mutations <count>] [--seed <number>] <filename.dtb>... \
+            \
+            Checks that the parsed tree of each file, and of count damaged copies of it, matches \
+            what the streaming cursor reads from the blob. Exits with status 1 on any mismatch. \
+            \r\n");
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t mutations = 0;
+    uint64_t seed = 1;
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "--mutations") == 0)
+            mutations = strtoul(argv[arg + 1], NULL, 0);
+        else if (strcmp(argv[arg], "--seed") == 0)
+            seed = strtoull(argv[arg + 1], NULL, 0);
+        else
+            break;
+        arg += 2;
+    }
+    if (arg >= argc)
+    {
+        show_usage();
+        return 0;
+    }
+
+    uint32_t mismatches = 0;
+    for (; arg < argc; arg++)
+    {
+        uint32_t size;
+        uint8_t* seed_blob = load_file(argv[arg], &size);
+        if (seed_blob == NULL)
+        {
+            printf("Could not read file %s\r\n", argv[arg]);
+            return 1;
+        }
+
+        reports_left = MAX_REPORTS;
+        const size_t tested = blobs_tested;
+        const size_t accepted = blobs_accepted;
+        uint32_t file_mismatches = compare_blob(argv[arg], seed_blob, size);
+        uint8_t* blob = malloc(size + 8);
+        rng_state = seed * 0x9E3779B97F4A7C15ull + 1;
+        for (uint32_t i = 0; i < mutations && size >= 4; i++)
+        {
+            memcpy(blob, seed_blob, size);
+            mutate(blob, size);
+            const uint32_t found = compare_blob(argv[arg], blob, size);
+            if (found != 0 && file_mismatches == 0)
+                printf("first mismatch in %s after mutation %u\r\n", argv[arg], i);
+            file_mismatches += found;
+        }
+        printf("%s: %zu blobs, %zu accepted, %u mismatches\r\n", argv[arg], blobs_tested - tested,
+            blobs_accepted - accepted, file_mismatches);
+        mismatches += file_mismatches;
+        free(blob);
+        free(seed_blob);
+    }
+    return mismatches != 0;
+}
+#endif
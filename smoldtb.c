@@ -2,40 +2,392 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+/* Vector byte swapping for `extract_cells()`, define `SMOLDTB_NO_SIMD` to only use the scalar loop. */
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__ && !defined(SMOLDTB_NO_SIMD)
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#endif
+
 #define FDT_MAGIC 0xD00DFEED
 #define FDT_BEGIN_NODE 1
 #define FDT_END_NODE 2
 #define FDT_PROP 3
 #define FDT_NOP 4
+#define FDT_END 9
+
+/* The version `dtb_write()` produces, and the oldest version it's compatible with. */
+#define FDT_VERSION 17
+#define FDT_LAST_COMP_VERSION 16
 
 #define FDT_CELL_SIZE 4
 #define ROOT_NODE_STR "/"
 
+/* Set in an atom if the name appears more than once in the strings block (i.e. the blob
+ * wasn't generated with deduplicated strings), in which case it's compared as a string.
+ */
+#define ATOM_AMBIGUOUS 0x80000000u
+
+/* Counters and phase callbacks for `dtb_get_stats()`, which compile to nothing unless
+ * `SMOLDTB_STATS` is defined. Counters may be updated by concurrent readers.
+ */
+#ifdef SMOLDTB_STATS
+#define STAT_ADD(state, counter, n) __atomic_fetch_add(&(state)->counter, (n), __ATOMIC_RELAXED)
+#define STAT_COUNT(local) ((local)++)
+#define STAT_PHASE(state, phase, done) ((state)->ops.on_phase ? (state)->ops.on_phase(phase, done) : (void)0)
+#else
+#define STAT_ADD(state, counter, n) (void)(n)
+#define STAT_COUNT(local) (void)(local)
+#define STAT_PHASE(state, phase, done) (void)0
+#endif
+
 #define DBG 1
 #if DBG
 uintptr_t dtb_base;
 uintptr_t cells_base;
 #endif
 
+/* A slot in the phandle hash table, `handle == 0` marks an empty slot. Zero (and ~0u) are
+ * not valid phandle values so this doesn't prevent any real phandle from being stored.
+ */
+struct dtb_phandle_slot
+{
+    uint32_t handle;
+    dtb_node* node;
+};
+
+#ifdef SMOLDTB_COMPAT_INDEX
+/* An entry in the compatible string index: one per string in each node's 'compatible'
+ * property. Each hash bucket is a list of distinct strings (linked by `next_str`), and each
+ * distinct string has a chain of every node using it in tree order (linked by `next_match`),
+ * so iterating over matches never visits a node that doesn't match.
+ */
+struct dtb_compat_entry
+{
+    const char* str;
+    dtb_node* node;
+    struct dtb_compat_entry* next_str;
+    struct dtb_compat_entry* next_match;
+    uint32_t hash;
+};
+#endif
+
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+#ifndef SMOLDTB_PATH_CACHE_KEY_LEN
+#define SMOLDTB_PATH_CACHE_KEY_LEN 64
+#endif
+#if (SMOLDTB_PATH_CACHE_SIZE & (SMOLDTB_PATH_CACHE_SIZE - 1)) != 0
+#error "SMOLDTB_PATH_CACHE_SIZE must be a power of 2"
+#endif
+
+/* A cached result of `dtb_find()`. Lookups are done by readers which may run concurrently, so
+ * each entry is protected by a sequence count: it's odd while the entry is being written, and
+ * a reader only uses what it read if the count was even and unchanged across the read.
+ * Zero means the entry has never been written. All fields are accessed with atomics.
+ */
+struct dtb_path_cache_entry
+{
+    uint32_t seq;
+    uint32_t hash;
+    dtb_node* node;
+    char path[SMOLDTB_PATH_CACHE_KEY_LEN];
+};
+#endif
+
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+#if (SMOLDTB_RANGES_CACHE_SIZE & (SMOLDTB_RANGES_CACHE_SIZE - 1)) != 0
+#error "SMOLDTB_RANGES_CACHE_SIZE must be a power of 2"
+#endif
+#ifndef SMOLDTB_RANGES_CACHE_MAX
+#define SMOLDTB_RANGES_CACHE_MAX 8
+#endif
+
+/* Special values for `dtb_ranges_cache_entry::count` */
+#define RANGES_UNTRANSLATABLE (~0u) //the bus has no 'ranges' property
+#define RANGES_IDENTITY (~0u - 1) //the bus has an empty 'ranges' property
+
+/* The decoded 'ranges' of a bus node, used by `dtb_translate_address()`. Entries are written
+ * once: a writer claims an empty entry, fills it and then publishes it by storing `node`
+ * (with release ordering), after which it never changes. So readers only need an acquire
+ * load of `node` before reading the rest. Buses with more than `SMOLDTB_RANGES_CACHE_MAX`
+ * ranges aren't cached.
+ */
+struct dtb_ranges_cache_entry
+{
+    uint32_t claimed;
+    uint32_t count;
+    dtb_node* node;
+    dtb_range ranges[SMOLDTB_RANGES_CACHE_MAX];
+};
+#endif
+
+#ifdef SMOLDTB_CHILD_INDEX
+#ifndef SMOLDTB_CHILD_INDEX_MIN
+#define SMOLDTB_CHILD_INDEX_MIN 32
+#endif
+/* How deep in the tree the count pass keeps track of child counts. Wide nodes deeper than
+ * this may not have space reserved for an index, and are searched linearly instead.
+ */
+#define CHILD_INDEX_MAX_DEPTH 32
+
+/* An entry in a node's child index, which holds one entry per child sorted by the hash of
+ * the child's unit name, then the hash of its full name (including the unit address), then
+ * the child's position in the sibling list. Lookups by full name are a binary search, lookups
+ * by unit name only have to check the children with the same unit name.
+ */
+struct dtb_child_entry
+{
+    uint32_t unit_hash;
+    uint32_t full_hash;
+    uint32_t position;
+    dtb_node* node;
+};
+#endif
+
+#ifdef SMOLDTB_LAZY_PARSE
+#ifdef SMOLDTB_COMPAT_INDEX
+#error "SMOLDTB_COMPAT_INDEX requires the whole tree to be parsed up front, it can't be used with SMOLDTB_LAZY_PARSE"
+#endif
+#endif
+
+#ifndef SMOLDTB_CHUNK_SIZE
+#define SMOLDTB_CHUNK_SIZE 0x1000
+#endif
+
+/* Memory that's needed after init (changes made to the tree, and in lazy mode the parse data
+ * of nodes as they're expanded) is allocated from a list of chunks. The chunk header is
+ * followed by `size` bytes of space, `used` of which have been handed out.
+ */
+struct dtb_chunk
+{
+    struct dtb_chunk* prev;
+    uint32_t size;
+    uint32_t used;
+};
+
+/* A property name that isn't in the blob's strings block, added by `dtb_set_prop()`. They're
+ * kept in a list (each name once) so `dtb_write()` can append them to the strings block,
+ * `offset` is where the name ends up in it.
+ */
+struct dtb_added_name
+{
+    struct dtb_added_name* next;
+    uint32_t offset;
+    char name[];
+};
+
+/* How many groups of top-level subtrees `dtb_init_parallel()` aims to split a blob into for
+ * each worker (more groups than workers keeps them busy when the subtrees differ in size), and
+ * the most groups it will use.
+ */
+#define SPLIT_GROUPS_PER_WORKER 4
+#define SPLIT_MAX_GROUPS 64
+
+/* Where a group of the root node's children starts, and how many of each buffer's entries
+ * come before it. The count pass records these so each group can be parsed into its own part
+ * of the buffers, see `parse_split_root()`.
+ */
+struct dtb_split
+{
+    uint32_t offset; //BEGIN_NODE of the group's first node, or END_NODE of the root for the last split.
+    uint32_t node_count;
+    uint32_t prop_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    uint32_t compat_count;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    uint32_t child_entry_count;
+#endif
+};
+
+struct dtb_split_plan
+{
+    struct dtb_split* splits;
+    uint32_t max_count;
+    uint32_t count;
+    uint32_t min_cells; //the smallest group worth splitting off, in cells.
+};
+
+/* The most cells `dtb_resolve_interrupt()` handles in an interrupt-map unit address, and
+ * the most interrupt parents (or nexus nodes) it follows before giving up on a loop.
+ */
+#define IMAP_MAX_ADDR_CELLS 4
+#define INTERRUPT_MAX_DEPTH 16
+
+/* A decoded 'interrupt-map' entry. The child unit address and interrupt specifier (as one
+ * array of cells) and the parent unit address and specifier are left in the blob.
+ */
+struct dtb_imap_entry
+{
+    uint32_t hash; //hash of the masked child cells, only used by `SMOLDTB_INTERRUPT_INFO`.
+    uint16_t parent_addr_cells;
+    uint16_t parent_int_cells;
+    const uint32_t* child;
+    const uint32_t* parent_cells;
+    dtb_node* parent;
+};
+
+#if defined(SMOLDTB_INTERRUPT_INFO) && defined(SMOLDTB_LAZY_PARSE)
+#error "SMOLDTB_INTERRUPT_INFO requires the whole tree to be parsed up front, it can't be used with SMOLDTB_LAZY_PARSE"
+#endif
+
+/* Names of the properties the parser looks for while parsing, interned during `dtb_init()`. */
+struct dtb_special_atoms
+{
+    dtb_atom phandle;
+    dtb_atom linux_phandle;
+    dtb_atom addr_cells;
+    dtb_atom size_cells;
+    dtb_atom compatible;
+#if defined(SMOLDTB_STATUS_INFO) || defined(SMOLDTB_PRUNE_DISABLED)
+    dtb_atom status;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    dtb_atom interrupt_cells;
+    dtb_atom interrupt_map;
+#endif
+};
+
+/* What the parser does itself with a property, see `special_props`. */
+enum dtb_special_kind
+{
+    SPECIAL_NONE,
+    SPECIAL_PHANDLE,
+    SPECIAL_ADDR_CELLS,
+    SPECIAL_SIZE_CELLS,
+    SPECIAL_COMPATIBLE,
+    SPECIAL_INTERRUPT_CELLS,
+    SPECIAL_INTERRUPT_MAP,
+    SPECIAL_STATUS,
+    SPECIAL_KIND_COUNT,
+};
+
+/* A slot in the special property table, which is keyed by the offset of the property's name in
+ * the strings block, so looking up a property costs the same however many names are in it.
+ * `atom == DTB_ATOM_INVALID` marks an empty slot. The table is never more than half full.
+ */
+#define SPECIAL_SLOT_BITS 6
+#define SPECIAL_SLOT_COUNT (1 << SPECIAL_SLOT_BITS)
+struct dtb_special_slot
+{
+    dtb_atom atom;
+    uint8_t kind;
+    uint32_t hooks; //bit `i` set for each `prop_hooks[i]` with this name.
+};
+
+/* The most hooks from `ops.prop_hooks` that an instance uses, any after them are reported through
+ * `ops.on_error()` and ignored. Each hook's name can take a slot in the table above, which holds
+ * at most `SPECIAL_SLOT_COUNT / 2` names, and `SPECIAL_BUILTIN_NAMES` of those are the ones the
+ * parser handles itself (every name interned by `intern_special_atoms()`), so with 64 slots
+ * that leaves room for 24 hooks.
+ */
+#define SPECIAL_BUILTIN_NAMES 8
+#ifndef SMOLDTB_MAX_PROP_HOOKS
+#define SMOLDTB_MAX_PROP_HOOKS 8
+#endif
+#if SMOLDTB_MAX_PROP_HOOKS > SPECIAL_SLOT_COUNT / 2 - SPECIAL_BUILTIN_NAMES
+#error "SMOLDTB_MAX_PROP_HOOKS can't be more than 24, since the special property table would be over half full"
+#endif
+
 struct dtb_state
 {
+    const struct fdt_header* header;
     const uint32_t* cells;
     const char* strings;
     uint32_t cell_count;
+    uint32_t strings_size;
     dtb_node* root;
+    struct dtb_special_atoms atoms;
+    struct dtb_special_slot special_slots[SPECIAL_SLOT_COUNT];
+    uint64_t special_filter; //bit `special_hash(offset)` set for each name offset in the table.
+    bool special_ambiguous; //a name in the table isn't unique, see `find_special()`.
+    const dtb_prop_hook* prop_hooks;
 
-    dtb_node** handle_lookup;
+    uint8_t* buffer;
+    uint32_t buffer_size;
+    struct dtb_phandle_slot* handle_lookup;
+    uint32_t handle_slot_count;
+    uint32_t handle_slots_used;
     dtb_node* node_buff;
     uint32_t node_alloc_head;
     uint32_t node_alloc_max;
     dtb_prop* prop_buff;
     uint32_t prop_alloc_head;
     uint32_t prop_alloc_max;
+#ifdef SMOLDTB_COMPAT_INDEX
+    struct dtb_compat_entry* compat_buff;
+    uint32_t compat_alloc_head;
+    uint32_t compat_alloc_max;
+    struct dtb_compat_entry** compat_buckets;
+    uint32_t compat_bucket_count;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    struct dtb_child_entry* child_entry_buff;
+    uint32_t child_entry_alloc_head;
+    uint32_t child_entry_alloc_max;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    struct dtb_imap_entry* imap_buff;
+    uint32_t imap_alloc_head;
+    uint32_t imap_alloc_max;
+#endif
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+    struct dtb_path_cache_entry path_cache[SMOLDTB_PATH_CACHE_SIZE];
+    size_t path_cache_hits;
+    size_t path_cache_misses;
+#endif
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+    struct dtb_ranges_cache_entry ranges_cache[SMOLDTB_RANGES_CACHE_SIZE];
+    size_t ranges_cache_hits;
+    size_t ranges_cache_misses;
+#endif
+#ifdef SMOLDTB_STATS
+    size_t loaded_nodes; //with lazy parsing, the nodes and properties created so far.
+    size_t loaded_props;
+    dtb_call_stats find_stats;
+    dtb_call_stats compat_stats;
+    dtb_call_stats prop_stats;
+    dtb_call_stats phandle_stats;
+#endif
+    struct dtb_chunk* chunks;
+    struct dtb_added_name* added_names;
+    struct dtb_added_name* last_added_name;
+    uint32_t added_strings_size;
+    /* Set once the tree is changed in a way a lookup index can't be updated for, so lookups walk
+     * the tree instead: the phandle table (or the blob in lazy mode), the compatible index (or the
+     * parsed nodes searched without one), and the interrupt parents and maps recorded by the parser.
+     */
+    bool phandles_stale;
+    bool compat_stale;
+    bool interrupts_stale;
+    bool phandle_duplicates; //a phandle is used by more than one node, the table only has the first.
+    bool max_phandle_known; //the tree is only walked for the largest phandle if it's needed.
+    uint32_t max_phandle;
+    bool shared_tables; //set on the copies of an instance used by workers, see `parse_split_root()`.
+    dtb_error error; //why the last parse failed, or `DTB_OK`.
+    const struct fdt_reserved_mem_entry* memreserve;
+    uint32_t memreserve_count;
+    dtb_reg* reserved_ranges; //sorted and coalesced, see `build_reserved_ranges()`.
+    uint32_t reserved_range_count;
+    struct dtb_index_header* index; //the caller's memory holding the arena, see `dtb_init_from_index()`.
+#ifdef SMOLDTB_TOPOLOGY
+    dtb_cpu* cpus;
+    uint32_t cpu_count;
+    dtb_reg* memory;
+    uint32_t memory_count;
+#endif
 
     dtb_ops ops;
 };
 
-struct dtb_state state;
+/* The instance used by the original (non-`_ex`) API. */
+static struct dtb_state default_state;
+/* The instance most recently made visible to readers by `dtb_publish()`. */
+static struct dtb_state* published_state;
 
 #ifdef SMOLDTB_STATIC_BUFFER_SIZE
     uint8_t big_buff[SMOLDTB_STATIC_BUFFER_SIZE];
@@ -46,6 +398,8 @@ static uint32_t be32(uint32_t input)
 {
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
     return input;
+#elif defined(__GNUC__)
+    return __builtin_bswap32(input);
 #else
     uint32_t temp = 0;
     temp |= (input & 0xFF) << 24;
@@ -65,6 +419,15 @@ static uint32_t string_len(const char* str)
     return count;
 }
 
+/* Returns the length of a string in a buffer of `max` bytes, or `max` if it isn't terminated. */
+static uint32_t string_len_bounded(const char* str, uint32_t max)
+{
+    uint32_t count = 0;
+    while (count < max && str[count] != 0)
+        count++;
+    return count;
+}
+
 /* Returns non-zero if the contents of two strings match, else zero. */
 static bool strings_eq(const char* a, const char* b)
 {
@@ -107,507 +470,5731 @@ static uint32_t string_find_char(const char* str, char target)
     return i;
 }
 
-static uint32_t dtb_align_up(uint32_t input, uint32_t alignment)
-{
-    return ((input + alignment - 1) / alignment) * alignment;
-}
-
-/* Allocator design:
- * The parser allocates a single large buffer from the host kernel, or uses the compile time
- * statically allocated buffer. It then internally breaks that into 3 other buffers:
- * - the first is `node_buff` which is used as a bump allocator for node structs. This function
- *   (`alloc_node()`) uses this buffer to return new pointers.
- * - the second is `prop_buffer` which is similar, but for property structs instead of nodes.
- *   The `alloc_prop()` function uses that buffer.
- * - the last buffer isn't allocated from, but is an array of pointers (one per node). This is
- *   used for phandle lookup. The phandle is the index, and if the array element is non-null,
- *   it points to the dtb_node struct representing the associated node. This makes the assumption
- *   that phandles were allocated in a sane manner (asking a lot of some hardware vendors).
- *   This buffer is populated when nodes are parsed: if a node has a phandle property, it's
- *   inserted into the array at the corresponding index to the phandle value.
+/* Steps through the strings of a string-list property value (like 'compatible'), returning the
+ * one at or after `*offset` and moving the offset past it, or NULL when there are no more. Empty
+ * strings are skipped, and so is a string that isn't terminated within the value.
  */
-static dtb_node* alloc_node()
-{
-    if (state.node_alloc_head + 1 < state.node_alloc_max)
-        return &state.node_buff[state.node_alloc_head++];
-
-    if (state.ops.on_error)
-        state.ops.on_error("Node allocator ran out of space");
-    return NULL;
-}
-
-static dtb_prop* alloc_prop()
+static const char* next_list_string(const char* value, uint32_t length, uint32_t* offset)
 {
-    if (state.prop_alloc_head + 1 < state.prop_alloc_max)
-        return &state.prop_buff[state.prop_alloc_head++];
+    while (*offset < length && value[*offset] == 0)
+        (*offset)++;
+    const uint32_t begin = *offset;
+    while (*offset < length && value[*offset] != 0)
+        (*offset)++;
+    if (*offset >= length)
+        return NULL;
 
-    if (state.ops.on_error)
-        state.ops.on_error("Property allocator ran out of space");
-    return NULL;
+    (*offset)++;
+    return &value[begin];
 }
 
-static void free_buffers()
+/* Checks if `str` is one of the strings in a string-list property value */
+static bool list_has_string(const dtb_prop* prop, const char* str)
 {
-#ifdef SMOLDTB_STATIC_BUFFER_SIZE
-    state.node_alloc_head = state.node_alloc_max;
-    state.prop_alloc_head = state.prop_alloc_max;
-#else
-    if (state.ops.free == NULL)
+    uint32_t offset = 0;
+    const char* item;
+    while ((item = next_list_string((const char*)prop->first_cell, prop->length, &offset)) != NULL)
     {
-        if (state.ops.on_error)
-            state.ops.on_error("ops.free() is NULL while trying to free buffers.");
-        return;
+        if (strings_eq(item, str))
+            return true;
     }
-
-    uint32_t buff_size = state.node_alloc_max * sizeof(dtb_node);
-    buff_size += state.prop_alloc_max * sizeof(dtb_prop);
-    buff_size += state.node_alloc_max * sizeof(void*);
-
-    state.ops.free(state.node_buff, buff_size);
-    state.node_buff = NULL;
-    state.prop_buff = NULL;
-    state.handle_lookup = NULL;
-    state.node_alloc_max = state.prop_alloc_max = 0;
-#endif
+    return false;
 }
 
-static void alloc_buffers()
+#if defined(SMOLDTB_COMPAT_INDEX) || defined(SMOLDTB_PATH_CACHE_SIZE) || defined(SMOLDTB_NODE_NAME_INFO) \
+    || defined(SMOLDTB_CHILD_INDEX)
+/* 32-bit FNV-1a hash of the first `len` bytes of a string */
+static uint32_t string_hash_bounded(const char* str, uint32_t len)
 {
-    state.node_alloc_max = 0;
-    state.prop_alloc_max = 0;
-    for (uint32_t i = 0; i < state.cell_count; i++)
+    uint32_t hash = 0x811C9DC5;
+    for (uint32_t i = 0; i < len; i++)
     {
-        if (be32(state.cells[i]) == FDT_BEGIN_NODE)
-            state.node_alloc_max++;
-        else if (be32(state.cells[i]) == FDT_PROP)
-            state.prop_alloc_max++;
+        hash ^= (uint8_t)str[i];
+        hash *= 0x01000193;
     }
+    return hash;
+}
 
-    uint32_t total_size = state.node_alloc_max * sizeof(dtb_node);
-    total_size += state.prop_alloc_max * sizeof(dtb_prop);
-    total_size += state.node_alloc_max * sizeof(void*); //we assume the worst case and that each node has a phandle prop
-
-#ifdef SMOLDTB_STATIC_BUFFER_SIZE
-    if (total_size >= SMOLDTB_STATIC_BUFFER_SIZE)
-    {
-        if (state.ops.on_error)
-            state.ops.on_error("Too much data for statically allocated buffer.");
-        return;
-    }
-    uint8_t* buffer = big_buff;
-#else
-    uint8_t* buffer = state.ops.malloc(total_size);
+#if defined(SMOLDTB_COMPAT_INDEX) || defined(SMOLDTB_PATH_CACHE_SIZE) || defined(SMOLDTB_CHILD_INDEX)
+static uint32_t string_hash(const char* str)
+{
+    return string_hash_bounded(str, string_len(str));
+}
+#endif
 #endif
 
-    for (uint32_t i = 0; i < total_size; i++)
-        buffer[i] = 0;
-
-    state.node_buff = (dtb_node*)buffer;
-    state.node_alloc_head = 0;
-    state.prop_buff = (dtb_prop*)&state.node_buff[state.node_alloc_max];
-    state.prop_alloc_head = 0;
-    state.handle_lookup = (dtb_node**)&state.prop_buff[state.prop_alloc_max];
+static uint32_t dtb_align_up(uint32_t input, uint32_t alignment)
+{
+    return ((input + alignment - 1) / alignment) * alignment;
 }
 
-/* This runs on every new property found, and handles some special cases for us. */
-static void check_for_special_prop(dtb_node* node, dtb_prop* prop)
+/* Returns the offset of the token after a BEGIN_NODE token and the name that follows it. */
+static uint32_t skip_node_name(const uint32_t* cells, uint32_t offset)
 {
-    const char name0 = prop->name[0];
-    if (name0 != '#' && name0 != 'p' && name0 != 'l')
-        return; //short circuit to save processing
-
-    const uint32_t name_len = string_len(prop->name);
-    const char* name_phandle = "phandle";
-    const uint32_t len_phandle = string_len(name_phandle);
-    if (name_len == len_phandle && strings_eq(prop->name, name_phandle))
-    {
-        uint32_t handle;
-        dtb_read_prop_cell_array(prop, 1, &handle);
-        state.handle_lookup[handle] = node;
-        return;
-    }
-
-    const char* name_linuxhandle = "linux,phandle";
-    const uint32_t len_linuxhandle = string_len(name_linuxhandle);
-    if (name_len == len_linuxhandle && strings_eq(prop->name, name_linuxhandle))
-    {
-        uint32_t handle;
-        dtb_read_prop_cell_array(prop, 1, &handle);
-        state.handle_lookup[handle] = node;
-        return;
-    }
-
-    const char* name_addrcells = "#address-cells";
-    const uint32_t len_addrcells = string_len(name_addrcells);
-    if (name_len == len_addrcells && strings_eq(prop->name, name_addrcells))
-    {
-        uint32_t cells;
-        dtb_read_prop_cell_array(prop, 1, &cells);
-        node->addr_cells = cells;
-        return;
-    }
-
-    const char* name_sizecells = "#size-cells";
-    const uint32_t len_sizecells = string_len(name_sizecells);
-    if (name_len == len_sizecells && strings_eq(prop->name, name_sizecells))
-    {
-        uint32_t cells;
-        dtb_read_prop_cell_array(prop, 1, &cells);
-        node->size_cells = cells;
-        return;
-    }
+    const uint32_t name_len = string_len((const char*)(cells + offset + 1));
+    return offset + (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
 }
 
-static dtb_prop* parse_prop(uint32_t* offset)
+/* Returns the offset of the token after a PROP token and its payload. */
+static uint32_t skip_prop(const uint32_t* cells, uint32_t offset)
 {
-    if (be32(state.cells[*offset]) != FDT_PROP)
-        return NULL;
-
-    (*offset)++;
-    dtb_prop* prop = alloc_prop();
+    return offset + (dtb_align_up(be32(cells[offset + 1]), FDT_CELL_SIZE) / FDT_CELL_SIZE) + 3;
+}
 
-    const struct fdt_property* fdtprop = (struct fdt_property*)(state.cells + *offset);
-    prop->name = (const char*)(state.strings + be32(fdtprop->name_offset));
-    prop->first_cell = state.cells + *offset + 2;
+/* Fills in a property from the PROP token at `offset`, returns the offset of the token after it. */
+static uint32_t read_prop(const uint32_t* cells, const char* strings, uint32_t offset, dtb_prop* prop)
+{
+    const struct fdt_property* fdtprop = (const struct fdt_property*)(cells + offset + 1);
+    prop->name = strings + be32(fdtprop->name_offset);
+    prop->first_cell = cells + offset + 3;
     prop->length = be32(fdtprop->length);
-    (*offset) += (dtb_align_up(prop->length, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 2;
-    
-    return prop;
+    return skip_prop(cells, offset);
 }
 
-static dtb_node* parse_node(uint32_t* offset, uint8_t addr_cells, uint8_t size_cells)
+/* Reads a property that should be a single cell (like '#address-cells' or 'phandle'), leaving
+ * `value` unchanged and returning false if the property is any other size.
+ */
+static bool read_single_cell(const dtb_prop* prop, uint32_t* value)
 {
-    if (be32(state.cells[*offset]) != FDT_BEGIN_NODE)
-        return NULL;
-
-    dtb_node* node = alloc_node(); 
-    node->name = (const char*)(state.cells + (*offset) + 1);
-    node->addr_cells = addr_cells;
-    node->size_cells = size_cells;
+    if (prop == NULL || prop->length != FDT_CELL_SIZE)
+        return false;
+    *value = be32(prop->first_cell[0]);
+    return true;
+}
 
-    const uint32_t name_len = string_len(node->name);
-    *offset += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+/* Combines `count` big-endian cells into an integer, larger values keep their low 64 bits. */
+static uint64_t read_cells_u64(const uint32_t* cells, uint32_t count)
+{
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; i++)
+        value = (value << 32) | be32(cells[i]);
+    return value;
+}
 
-    while (*offset < state.cell_count)
+/* Returns the offset of the token after the end of the node starting at `offset`, or
+ * `cell_count` if the node isn't terminated.
+ */
+static uint32_t skip_node(const uint32_t* cells, uint32_t cell_count, uint32_t offset)
+{
+    uint32_t depth = 0;
+    while (offset < cell_count)
     {
-        const uint32_t test = be32(state.cells[*offset]);
-        if (test == FDT_END_NODE)
+        const uint32_t token = be32(cells[offset]);
+        if (token == FDT_BEGIN_NODE)
         {
-            (*offset)++;
-            return node;
+            offset = skip_node_name(cells, offset);
+            depth++;
         }
-        else if (test == FDT_BEGIN_NODE)
+        else if (token == FDT_END_NODE)
         {
-            dtb_node* child = parse_node(offset, node->addr_cells, node->size_cells);
-            if (child)
-            {
-                child->sibling = node->child;
-                node->child = child;
-                child->parent = node;
-            }
+            offset++;
+            if (--depth == 0)
+                return offset;
         }
-        else if (test == FDT_PROP)
+        else if (token == FDT_PROP)
         {
-            dtb_prop* prop = parse_prop(offset);
-            if (prop)
-            {
-                prop->next = node->props;
-                node->props = prop;
-                check_for_special_prop(node, prop);
-            }
+            if (offset + 2 >= cell_count)
+                break;
+            offset = skip_prop(cells, offset);
         }
+        else if (token == FDT_END)
+            break;
         else
-            (*offset)++;
+            offset++;
     }
 
-    if (state.ops.on_error)
-        state.ops.on_error("Node has no terminating tag.");
-    return NULL;
+    return cell_count;
 }
 
-void dtb_init(uintptr_t start, dtb_ops ops)
+/* Allocator design:
+ * The parser allocates a single large buffer from the host kernel, or uses the compile time
+ * statically allocated buffer (only for the default instance, instances created by
+ * `dtb_init_ex()` always use `ops.malloc()`). It then internally breaks that into 3 other buffers:
+ * - the first is `node_buff` which is used as a bump allocator for node structs. This function
+ *   (`alloc_node()`) uses this buffer to return new pointers.
+ * - the second is `prop_buffer` which is similar, but for property structs instead of nodes.
+ *   The `alloc_prop()` function uses that buffer. Properties must come before any child nodes
+ *   in the blob, so a node's properties are allocated back to back and can be stored as a
+ *   pointer to the first one and a count.
+ * - the last buffer isn't allocated from, but is an open-addressing hash table used for phandle
+ *   lookup. It has a power-of-2 number of slots, at least twice the number of phandle properties
+ *   in the tree, so any 32-bit phandle value can be stored without assuming vendors allocated
+ *   them densely. This buffer is populated when nodes are parsed: if a node has a phandle
+ *   property it's inserted into the table, keyed by the phandle value.
+ * If `SMOLDTB_COMPAT_INDEX` is defined two more buffers follow: an array of compatible entries
+ * (one per string in every 'compatible' property) and an array of hash buckets pointing into it.
+ * If `SMOLDTB_CHILD_INDEX` is defined the last buffer is a pool of child index entries, with
+ * one entry for each child of a node with at least `SMOLDTB_CHILD_INDEX_MIN` children.
+ *
+ * With `SMOLDTB_LAZY_PARSE` there's no up-front buffer. Each time a node is expanded its
+ * properties, children and child index are allocated from a list of chunks (`chunk_alloc()`), and
+ * `node_buff`/`prop_buff` are pointed at those arrays so the functions below work unchanged.
+ * The phandle table isn't used, phandles are found by scanning the blob instead.
+ */
+static dtb_node* alloc_node(struct dtb_state* state)
 {
-    state.ops = ops;
-#if DBG
-    dtb_base = start;
-#endif
-#ifndef SMOLDTB_STATIC_BUFFER_SIZE
-    if (!state.ops.malloc)
-    {
-        if (state.ops.on_error)
-            state.ops.on_error("ops.malloc is NULL");
-        return;
-    }
-#endif
-
-    struct fdt_header* header = (struct fdt_header*)start;
-    if (be32(header->magic) != FDT_MAGIC)
-    {
-        if (state.ops.on_error)
-            state.ops.on_error("FDT has incorrect magic number.");
-        return;
-    }
-
-    state.cells = (const uint32_t*)(start + be32(header->offset_structs));
-    state.cell_count = be32(header->size_structs) / sizeof(uint32_t);
-    state.strings = (const char*)(start + be32(header->offset_strings));
+    if (state->node_alloc_head < state->node_alloc_max)
+        return &state->node_buff[state->node_alloc_head++];
 
-    if (state.node_buff)
-        free_buffers();
-    alloc_buffers();
+    if (state->ops.on_error)
+        state->ops.on_error("Node allocator ran out of space");
+    return NULL;
+}
 
-    for (uint32_t i = 0; i < state.cell_count; i++)
-    {
-        if (be32(state.cells[i]) != FDT_BEGIN_NODE)
-            continue;
+static dtb_prop* alloc_prop(struct dtb_state* state)
+{
+    if (state->prop_alloc_head < state->prop_alloc_max)
+        return &state->prop_buff[state->prop_alloc_head++];
 
-        dtb_node* sub_root = parse_node(&i, 2, 1);
-        if (sub_root == NULL)
-            continue;
-        sub_root->sibling = state.root;
-        state.root = sub_root;
-    }
+    if (state->ops.on_error)
+        state->ops.on_error("Property allocator ran out of space");
+    return NULL;
 }
 
-dtb_node* dtb_find_compatible(dtb_node* start, const char* str)
+static void free_chunks(struct dtb_state* state)
 {
-    uint32_t begin_index = 0;
-    if (start != NULL)
+    while (state->chunks != NULL)
     {
-        const uintptr_t offset = (uintptr_t)start - (uintptr_t)state.node_buff;
-        begin_index = offset / sizeof(dtb_node);
-        begin_index++; //we want to start searching AFTER this node.
-    }
-
-    for (uint32_t i = begin_index; i < state.node_alloc_head; i++)
-    {
-        dtb_node* node = &state.node_buff[i];
-        dtb_prop* compat = dtb_find_prop(node, "compatible");
-        if (compat == NULL)
+        struct dtb_chunk* chunk = state->chunks;
+        state->chunks = chunk->prev;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+        if ((uint8_t*)chunk >= big_buff && (uint8_t*)chunk < big_buff + SMOLDTB_STATIC_BUFFER_SIZE)
             continue;
-
-        for (uint32_t ci = 0; ; ci++)
+#endif
+        if (state->ops.free == NULL)
         {
-            const char* compat_str = dtb_read_prop_string(compat, ci);
-            if (compat_str == NULL)
-                break;
-            if (strings_eq(compat_str, str))
-                return node;
+            if (state->ops.on_error)
+                state->ops.on_error("ops.free() is NULL while trying to free buffers.");
+            break;
         }
+        state->ops.free(chunk, sizeof(struct dtb_chunk) + chunk->size);
     }
 
-    return NULL;
-} 
-
-dtb_node* dtb_find_phandle(uint32_t handle)
-{
-    if (handle < state.node_alloc_max)
-        return state.handle_lookup[handle];
-    return NULL; //TODO: would it be nicer to just search the tree in this case?
+    state->chunks = NULL;
+    state->added_names = state->last_added_name = NULL;
+    state->added_strings_size = 0;
 }
 
-static dtb_node* find_child_internal(dtb_node* start, const char* name, uint32_t name_bounds)
+/* Returns `size` bytes of zeroed space, starting a new chunk if the current one is too full. */
+static void* chunk_alloc(struct dtb_state* state, uint32_t size)
 {
-    dtb_node* scan = start->child;
-    while (scan != NULL)
+    size = dtb_align_up(size, sizeof(void*));
+    struct dtb_chunk* chunk = state->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size)
     {
-        uint32_t child_name_len = string_find_char(scan->name, '@');
-        if (child_name_len == ~0u)
-            child_name_len = string_len(scan->name);
-
-        if (child_name_len == name_bounds && strings_eq_bounded(scan->name, name, name_bounds))
-            return scan;
-
-        scan = scan->sibling;
+        if (state->ops.malloc == NULL)
+        {
+            if (state->ops.on_error)
+                state->ops.on_error("ops.malloc is NULL");
+            return NULL;
+        }
+        const uint32_t chunk_size = size > SMOLDTB_CHUNK_SIZE ? size : SMOLDTB_CHUNK_SIZE;
+        chunk = state->ops.malloc(sizeof(struct dtb_chunk) + chunk_size);
+        if (chunk == NULL)
+        {
+            if (state->ops.on_error)
+                state->ops.on_error("ops.malloc() failed to allocate buffers.");
+            return NULL;
+        }
+        chunk->prev = state->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        state->chunks = chunk;
     }
 
-    return NULL;
+    uint8_t* space = (uint8_t*)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    for (uint32_t i = 0; i < size; i++)
+        space[i] = 0;
+    return space;
 }
 
-dtb_node* dtb_find(const char* name)
+#ifdef SMOLDTB_LAZY_PARSE
+static void free_buffers(struct dtb_state* state)
 {
-    uint32_t seg_len;
-    dtb_node* scan = state.root;
+    free_chunks(state);
+    state->buffer = NULL;
+}
+#else
+static void free_buffers(struct dtb_state* state)
+{
+    free_chunks(state);
+    if (state->buffer == NULL)
+        return;
+    if (state->index != NULL)
+    {
+        state->index = NULL;
+        state->buffer = NULL;
+        return;
+    }
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    if (state->buffer == big_buff)
+    {
+        state->buffer = NULL;
+        return;
+    }
+#endif
+    if (state->ops.free == NULL)
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("ops.free() is NULL while trying to free buffers.");
+        return;
+    }
+
+    state->ops.free(state->buffer, state->buffer_size);
+    state->buffer = NULL;
+    state->buffer_size = 0;
+}
+#endif
+
+/* Returns the offset of a name within the strings block, or `DTB_ATOM_INVALID` if it isn't
+ * there. Names are matched anywhere, not just at the start of a string, as dtc will
+ * store "phandle" as the tail of "linux,phandle" for example. If the name appears more than
+ * once the returned offset is marked as `ATOM_AMBIGUOUS`.
+ */
+static dtb_atom intern_string(struct dtb_state* state, const char* name)
+{
+    const uint32_t name_len = string_len(name);
+    dtb_atom atom = DTB_ATOM_INVALID;
+    for (uint32_t i = 0; i + name_len < state->strings_size; i++)
+    {
+        if (state->strings[i] != name[0] || state->strings[i + name_len] != 0)
+            continue;
+        if (!strings_eq(state->strings + i, name))
+            continue;
+
+        if (atom != DTB_ATOM_INVALID)
+            return atom | ATOM_AMBIGUOUS;
+        atom = i;
+    }
+
+    return atom;
+}
+
+/* Returns whether a name points into the blob's strings block, rather than being one added by
+ * `dtb_set_prop()` in the instance's chunks. The addresses are compared in full, as a chunk can
+ * be anywhere relative to the blob.
+ */
+static inline bool name_in_strings(struct dtb_state* state, const char* name)
+{
+    return (uintptr_t)name - (uintptr_t)state->strings < state->strings_size;
+}
+
+/* Returns whether a property's name offset (within the strings block) refers to an atom */
+static inline bool atom_matches(struct dtb_state* state, dtb_atom atom, uint32_t name_offset)
+{
+    if (atom == name_offset)
+        return true;
+    if ((atom & ATOM_AMBIGUOUS) == 0 || atom == DTB_ATOM_INVALID)
+        return false;
+    return strings_eq(state->strings + name_offset, state->strings + (atom & ~ATOM_AMBIGUOUS));
+}
+
+static inline bool prop_is_atom(struct dtb_state* state, const dtb_prop* prop, dtb_atom atom)
+{
+    //names added by `dtb_set_prop()` can be outside the strings block, but never match an atom.
+    return name_in_strings(state, prop->name) && atom_matches(state, atom, (uint32_t)(prop->name - state->strings));
+}
+
+/* Returns the special property table slot holding a name offset, or the empty slot where it
+ * would go.
+ */
+static inline uint32_t special_hash(uint32_t name_offset)
+{
+    return (name_offset * 2654435761u) >> (32 - SPECIAL_SLOT_BITS);
+}
+
+static inline struct dtb_special_slot* special_slot(struct dtb_state* state, uint32_t name_offset)
+{
+    uint32_t i = special_hash(name_offset);
+    while (state->special_slots[i].atom != DTB_ATOM_INVALID
+        && (state->special_slots[i].atom & ~ATOM_AMBIGUOUS) != name_offset)
+        i = (i + 1) & (SPECIAL_SLOT_COUNT - 1);
+    return &state->special_slots[i];
+}
+
+/* Returns the special property table slot for a name offset, or NULL if the name isn't in it. */
+static inline const struct dtb_special_slot* find_special(struct dtb_state* state, uint32_t name_offset)
+{
+    //most properties aren't special, so they're filtered out before probing the table.
+    if (!state->special_ambiguous && ((state->special_filter >> special_hash(name_offset)) & 1) == 0)
+        return NULL;
+    const struct dtb_special_slot* slot = special_slot(state, name_offset);
+    if (slot->atom != DTB_ATOM_INVALID)
+        return slot;
+    if (!state->special_ambiguous)
+        return NULL;
+
+    //a name stored more than once can be used through any of its copies.
+    for (uint32_t i = 0; i < SPECIAL_SLOT_COUNT; i++)
+    {
+        slot = &state->special_slots[i];
+        if ((slot->atom & ATOM_AMBIGUOUS) != 0 && atom_matches(state, slot->atom, name_offset))
+            return slot;
+    }
+    return NULL;
+}
+
+static void add_special(struct dtb_state* state, dtb_atom atom, uint8_t kind, uint32_t hooks)
+{
+    if (atom == DTB_ATOM_INVALID)
+        return; //no property in the blob has this name.
+
+    struct dtb_special_slot* slot = special_slot(state, atom & ~ATOM_AMBIGUOUS);
+    slot->atom = atom;
+    if (kind != SPECIAL_NONE)
+        slot->kind = kind;
+    slot->hooks |= hooks;
+    state->special_filter |= (uint64_t)1 << special_hash(atom & ~ATOM_AMBIGUOUS);
+    if (atom & ATOM_AMBIGUOUS)
+        state->special_ambiguous = true;
+}
+
+/* Interns the names the parser looks for, and fills in the special property table from them
+ * and `ops.prop_hooks`.
+ */
+static void intern_special_atoms(struct dtb_state* state)
+{
+    state->atoms.phandle = intern_string(state, "phandle");
+    state->atoms.linux_phandle = intern_string(state, "linux,phandle");
+    state->atoms.addr_cells = intern_string(state, "#address-cells");
+    state->atoms.size_cells = intern_string(state, "#size-cells");
+    state->atoms.compatible = intern_string(state, "compatible");
+#if defined(SMOLDTB_STATUS_INFO) || defined(SMOLDTB_PRUNE_DISABLED)
+    state->atoms.status = intern_string(state, "status");
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->atoms.interrupt_cells = intern_string(state, "#interrupt-cells");
+    state->atoms.interrupt_map = intern_string(state, "interrupt-map");
+#endif
+
+    for (uint32_t i = 0; i < SPECIAL_SLOT_COUNT; i++)
+    {
+        state->special_slots[i].atom = DTB_ATOM_INVALID;
+        state->special_slots[i].kind = SPECIAL_NONE;
+        state->special_slots[i].hooks = 0;
+    }
+    state->special_filter = 0;
+    state->special_ambiguous = false;
+    add_special(state, state->atoms.phandle, SPECIAL_PHANDLE, 0);
+    add_special(state, state->atoms.linux_phandle, SPECIAL_PHANDLE, 0);
+    add_special(state, state->atoms.addr_cells, SPECIAL_ADDR_CELLS, 0);
+    add_special(state, state->atoms.size_cells, SPECIAL_SIZE_CELLS, 0);
+    add_special(state, state->atoms.compatible, SPECIAL_COMPATIBLE, 0);
+#if defined(SMOLDTB_STATUS_INFO) || defined(SMOLDTB_PRUNE_DISABLED)
+    add_special(state, state->atoms.status, SPECIAL_STATUS, 0);
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    add_special(state, state->atoms.interrupt_cells, SPECIAL_INTERRUPT_CELLS, 0);
+    add_special(state, state->atoms.interrupt_map, SPECIAL_INTERRUPT_MAP, 0);
+#endif
+
+    state->prop_hooks = state->ops.prop_hooks;
+    const uint32_t hook_count = state->ops.prop_hooks == NULL ? 0 : state->ops.prop_hook_count;
+    if (hook_count > SMOLDTB_MAX_PROP_HOOKS && state->ops.on_error)
+        state->ops.on_error("More property hooks than SMOLDTB_MAX_PROP_HOOKS, the extra ones are ignored");
+    for (uint32_t i = 0; i < hook_count && i < SMOLDTB_MAX_PROP_HOOKS; i++)
+    {
+        if (state->prop_hooks[i].name != NULL && state->prop_hooks[i].func != NULL)
+            add_special(state, intern_string(state, state->prop_hooks[i].name), SPECIAL_NONE, 1u << i);
+    }
+}
+
+#ifdef SMOLDTB_COMPAT_INDEX
+/* Counts the strings in a string-list property value that `next_list_string()` returns */
+static uint32_t count_prop_strings(const char* value, uint32_t length)
+{
+    uint32_t count = 0;
+    uint32_t offset = 0;
+    while (next_list_string(value, length, &offset) != NULL)
+        count++;
+    return count;
+}
+#endif
+
+/* The message passed to `ops.on_error()` for each `dtb_error`. */
+static const char* const error_messages[] =
+{
+    [DTB_OK] = "No error.",
+    [DTB_ERR_MAGIC] = "FDT has incorrect magic number.",
+    [DTB_ERR_VERSION] = "FDT version isn't supported.",
+    [DTB_ERR_TRUNCATED] = "FDT total size doesn't fit its header or buffer.",
+    [DTB_ERR_LAYOUT] = "FDT header has a block outside of the blob.",
+    [DTB_ERR_STRINGS] = "FDT strings block isn't terminated.",
+    [DTB_ERR_BAD_TOKEN] = "Unknown token in the structure block.",
+    [DTB_ERR_BAD_NAME] = "Node name runs past the end of the structure block.",
+    [DTB_ERR_BAD_PROP] = "Property runs past the structure block, or its name is outside the strings block.",
+    [DTB_ERR_STRUCTURE] = "Nodes in the structure block aren't nested properly.",
+    [DTB_ERR_NO_MEMORY] = "Couldn't allocate memory for the parser.",
+    [DTB_ERR_INDEX] = "Index doesn't match the blob, or was written by a different build.",
+    [DTB_ERR_TOO_LARGE] = "FDT has too many nodes or properties for the parser's arena.",
+};
+
+/* Records why parsing failed and reports it, returns false so callers can pass the result on. */
+static bool report_error(struct dtb_state* state, dtb_error error)
+{
+    state->error = error;
+    if (state->ops.on_error)
+        state->ops.on_error(error_messages[error]);
+    return false;
+}
+
+#ifdef SMOLDTB_INTERRUPT_INFO
+/* Reserves space for a node's 'interrupt-map' entries. The size of an entry depends on the
+ * parent it refers to, which isn't known yet, so this reserves the most entries the map could
+ * have: each one has at least the child unit address, the child specifier and a phandle.
+ */
+static void reserve_imap_entries(struct dtb_state* state, uint32_t* imap_cells, uint32_t addr_cells, uint32_t int_cells)
+{
+    //the cell counts come from the blob, so the entry size is worked out in 64 bits to never be 0.
+    if (*imap_cells > 0)
+        state->imap_alloc_max += (uint32_t)(*imap_cells / ((uint64_t)addr_cells + (int_cells ? int_cells : 1) + 1));
+    *imap_cells = 0;
+}
+#endif
+
+/* Records a split in the plan: how much of each buffer is used by everything before `offset`. */
+static void add_split(struct dtb_state* state, struct dtb_split_plan* plan, uint32_t offset,
+    uint32_t node_count, uint32_t prop_count)
+{
+    struct dtb_split* split = &plan->splits[plan->count++];
+    split->offset = offset;
+    split->node_count = node_count;
+    split->prop_count = prop_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    split->compat_count = state->compat_alloc_max;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    split->child_entry_count = state->child_entry_alloc_max;
+#endif
+    (void)state;
+}
+
+/* Returns true if a 'status' property says its node is available. */
+static bool status_is_okay(dtb_prop* status)
+{
+    uint32_t offset = 0;
+    const char* value = next_list_string((const char*)status->first_cell, status->length, &offset);
+    return value != NULL && (strings_eq(value, "okay") || strings_eq(value, "ok"));
+}
+
+#ifdef SMOLDTB_PRUNE_DISABLED
+/* Returns true if the node whose BEGIN_NODE token is at `offset` has a 'status' other than
+ * "okay", so neither it nor anything inside it is created. This runs before the node's
+ * properties have been validated, so each one is checked before it's read.
+ */
+static bool node_is_pruned(struct dtb_state* state, uint32_t offset)
+{
+    const uint32_t name_space = (state->cell_count - offset - 1) * FDT_CELL_SIZE;
+    const uint32_t name_len = string_len_bounded((const char*)(state->cells + offset + 1), name_space);
+    if (name_len == name_space)
+        return false;
+
+    uint32_t i = offset + (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+    while (i + 2 < state->cell_count)
+    {
+        const uint32_t token = be32(state->cells[i]);
+        if (token == FDT_NOP)
+        {
+            i++;
+            continue;
+        }
+        if (token != FDT_PROP)
+            return false; //the properties come first, so there's no 'status' after this.
+
+        const uint32_t name_offset = be32(state->cells[i + 2]);
+        if (be32(state->cells[i + 1]) > (state->cell_count - i - 3) * FDT_CELL_SIZE || name_offset >= state->strings_size)
+            return false;
+        const struct dtb_special_slot* special = find_special(state, name_offset);
+        dtb_prop prop;
+        i = read_prop(state->cells, state->strings, i, &prop);
+        if (special != NULL && special->kind == SPECIAL_STATUS)
+            return !status_is_okay(&prop);
+    }
+    return false;
+}
+#endif
+
+/* Walks the tokens of the structure block and counts the nodes and properties that
+ * `parse_node()` will produce, so the buffers can be sized exactly. Node names and property
+ * payloads are skipped rather than inspected, this means only the token cells are read and
+ * payload data that happens to look like a token isn't counted. Phandle properties are also
+ * counted, since they determine the size of the phandle table.
+ * This is also where the structure block is validated: every name and property must fit in
+ * the block and nodes must be nested properly, so the parser can trust the tokens afterwards.
+ * If `plan` isn't NULL this also splits the children of the first root node into groups of at
+ * least `plan->min_cells`, with a final split at the end of the root. With
+ * `SMOLDTB_PRUNE_DISABLED` disabled subtrees are still validated, but nothing in them is counted.
+ */
+static dtb_error count_tokens(struct dtb_state* state, uint32_t* node_count, uint32_t* prop_count, uint32_t* handle_count,
+    struct dtb_split_plan* plan)
+{
+    *node_count = 0;
+    *prop_count = 0;
+    *handle_count = 0;
+
+    uint32_t depth = 0;
+    uint32_t root_count = 0;
+#ifdef SMOLDTB_PRUNE_DISABLED
+    uint32_t pruned_depth = 0; //the depth inside the outermost disabled node, or 0.
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    uint32_t child_counts[CHILD_INDEX_MAX_DEPTH];
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    //a node's properties come before its children, so its 'interrupt-map' can be sized when
+    //its first child or its end is reached.
+    uint32_t imap_cells = 0;
+    uint32_t imap_addr_cells = 0;
+    uint32_t imap_int_cells = 0;
+#endif
+
+    uint32_t i = 0;
+    while (i < state->cell_count)
+    {
+        const uint32_t token = be32(state->cells[i]);
+        if (token == FDT_BEGIN_NODE)
+        {
+            if (depth == 0)
+                root_count++;
+            else if (plan != NULL && depth == 1 && root_count == 1 && plan->count + 1 < plan->max_count
+                && (plan->count == 0 || i - plan->splits[plan->count - 1].offset >= plan->min_cells))
+                add_split(state, plan, i, *node_count, *prop_count);
+
+            const uint32_t name_space = (state->cell_count - i - 1) * FDT_CELL_SIZE;
+            const uint32_t name_len = string_len_bounded((const char*)(state->cells + i + 1), name_space);
+            if (name_len == name_space)
+                return DTB_ERR_BAD_NAME;
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (pruned_depth == 0 && depth > 0 && node_is_pruned(state, i))
+                pruned_depth = depth + 1;
+            if (pruned_depth != 0)
+            {
+                i += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+                depth++;
+                continue;
+            }
+#endif
+            i += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+            (*node_count)++;
+#ifdef SMOLDTB_INTERRUPT_INFO
+            reserve_imap_entries(state, &imap_cells, imap_addr_cells, imap_int_cells);
+            imap_addr_cells = imap_int_cells = 0;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+            if (depth > 0 && depth <= CHILD_INDEX_MAX_DEPTH)
+                child_counts[depth - 1]++;
+            if (depth < CHILD_INDEX_MAX_DEPTH)
+                child_counts[depth] = 0;
+#endif
+            depth++;
+        }
+        else if (token == FDT_END_NODE)
+        {
+            i++;
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (pruned_depth != 0)
+            {
+                if (--depth < pruned_depth)
+                    pruned_depth = 0;
+                continue;
+            }
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+            reserve_imap_entries(state, &imap_cells, imap_addr_cells, imap_int_cells);
+#endif
+            if (depth == 0)
+                return DTB_ERR_STRUCTURE;
+            depth--;
+            if (plan != NULL && depth == 0 && root_count == 1 && plan->count > 0)
+                add_split(state, plan, i - 1, *node_count, *prop_count);
+#ifdef SMOLDTB_CHILD_INDEX
+            if (depth < CHILD_INDEX_MAX_DEPTH && child_counts[depth] >= SMOLDTB_CHILD_INDEX_MIN)
+                state->child_entry_alloc_max += child_counts[depth];
+#endif
+        }
+        else if (token == FDT_PROP)
+        {
+            if (depth == 0)
+                return DTB_ERR_STRUCTURE;
+            if (i + 2 >= state->cell_count)
+                return DTB_ERR_BAD_PROP;
+            const struct fdt_property* fdtprop = (const struct fdt_property*)(state->cells + i + 1);
+            const uint32_t name_offset = be32(fdtprop->name_offset);
+            if (be32(fdtprop->length) > (state->cell_count - i - 3) * FDT_CELL_SIZE || name_offset >= state->strings_size)
+                return DTB_ERR_BAD_PROP;
+            i += (dtb_align_up(be32(fdtprop->length), FDT_CELL_SIZE) / FDT_CELL_SIZE) + 3;
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (pruned_depth != 0)
+                continue;
+#endif
+            (*prop_count)++;
+            const struct dtb_special_slot* special = find_special(state, name_offset);
+            const uint32_t kind = special != NULL ? special->kind : SPECIAL_NONE;
+            if (kind == SPECIAL_PHANDLE)
+                (*handle_count)++;
+#ifdef SMOLDTB_COMPAT_INDEX
+            else if (kind == SPECIAL_COMPATIBLE)
+                state->compat_alloc_max += count_prop_strings((const char*)(fdtprop + 1), be32(fdtprop->length));
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+            const uint32_t value = be32(fdtprop->length) >= FDT_CELL_SIZE ? be32(*(const uint32_t*)(fdtprop + 1)) : 0;
+            if (kind == SPECIAL_INTERRUPT_MAP)
+                imap_cells = be32(fdtprop->length) / FDT_CELL_SIZE;
+            else if (kind == SPECIAL_ADDR_CELLS)
+                imap_addr_cells = value;
+            else if (kind == SPECIAL_INTERRUPT_CELLS)
+                imap_int_cells = value;
+#endif
+        }
+        else if (token == FDT_END)
+            return depth == 0 ? DTB_OK : DTB_ERR_STRUCTURE;
+        else if (token == FDT_NOP)
+            i++;
+        else
+            return DTB_ERR_BAD_TOKEN;
+    }
+
+    return DTB_ERR_STRUCTURE;
+}
+
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+/* Makes the static buffer from `offset` onwards the default instance's first chunk. */
+static void use_static_chunk(struct dtb_state* state, uint32_t offset)
+{
+    if (offset >= SMOLDTB_STATIC_BUFFER_SIZE || SMOLDTB_STATIC_BUFFER_SIZE - offset <= sizeof(struct dtb_chunk))
+        return;
+    state->chunks = (struct dtb_chunk*)(big_buff + offset);
+    state->chunks->prev = NULL;
+    state->chunks->size = SMOLDTB_STATIC_BUFFER_SIZE - offset - sizeof(struct dtb_chunk);
+    state->chunks->used = 0;
+}
+#endif
+
+#ifdef SMOLDTB_LAZY_PARSE
+/* Nothing is counted or allocated up front in lazy mode, except that the default instance
+ * uses the static buffer (if there is one) as its only chunk.
+ */
+static bool alloc_buffers(struct dtb_state* state, struct dtb_split_plan* plan)
+{
+    (void)plan;
+    state->handle_slot_count = 0;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    if (state == &default_state)
+        use_static_chunk(state, 0);
+#endif
+    return true;
+}
+#else
+/* Allocates the arena for the counts in `state` and divides it between the nodes, properties,
+ * phandle table and any indexes. When restoring an index `buffer` is the arena stored in it,
+ * which is used as it is rather than allocating a new one, and is laid out the same way.
+ */
+static bool alloc_arena(struct dtb_state* state, uint8_t* buffer)
+{
+    /* A large enough blob of tiny nodes or 'interrupt-map' entries has counts that wrap a 32-bit
+     * size around, so the size is added up in 64 bits: each term is a 32-bit count times a struct
+     * of well under 256 bytes, so the sum can't overflow. Anything that doesn't fit the 32-bit
+     * sizes used for allocations is rejected.
+     */
+    uint64_t arena_size = (uint64_t)state->node_alloc_max * sizeof(dtb_node);
+    arena_size += (uint64_t)state->prop_alloc_max * sizeof(dtb_prop);
+    arena_size += (uint64_t)state->handle_slot_count * sizeof(struct dtb_phandle_slot);
+#ifdef SMOLDTB_COMPAT_INDEX
+    uint64_t compat_bucket_count = state->compat_alloc_max > 0 ? 1 : 0;
+    while (compat_bucket_count < state->compat_alloc_max)
+        compat_bucket_count <<= 1;
+    arena_size += (uint64_t)state->compat_alloc_max * sizeof(struct dtb_compat_entry);
+    arena_size += compat_bucket_count * sizeof(void*);
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    arena_size = (arena_size + sizeof(void*) - 1) & ~(uint64_t)(sizeof(void*) - 1);
+    const uint64_t child_entry_offset = arena_size;
+    arena_size += (uint64_t)state->child_entry_alloc_max * sizeof(struct dtb_child_entry);
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    arena_size = (arena_size + sizeof(void*) - 1) & ~(uint64_t)(sizeof(void*) - 1);
+    const uint64_t imap_offset = arena_size;
+    arena_size += (uint64_t)state->imap_alloc_max * sizeof(struct dtb_imap_entry);
+#endif
+    if (arena_size > UINT32_MAX)
+        return report_error(state, DTB_ERR_TOO_LARGE);
+    const uint32_t total_size = (uint32_t)arena_size;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_bucket_count = (uint32_t)compat_bucket_count;
+#endif
+
+    if (buffer == NULL)
+    {
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+        if (state == &default_state)
+        {
+            if (total_size > SMOLDTB_STATIC_BUFFER_SIZE)
+            {
+                state->error = DTB_ERR_NO_MEMORY;
+                if (state->ops.on_error)
+                    state->ops.on_error("Too much data for statically allocated buffer.");
+                return false;
+            }
+            buffer = big_buff;
+            //whatever the tree doesn't use is the first chunk, for anything allocated after parsing.
+            use_static_chunk(state, dtb_align_up(total_size, sizeof(void*)));
+        }
+        else
+#endif
+        {
+            buffer = state->ops.malloc(total_size);
+            if (buffer == NULL)
+            {
+                state->error = DTB_ERR_NO_MEMORY;
+                if (state->ops.on_error)
+                    state->ops.on_error("ops.malloc() failed to allocate buffers.");
+                return false;
+            }
+        }
+
+        for (uint32_t i = 0; i < total_size; i++)
+            buffer[i] = 0;
+    }
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    else if (state == &default_state)
+        use_static_chunk(state, 0);
+#endif
+
+    state->buffer = buffer;
+    state->buffer_size = total_size;
+    state->node_buff = (dtb_node*)buffer;
+    state->node_alloc_head = 0;
+    state->prop_buff = (dtb_prop*)&state->node_buff[state->node_alloc_max];
+    state->prop_alloc_head = 0;
+    state->handle_lookup = (struct dtb_phandle_slot*)&state->prop_buff[state->prop_alloc_max];
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_buff = (struct dtb_compat_entry*)&state->handle_lookup[state->handle_slot_count];
+    state->compat_alloc_head = 0;
+    state->compat_buckets = (struct dtb_compat_entry**)&state->compat_buff[state->compat_alloc_max];
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_buff = (struct dtb_child_entry*)(buffer + child_entry_offset);
+    state->child_entry_alloc_head = 0;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->imap_buff = (struct dtb_imap_entry*)(buffer + imap_offset);
+    state->imap_alloc_head = 0;
+#endif
+    return true;
+}
+
+static bool alloc_buffers(struct dtb_state* state, struct dtb_split_plan* plan)
+{
+    uint32_t handle_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_alloc_max = 0;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_max = 0;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->imap_alloc_max = 0;
+#endif
+    const dtb_error error = count_tokens(state, &state->node_alloc_max, &state->prop_alloc_max, &handle_count, plan);
+    if (error != DTB_OK)
+        return report_error(state, error);
+
+    //keep the phandle table at most half full, so probe sequences stay short.
+    state->handle_slot_count = 0;
+    if (handle_count > 0)
+    {
+        state->handle_slot_count = 1;
+        while (state->handle_slot_count < handle_count * 2)
+            state->handle_slot_count <<= 1;
+    }
+    return alloc_arena(state, NULL);
+}
+#endif
+
+#ifndef SMOLDTB_LAZY_PARSE
+/* Multiplicative (fibonacci) hashing, phandles are often small sequential integers so the
+ * low bits alone would cluster badly.
+ */
+static uint32_t hash_phandle(uint32_t handle)
+{
+    return handle * 0x9E3779B1u;
+}
+
+/* Returns the slot for a phandle: either the slot holding it or the empty slot it would be
+ * inserted into. Returns NULL if the table is empty or is full without containing the handle.
+ */
+static struct dtb_phandle_slot* find_phandle_slot(struct dtb_state* state, uint32_t handle)
+{
+    const uint32_t mask = state->handle_slot_count - 1;
+    uint32_t index = hash_phandle(handle) & mask;
+    for (uint32_t i = 0; i < state->handle_slot_count; i++)
+    {
+        struct dtb_phandle_slot* slot = &state->handle_lookup[index];
+        if (slot->handle == handle || slot->handle == 0)
+            return slot;
+        index = (index + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/* Workers parsing parts of the same tree (see `parse_split_root()`) share the table: a slot is
+ * claimed by swapping the handle into it, and if a handle appears more than once the node that's
+ * earliest in the tree is kept, the same as when the tree is parsed in one go.
+ */
+static bool insert_shared_phandle(struct dtb_state* state, uint32_t handle, dtb_node* node)
+{
+    const uint32_t mask = state->handle_slot_count - 1;
+    uint32_t index = hash_phandle(handle) & mask;
+    for (uint32_t i = 0; i < state->handle_slot_count; i++)
+    {
+        struct dtb_phandle_slot* slot = &state->handle_lookup[index];
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&slot->handle, &expected, handle, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+            || expected == handle)
+        {
+            dtb_node* current = __atomic_load_n(&slot->node, __ATOMIC_RELAXED);
+            while ((current == NULL || current > node)
+                && !__atomic_compare_exchange_n(&slot->node, &current, node, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+            if (current != NULL && current != node)
+                state->phandle_duplicates = true;
+            return true;
+        }
+        index = (index + 1) & mask;
+    }
+
+    return false;
+}
+
+static void insert_phandle(struct dtb_state* state, uint32_t handle, dtb_node* node)
+{
+    if (handle == 0 || handle == ~0u)
+        return; //reserved values, a node can't be referenced by these
+
+    if (state->shared_tables)
+    {
+        if (!insert_shared_phandle(state, handle, node) && state->ops.on_error)
+            state->ops.on_error("Phandle table ran out of space");
+        return;
+    }
+
+    struct dtb_phandle_slot* slot = find_phandle_slot(state, handle);
+    if (slot == NULL)
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Phandle table ran out of space");
+        return;
+    }
+    //nodes are inserted in tree order, the first one with a handle keeps it like in a tree walk.
+    if (slot->handle == handle)
+    {
+        if (slot->node != node)
+            state->phandle_duplicates = true;
+        return;
+    }
+    slot->handle = handle;
+    slot->node = node;
+}
+
+/* The table starts out in the arena, and only moves to the chunks if an edit makes it grow. */
+static bool phandle_table_in_arena(const struct dtb_state* state)
+{
+    return (uintptr_t)state->handle_lookup - (uintptr_t)state->buffer <= state->buffer_size;
+}
+
+/* Empties a slot in the phandle table. Probing is linear, so any entries after it in the same
+ * run that would have been placed in it are moved back, and lookups still find them.
+ */
+static void remove_phandle_slot(struct dtb_state* state, struct dtb_phandle_slot* slot)
+{
+    const uint32_t mask = state->handle_slot_count - 1;
+    uint32_t hole = (uint32_t)(slot - state->handle_lookup);
+    for (uint32_t index = (hole + 1) & mask; state->handle_lookup[index].handle != 0; index = (index + 1) & mask)
+    {
+        //the entry can fill the hole if the hole is between its home slot and where it is now.
+        const uint32_t home = hash_phandle(state->handle_lookup[index].handle) & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask))
+        {
+            state->handle_lookup[hole] = state->handle_lookup[index];
+            hole = index;
+        }
+    }
+
+    state->handle_lookup[hole].handle = 0;
+    state->handle_lookup[hole].node = NULL;
+    state->handle_slots_used--;
+}
+
+/* Moves the phandle table into one twice the size (taken from the chunks), so it can stay at
+ * most half full as phandles are added by edits.
+ */
+static bool grow_phandle_table(struct dtb_state* state)
+{
+    const struct dtb_phandle_slot* old_slots = state->handle_lookup;
+    const uint32_t old_count = state->handle_slot_count;
+    const uint32_t count = old_count > 0 ? old_count * 2 : 16;
+    if (count > UINT32_MAX / sizeof(struct dtb_phandle_slot))
+        return false;
+    struct dtb_phandle_slot* slots = chunk_alloc(state, count * sizeof(struct dtb_phandle_slot));
+    if (slots == NULL)
+        return false;
+
+    state->handle_lookup = slots;
+    state->handle_slot_count = count;
+    for (uint32_t i = 0; i < old_count; i++)
+    {
+        if (old_slots[i].handle != 0)
+            *find_phandle_slot(state, old_slots[i].handle) = old_slots[i];
+    }
+    return true;
+}
+#endif
+
+#ifdef SMOLDTB_COMPAT_INDEX
+/* Adds an entry to the compatible index for each string in a 'compatible' property. The
+ * entries are only linked into their buckets once parsing is done, see `link_compat_index(state)`.
+ */
+static void add_compat_entries(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    //only a node's first 'compatible' counts, like with `dtb_find_prop()`.
+    for (dtb_prop* earlier = node->props; earlier != NULL && earlier < prop; earlier++)
+    {
+        if (strings_eq(earlier->name, "compatible"))
+            return;
+    }
+
+    uint32_t offset = 0;
+    const char* str;
+    while ((str = next_list_string((const char*)prop->first_cell, prop->length, &offset)) != NULL)
+    {
+        //a string listed twice would make `dtb_find_compatible()` return the node twice.
+        dtb_prop before = *prop;
+        before.length = (uint32_t)(str - (const char*)prop->first_cell);
+        if (list_has_string(&before, str))
+            continue;
+        if (state->compat_alloc_head == state->compat_alloc_max)
+        {
+            if (state->ops.on_error)
+                state->ops.on_error("Compatible index ran out of space");
+            return;
+        }
+
+        struct dtb_compat_entry* entry = &state->compat_buff[state->compat_alloc_head++];
+        entry->str = str;
+        entry->node = node;
+        entry->hash = string_hash(entry->str);
+    }
+}
+
+/* Returns the link in a bucket's list of distinct strings that points to `str`, or the
+ * link at the end of the list if the string isn't present.
+ */
+static struct dtb_compat_entry** find_compat_str(struct dtb_state* state, const char* str, uint32_t hash)
+{
+    struct dtb_compat_entry** link = &state->compat_buckets[hash & (state->compat_bucket_count - 1)];
+    while (*link != NULL)
+    {
+        if ((*link)->hash == hash && strings_eq((*link)->str, str))
+            return link;
+        link = &(*link)->next_str;
+    }
+    return link;
+}
+
+/* Nodes are allocated in tree order, and so are the entries. Linking them in reverse order
+ * (always pushing to the front of a string's chain) leaves each chain sorted by node, which
+ * `dtb_find_compatible()` relies on.
+ */
+static void link_compat_index(struct dtb_state* state)
+{
+    for (uint32_t i = state->compat_alloc_head; i > 0; i--)
+    {
+        struct dtb_compat_entry* entry = &state->compat_buff[i - 1];
+        struct dtb_compat_entry** link = find_compat_str(state, entry->str, entry->hash);
+        entry->next_match = *link;
+        entry->next_str = *link ? (*link)->next_str : NULL;
+        *link = entry;
+    }
+}
+
+/* Finds the index entry placing `node` in the chain for `str`, if `node` has that compatible
+ * string. Entries are sorted by node, so this is a binary search. Only the entries made while
+ * parsing are searched, and ones removed by edits have no string.
+ */
+static struct dtb_compat_entry* find_compat_entry(struct dtb_state* state, dtb_node* node, const char* str, uint32_t hash)
+{
+    uint32_t low = 0;
+    uint32_t high = state->compat_alloc_head;
+    while (low < high)
+    {
+        const uint32_t mid = low + (high - low) / 2;
+        if (state->compat_buff[mid].node < node)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (uint32_t i = low; i < state->compat_alloc_head && state->compat_buff[i].node == node; i++)
+    {
+        struct dtb_compat_entry* entry = &state->compat_buff[i];
+        if (entry->str != NULL && entry->hash == hash && strings_eq(entry->str, str))
+            return entry;
+    }
+    return NULL;
+}
+
+static uint32_t node_depth(const dtb_node* node)
+{
+    uint32_t depth = 0;
+    for (; node->parent != NULL; node = node->parent)
+        depth++;
+    return depth;
+}
+
+/* Returns whether node `a` comes before node `b` in the tree. Parsed nodes are allocated in tree
+ * order so they're compared by address, nodes added by edits are placed by going up from both
+ * until they share a parent, then checking which comes first in its list of children.
+ */
+static bool node_before(struct dtb_state* state, const dtb_node* a, const dtb_node* b)
+{
+    const dtb_node* parsed_end = state->node_buff + state->node_alloc_head;
+    if (a >= state->node_buff && a < parsed_end && b >= state->node_buff && b < parsed_end)
+        return a < b;
+    if (a == b)
+        return false;
+
+    uint32_t a_depth = node_depth(a);
+    uint32_t b_depth = node_depth(b);
+    for (; a_depth > b_depth; a_depth--)
+    {
+        a = a->parent;
+        if (a == b)
+            return false; //b is an ancestor of a
+    }
+    for (; b_depth > a_depth; b_depth--)
+    {
+        b = b->parent;
+        if (b == a)
+            return true; //a is an ancestor of b
+    }
+    while (a->parent != b->parent)
+    {
+        a = a->parent;
+        b = b->parent;
+    }
+    for (const dtb_node* sibling = a->sibling; sibling != NULL; sibling = sibling->sibling)
+    {
+        if (sibling == b)
+            return true;
+    }
+    return false;
+}
+
+/* Takes a node out of the chain for one of its compatible strings, after it's been edited or
+ * removed from the tree.
+ */
+static void unlink_compat_entry(struct dtb_state* state, dtb_node* node, const char* str)
+{
+    struct dtb_compat_entry** head = find_compat_str(state, str, string_hash(str));
+    struct dtb_compat_entry** link = head;
+    while (*link != NULL && (*link)->node != node)
+        link = &(*link)->next_match;
+    struct dtb_compat_entry* entry = *link;
+    if (entry == NULL)
+        return;
+
+    if (link != head)
+        *link = entry->next_match;
+    else if (entry->next_match != NULL)
+    {
+        //the head of a chain is also in its bucket's list of strings, the next entry takes its place.
+        entry->next_match->next_str = entry->next_str;
+        *link = entry->next_match;
+    }
+    else
+        *link = entry->next_str; //that was the last node with the string.
+    entry->str = NULL;
+}
+
+/* Adds a node to the chain for one of its compatible strings, keeping the chain in tree order. */
+static bool link_compat_entry(struct dtb_state* state, dtb_node* node, const char* str)
+{
+    struct dtb_compat_entry* entry = chunk_alloc(state, sizeof(struct dtb_compat_entry));
+    if (entry == NULL)
+        return false;
+    entry->str = str;
+    entry->node = node;
+    entry->hash = string_hash(str);
+
+    struct dtb_compat_entry** head = find_compat_str(state, str, entry->hash);
+    struct dtb_compat_entry** link = head;
+    while (*link != NULL && node_before(state, (*link)->node, node))
+        link = &(*link)->next_match;
+
+    entry->next_match = *link;
+    if (link == head)
+        entry->next_str = *head ? (*head)->next_str : NULL;
+    *link = entry;
+    return true;
+}
+#endif
+
+static void swap_elements(uint8_t* a, uint8_t* b, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+    {
+        const uint8_t temp = a[i];
+        a[i] = b[i];
+        b[i] = temp;
+    }
+}
+
+static void sift_element(uint8_t* base, uint32_t size, uint32_t root, uint32_t count,
+    bool (*less)(const void*, const void*))
+{
+    while (root * 2 + 1 < count)
+    {
+        uint32_t child = root * 2 + 1;
+        if (child + 1 < count && less(base + child * size, base + (child + 1) * size))
+            child++;
+        if (!less(base + root * size, base + child * size))
+            return;
+
+        swap_elements(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+/* Heapsort, since there's no libc to provide qsort() and the arrays being sorted (children of
+ * wide nodes, interrupt-map entries, reserved ranges) can have thousands of elements.
+ */
+static void heap_sort(void* elements, uint32_t count, uint32_t size, bool (*less)(const void*, const void*))
+{
+    uint8_t* base = elements;
+    for (uint32_t i = count / 2; i > 0; i--)
+        sift_element(base, size, i - 1, count, less);
+
+    for (uint32_t end = count; end > 1; end--)
+    {
+        swap_elements(base, base + (end - 1) * size, size);
+        sift_element(base, size, 0, end - 1, less);
+    }
+}
+
+#ifdef SMOLDTB_CHILD_INDEX
+/* Returns the hash of a node's unit name, as used by the child index */
+static uint32_t unit_name_hash(const dtb_node* node)
+{
+#ifdef SMOLDTB_NODE_NAME_INFO
+    return node->name_hash;
+#else
+    uint32_t unit_len = string_find_char(node->name, '@');
+    if (unit_len == ~0u)
+        unit_len = string_len(node->name);
+    return string_hash_bounded(node->name, unit_len);
+#endif
+}
+
+static bool child_entry_less(const void* lhs, const void* rhs)
+{
+    const struct dtb_child_entry* a = lhs;
+    const struct dtb_child_entry* b = rhs;
+    if (a->unit_hash != b->unit_hash)
+        return a->unit_hash < b->unit_hash;
+    if (a->full_hash != b->full_hash)
+        return a->full_hash < b->full_hash;
+    return a->position < b->position;
+}
+
+/* Builds the child index for a node once all of its children have been parsed. If the count
+ * pass couldn't reserve space for this node the index is skipped, and lookups fall back to
+ * walking the sibling list.
+ */
+static void build_child_index(struct dtb_state* state, dtb_node* node)
+{
+    if (node->child_count < SMOLDTB_CHILD_INDEX_MIN)
+        return;
+    if (state->child_entry_alloc_max - state->child_entry_alloc_head < node->child_count)
+        return;
+
+    struct dtb_child_entry* entries = &state->child_entry_buff[state->child_entry_alloc_head];
+    state->child_entry_alloc_head += node->child_count;
+
+    uint32_t position = 0;
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling, position++)
+    {
+        entries[position].unit_hash = unit_name_hash(child);
+        entries[position].full_hash = string_hash(child->name);
+        entries[position].position = position;
+        entries[position].node = child;
+    }
+    heap_sort(entries, node->child_count, sizeof(struct dtb_child_entry), child_entry_less);
+    node->child_index = entries;
+}
+#endif
+
+#ifndef SMOLDTB_LAZY_PARSE
+static void handle_phandle(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    uint32_t handle = 0;
+    read_single_cell(prop, &handle);
+    insert_phandle(state, handle, node);
+    if (handle != ~0u && handle > state->max_phandle)
+        state->max_phandle = handle;
+}
+#endif
+
+static void handle_addr_cells(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    (void)state;
+    uint32_t cells;
+    if (read_single_cell(prop, &cells))
+        node->addr_cells = cells;
+}
+
+static void handle_size_cells(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    (void)state;
+    uint32_t cells;
+    if (read_single_cell(prop, &cells))
+        node->size_cells = cells;
+}
+
+#ifdef SMOLDTB_STATUS_INFO
+static void handle_status(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    (void)state;
+    //only the first 'status' counts, the same one pruning and `dtb_find_prop()` see.
+    for (dtb_prop* earlier = node->props; earlier != NULL && earlier < prop; earlier++)
+    {
+        if (strings_eq(earlier->name, "status"))
+            return;
+    }
+    node->disabled = !status_is_okay(prop);
+}
+#endif
+
+#ifdef SMOLDTB_INTERRUPT_INFO
+static void handle_interrupt_cells(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    (void)state;
+    read_single_cell(prop, &node->interrupt_cells);
+}
+#endif
+
+/* How `check_for_special_prop()` handles each kind of special property. Kinds without a
+ * function are only looked at while counting the tree.
+ */
+static void (* const special_props[SPECIAL_KIND_COUNT])(struct dtb_state* state, dtb_node* node, dtb_prop* prop) =
+{
+#ifndef SMOLDTB_LAZY_PARSE
+    [SPECIAL_PHANDLE] = handle_phandle,
+#endif
+    [SPECIAL_ADDR_CELLS] = handle_addr_cells,
+    [SPECIAL_SIZE_CELLS] = handle_size_cells,
+#ifdef SMOLDTB_COMPAT_INDEX
+    [SPECIAL_COMPATIBLE] = add_compat_entries,
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    [SPECIAL_INTERRUPT_CELLS] = handle_interrupt_cells,
+#endif
+#ifdef SMOLDTB_STATUS_INFO
+    [SPECIAL_STATUS] = handle_status,
+#endif
+};
+
+/* This runs on every new property found, and handles some special cases for us. The
+ * property's name is looked up by its offset in the strings block, so this doesn't need to
+ * touch the strings block, then the parser's own handling and any hooks for it are run.
+ */
+static void check_for_special_prop(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    if (!name_in_strings(state, prop->name))
+        return;
+    const uint32_t name_offset = (uint32_t)(prop->name - state->strings);
+    const struct dtb_special_slot* slot = find_special(state, name_offset);
+    if (slot == NULL)
+        return;
+
+    if (special_props[slot->kind] != NULL)
+        special_props[slot->kind](state, node, prop);
+    for (uint32_t hooks = slot->hooks; hooks != 0; hooks &= hooks - 1)
+    {
+        const dtb_prop_hook* hook = &state->prop_hooks[__builtin_ctz(hooks)];
+        hook->func(node, prop, hook->arg);
+    }
+}
+
+static dtb_prop* parse_prop(struct dtb_state* state, uint32_t* offset)
+{
+    if (be32(state->cells[*offset]) != FDT_PROP)
+        return NULL;
+
+    dtb_prop* prop = alloc_prop(state);
+    dtb_prop skipped;
+    *offset = read_prop(state->cells, state->strings, *offset, prop ? prop : &skipped);
+    return prop;
+}
+
+/* Adds a newly parsed property to its node. */
+static void attach_prop(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    //the spec requires properties to come before child nodes, which keeps them contiguous.
+    if (node->props != NULL && prop != node->props + node->prop_count)
+    {
+        state->prop_alloc_head--;
+        if (state->ops.on_error)
+            state->ops.on_error("Property found after child node, ignoring it.");
+        return;
+    }
+    if (node->prop_count == UINT16_MAX)
+    {
+        state->prop_alloc_head--;
+        if (state->ops.on_error)
+            state->ops.on_error("Node has too many properties, ignoring the rest.");
+        return;
+    }
+
+    if (node->props == NULL)
+        node->props = prop;
+    node->prop_count++;
+    check_for_special_prop(state, node, prop);
+}
+
+/* Adds a child to the end of its parent's list of children, `last_child` tracks the end. */
+static void attach_child(dtb_node* node, dtb_node* child, dtb_node** last_child)
+{
+    if (*last_child)
+        (*last_child)->sibling = child;
+    else
+        node->child = child;
+    *last_child = child;
+    child->parent = node;
+    node->child_count++;
+}
+
+#ifdef SMOLDTB_NODE_NAME_INFO
+static void set_name_info(dtb_node* node, uint32_t name_len)
+{
+    uint32_t unit_len = string_find_char(node->name, '@');
+    if (unit_len == ~0u)
+        unit_len = name_len;
+    node->unit_name_len = unit_len;
+    node->unit_addr_offset = unit_len < name_len ? unit_len + 1 : 0;
+    node->name_hash = string_hash_bounded(node->name, unit_len);
+}
+#endif
+
+/* Allocates a node for the FDT_BEGIN_NODE token at `offset` and moves `offset` past the
+ * node's name, the rest of the node is left for the caller.
+ */
+static dtb_node* parse_node_header(struct dtb_state* state, uint32_t* offset, uint8_t addr_cells, uint8_t size_cells)
+{
+    dtb_node* node = alloc_node(state); 
+    node->name = (const char*)(state->cells + (*offset) + 1);
+    node->addr_cells = addr_cells;
+    node->size_cells = size_cells;
+#ifdef SMOLDTB_LAZY_PARSE
+    node->owner = state;
+    node->offset = *offset;
+#endif
+
+    const uint32_t name_len = string_len(node->name);
+    *offset += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+#ifdef SMOLDTB_NODE_NAME_INFO
+    set_name_info(node, name_len);
+#endif
+    return node;
+}
+
+#ifdef SMOLDTB_LAZY_PARSE
+/* Parses a node's properties and creates its children, without parsing their contents. This
+ * runs the first time anything within the node is accessed. If the node can't be expanded
+ * it's left without properties or children and the error is only reported once.
+ */
+static bool expand_node(struct dtb_state* state, dtb_node* node)
+{
+    node->expanded = 1;
+
+    const uint32_t body = skip_node_name(state->cells, node->offset);
+    uint32_t prop_count = 0;
+    uint32_t child_count = 0;
+    uint32_t i = body;
+    while (i < state->cell_count && be32(state->cells[i]) != FDT_END_NODE)
+    {
+        const uint32_t token = be32(state->cells[i]);
+        if (token == FDT_BEGIN_NODE)
+        {
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (!node_is_pruned(state, i))
+#endif
+                child_count++;
+            i = skip_node(state->cells, state->cell_count, i);
+        }
+        else if (token == FDT_PROP && i + 2 < state->cell_count)
+        {
+            if (child_count == 0)
+                prop_count++;
+            i = skip_prop(state->cells, i);
+        }
+        else if (token == FDT_END || token == FDT_PROP)
+            i = state->cell_count;
+        else
+            i++;
+    }
+    if (i >= state->cell_count)
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Node has no terminating tag.");
+        return false;
+    }
+
+    state->prop_buff = NULL;
+    state->prop_alloc_head = state->prop_alloc_max = 0;
+    state->node_buff = NULL;
+    state->node_alloc_head = state->node_alloc_max = 0;
+    if (prop_count > 0 && (state->prop_buff = chunk_alloc(state, prop_count * sizeof(dtb_prop))) == NULL)
+        return false;
+    if (child_count > 0 && (state->node_buff = chunk_alloc(state, child_count * sizeof(dtb_node))) == NULL)
+        return false;
+    state->prop_alloc_max = prop_count;
+    state->node_alloc_max = child_count;
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_head = state->child_entry_alloc_max = 0;
+    if (child_count >= SMOLDTB_CHILD_INDEX_MIN)
+    {
+        state->child_entry_buff = chunk_alloc(state, child_count * sizeof(struct dtb_child_entry));
+        if (state->child_entry_buff != NULL)
+            state->child_entry_alloc_max = child_count;
+    }
+#endif
+
+    //properties come first, so the cell counts are known before the children are created.
+    dtb_node* last_child = NULL;
+    i = body;
+    while (be32(state->cells[i]) != FDT_END_NODE)
+    {
+        const uint32_t token = be32(state->cells[i]);
+        if (token == FDT_BEGIN_NODE)
+        {
+            const uint32_t child_start = i;
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (!node_is_pruned(state, child_start))
+#endif
+                attach_child(node, parse_node_header(state, &i, node->addr_cells, node->size_cells), &last_child);
+            i = skip_node(state->cells, state->cell_count, child_start);
+        }
+        else if (token == FDT_PROP && last_child != NULL)
+        {
+            dtb_prop ignored;
+            i = read_prop(state->cells, state->strings, i, &ignored);
+            if (state->ops.on_error)
+                state->ops.on_error("Property found after child node, ignoring it.");
+        }
+        else if (token == FDT_PROP)
+        {
+            dtb_prop* prop = parse_prop(state, &i);
+            if (prop)
+                attach_prop(state, node, prop);
+        }
+        else
+            i++;
+    }
+
+#ifdef SMOLDTB_CHILD_INDEX
+    build_child_index(state, node);
+#endif
+    STAT_ADD(state, loaded_nodes, state->node_alloc_head);
+    STAT_ADD(state, loaded_props, state->prop_alloc_head);
+    return true;
+}
+
+/* Returns the node whose BEGIN_NODE token is at `offset`, expanding its ancestors as needed. */
+static dtb_node* load_node_at(struct dtb_state* state, uint32_t offset)
+{
+    dtb_node* scan = state->root;
+    while (scan != NULL && scan->offset != offset)
+    {
+        if (!scan->expanded && !expand_node(state, scan))
+            return NULL;
+
+        //children are in blob order, the one containing `offset` is the last starting before it.
+        dtb_node* next = NULL;
+        for (dtb_node* child = scan->child; child != NULL && child->offset <= offset; child = child->sibling)
+            next = child;
+        scan = next;
+    }
+
+    return scan;
+}
+
+/* Finds the next property (from `*offset` onwards) in the structure block named by either atom,
+ * and the offset of the node it belongs to (properties come before a node's children, so this
+ * is the most recent BEGIN_NODE). Properties after an END_NODE are ignored by the parser, so
+ * they're skipped here too. Used instead of the lookup tables in lazy mode.
+ */
+static bool find_raw_prop(struct dtb_state* state, uint32_t* offset, uint32_t* node_offset,
+    dtb_atom atom, dtb_atom alt_atom, dtb_prop* prop)
+{
+    uint32_t i = *offset;
+    while (i < state->cell_count)
+    {
+        const uint32_t token = be32(state->cells[i]);
+        if (token == FDT_BEGIN_NODE)
+        {
+            *node_offset = i;
+            i = skip_node_name(state->cells, i);
+        }
+        else if (token == FDT_PROP)
+        {
+            if (i + 2 >= state->cell_count)
+                break;
+            const uint32_t name_offset = be32(state->cells[i + 2]);
+            i = read_prop(state->cells, state->strings, i, prop);
+            if (*node_offset == ~0u)
+                continue;
+            if (atom_matches(state, atom, name_offset) || atom_matches(state, alt_atom, name_offset))
+            {
+                *offset = i;
+                return true;
+            }
+        }
+        else if (token == FDT_END)
+            break;
+        else
+        {
+            if (token == FDT_END_NODE)
+                *node_offset = ~0u;
+            i++;
+        }
+    }
+
+    *offset = i;
+    return false;
+}
+#else
+static dtb_node* parse_node(struct dtb_state* state, uint32_t* offset, uint8_t addr_cells, uint8_t size_cells)
+{
+    if (be32(state->cells[*offset]) != FDT_BEGIN_NODE)
+        return NULL;
+
+    dtb_node* node = parse_node_header(state, offset, addr_cells, size_cells);
+    dtb_node* last_child = NULL;
+    while (*offset < state->cell_count)
+    {
+        const uint32_t test = be32(state->cells[*offset]);
+        if (test == FDT_END_NODE)
+        {
+            (*offset)++;
+#ifdef SMOLDTB_CHILD_INDEX
+            build_child_index(state, node);
+#endif
+            return node;
+        }
+        else if (test == FDT_BEGIN_NODE)
+        {
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (node_is_pruned(state, *offset))
+            {
+                *offset = skip_node(state->cells, state->cell_count, *offset);
+                continue;
+            }
+#endif
+            dtb_node* child = parse_node(state, offset, node->addr_cells, node->size_cells);
+            if (child)
+                attach_child(node, child, &last_child);
+        }
+        else if (test == FDT_PROP)
+        {
+            dtb_prop* prop = parse_prop(state, offset);
+            if (prop)
+                attach_prop(state, node, prop);
+        }
+        else
+            (*offset)++;
+    }
+
+    if (state->ops.on_error)
+        state->ops.on_error("Node has no terminating tag.");
+    return NULL;
+}
+
+/* A blob can be parsed on several workers by splitting the root's children into groups (see
+ * `count_tokens()`). Everything is allocated in tree order, so the count pass also tells us which
+ * parts of the buffers each group will use. The root's own properties are parsed first, then the
+ * workers take groups and parse each one with a copy of the instance that can only allocate from
+ * the group's parts of the buffers. The phandle table is shared by all of them.
+ */
+struct dtb_split_group
+{
+    struct dtb_state view;
+    dtb_node* first;
+    dtb_node* last;
+    uint32_t child_count;
+    bool complete; //the group was parsed exactly as counted.
+};
+
+struct dtb_split_job
+{
+    struct dtb_split_group* groups;
+    const struct dtb_split* splits;
+    dtb_node* root;
+    uint32_t group_count;
+    uint32_t next_group;
+};
+
+static void parse_split_groups(void* arg, uint32_t worker)
+{
+    (void)worker;
+    struct dtb_split_job* job = arg;
+    uint32_t index;
+    while ((index = __atomic_fetch_add(&job->next_group, 1, __ATOMIC_RELAXED)) < job->group_count)
+    {
+        struct dtb_split_group* group = &job->groups[index];
+        struct dtb_state* view = &group->view;
+        const uint32_t end = job->splits[index + 1].offset;
+        uint32_t i = job->splits[index].offset;
+        while (i < end)
+        {
+            const uint32_t token = be32(view->cells[i]);
+            if (token == FDT_NOP)
+            {
+                i++;
+                continue;
+            }
+#ifdef SMOLDTB_PRUNE_DISABLED
+            if (token == FDT_BEGIN_NODE && node_is_pruned(view, i))
+            {
+                i = skip_node(view->cells, view->cell_count, i);
+                continue;
+            }
+#endif
+            dtb_node* child = parse_node(view, &i, job->root->addr_cells, job->root->size_cells);
+            if (child == NULL)
+                break;
+
+            child->parent = job->root;
+            if (group->last)
+                group->last->sibling = child;
+            else
+                group->first = child;
+            group->last = child;
+            group->child_count++;
+        }
+
+        group->complete = i == end && view->node_alloc_head == view->node_alloc_max
+            && view->prop_alloc_head == view->prop_alloc_max;
+#ifdef SMOLDTB_COMPAT_INDEX
+        group->complete = group->complete && view->compat_alloc_head == view->compat_alloc_max;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+        group->complete = group->complete && view->child_entry_alloc_head == view->child_entry_alloc_max;
+#endif
+    }
+}
+
+/* Limits a copy of the instance to allocating what was counted between two splits. */
+static void init_split_view(struct dtb_state* view, const struct dtb_split* split)
+{
+    view->node_alloc_head = split[0].node_count;
+    view->node_alloc_max = split[1].node_count;
+    view->prop_alloc_head = split[0].prop_count;
+    view->prop_alloc_max = split[1].prop_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    view->compat_alloc_head = split[0].compat_count;
+    view->compat_alloc_max = split[1].compat_count;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    view->child_entry_alloc_head = split[0].child_entry_count;
+    view->child_entry_alloc_max = split[1].child_entry_count;
+#endif
+    view->shared_tables = true;
+}
+
+static bool split_matches(struct dtb_state* state, const struct dtb_split* split)
+{
+    bool matches = state->node_alloc_head == split->node_count && state->prop_alloc_head == split->prop_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    matches = matches && state->compat_alloc_head == split->compat_count;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    matches = matches && state->child_entry_alloc_head == split->child_entry_count;
+#endif
+    return matches;
+}
+
+/* Parses the root node described by `plan` using the workers, leaving `offset` after it. Returns
+ * NULL if the tree didn't match what was counted (this only happens with malformed blobs), or
+ * the groups couldn't be allocated, in which case the blob should be parsed again without splitting.
+ */
+static dtb_node* parse_split_root(struct dtb_state* state, uint32_t* offset, const struct dtb_split_plan* plan,
+    const dtb_workers* workers)
+{
+    const struct dtb_split* splits = plan->splits;
+    const uint32_t group_count = plan->count - 1;
+    if (be32(state->cells[splits[group_count].offset]) != FDT_END_NODE)
+        return NULL; //the count pass never saw the root end
+
+    dtb_node* root = parse_node_header(state, offset, 2, 1);
+    while (*offset < splits[0].offset)
+    {
+        if (be32(state->cells[*offset]) == FDT_PROP)
+        {
+            dtb_prop* prop = parse_prop(state, offset);
+            if (prop)
+                attach_prop(state, root, prop);
+        }
+        else
+            (*offset)++;
+    }
+    if (!split_matches(state, &splits[0]))
+        return NULL;
+
+    struct dtb_split_group* groups = state->ops.malloc(group_count * sizeof(struct dtb_split_group));
+    if (groups == NULL)
+        return NULL;
+    for (uint32_t i = 0; i < group_count; i++)
+    {
+        groups[i].view = *state;
+        init_split_view(&groups[i].view, &splits[i]);
+        groups[i].first = groups[i].last = NULL;
+        groups[i].child_count = 0;
+        groups[i].complete = false;
+    }
+
+    struct dtb_split_job job = { groups, splits, root, group_count, 0 };
+    workers->run(parse_split_groups, &job, workers->count);
+
+    bool complete = true;
+    dtb_node* last_child = NULL;
+    for (uint32_t i = 0; i < group_count; i++)
+    {
+        complete = complete && groups[i].complete;
+        if (groups[i].view.max_phandle > state->max_phandle)
+            state->max_phandle = groups[i].view.max_phandle;
+        if (groups[i].view.phandle_duplicates)
+            state->phandle_duplicates = true;
+        if (groups[i].first == NULL)
+            continue;
+        if (last_child)
+            last_child->sibling = groups[i].first;
+        else
+            root->child = groups[i].first;
+        last_child = groups[i].last;
+        root->child_count += groups[i].child_count;
+    }
+    if (state->ops.free)
+        state->ops.free(groups, group_count * sizeof(struct dtb_split_group));
+    if (!complete)
+        return NULL;
+
+    state->node_alloc_head = splits[group_count].node_count;
+    state->prop_alloc_head = splits[group_count].prop_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_alloc_head = splits[group_count].compat_count;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_head = splits[group_count].child_entry_count;
+    build_child_index(state, root);
+#endif
+    *offset = splits[group_count].offset + 1;
+    return root;
+}
+#endif
+
+/* Makes sure a node's properties and children have been parsed, which in lazy mode may not
+ * have happened yet. Returns false if they couldn't be.
+ */
+static inline bool load_node(dtb_node* node)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    return node->expanded || expand_node(node->owner, node);
+#else
+    (void)node;
+    return true;
+#endif
+}
+
+/* Interrupts are resolved by following each node's interrupt parent until an interrupt
+ * controller is reached. An interrupt nexus (a node with an 'interrupt-map') translates
+ * the specifier on the way, by matching the child's unit address and specifier (after
+ * applying the 'interrupt-map-mask') against the map's entries.
+ */
+static uint32_t get_interrupt_cells(dtb_node* node)
+{
+#ifdef SMOLDTB_INTERRUPT_INFO
+    return node->interrupt_cells;
+#else
+    uint32_t cells = 0;
+    dtb_prop* prop = dtb_find_prop(node, "#interrupt-cells");
+    if (prop != NULL)
+        read_single_cell(prop, &cells);
+    return cells;
+#endif
+}
+
+/* An interrupt-map uses a node's own '#address-cells', which is 0 (not inherited) if absent. */
+static uint32_t get_imap_addr_cells(dtb_node* node)
+{
+    return dtb_find_prop(node, "#address-cells") ? node->addr_cells : 0;
+}
+
+/* Finds the interrupt domain a node's interrupts go to: the node named by its
+ * 'interrupt-parent', or else its parent, skipping any that don't have '#interrupt-cells'.
+ */
+static dtb_node* find_interrupt_parent(struct dtb_state* state, dtb_node* node)
+{
+    for (uint32_t depth = 0; node != NULL && depth < INTERRUPT_MAX_DEPTH; depth++)
+    {
+        dtb_prop* prop = dtb_find_prop(node, "interrupt-parent");
+        uint32_t handle = 0;
+        if (prop != NULL && read_single_cell(prop, &handle))
+            node = dtb_find_phandle_ex(state, handle);
+        else
+            node = node->parent;
+
+        if (node != NULL && get_interrupt_cells(node) != 0)
+            return node;
+    }
+    return NULL;
+}
+
+/* Reads an interrupt-map-mask covering `count` cells, missing cells don't mask anything. */
+static void read_imap_mask(dtb_node* nexus, uint32_t count, uint32_t* mask)
+{
+    for (uint32_t i = 0; i < count; i++)
+        mask[i] = ~0u;
+    dtb_prop* prop = dtb_find_prop(nexus, "interrupt-map-mask");
+    if (prop != NULL && prop->length / FDT_CELL_SIZE >= count)
+    {
+        for (uint32_t i = 0; i < count; i++)
+            mask[i] = be32(prop->first_cell[i]);
+    }
+}
+
+/* Decodes the interrupt-map entry at `cells`, returning how many cells it used, or 0 if it's
+ * malformed (the phandle doesn't exist or the entry runs past the end of the map).
+ */
+static uint32_t decode_imap_entry(struct dtb_state* state, uint32_t child_cells, const uint32_t* cells,
+    uint32_t remaining, struct dtb_imap_entry* entry)
+{
+    if (remaining < child_cells + 1)
+        return 0;
+
+    entry->child = cells;
+    entry->parent = dtb_find_phandle_ex(state, be32(cells[child_cells]));
+    if (entry->parent == NULL)
+        return 0;
+    entry->parent_addr_cells = get_imap_addr_cells(entry->parent);
+    entry->parent_int_cells = get_interrupt_cells(entry->parent);
+    entry->parent_cells = cells + child_cells + 1;
+
+    const uint32_t length = child_cells + 1 + entry->parent_addr_cells + entry->parent_int_cells;
+    return length <= remaining ? length : 0;
+}
+
+/* Checks if an entry's child cells (from the blob) match a masked key (in host byte order). */
+static bool imap_entry_matches(const struct dtb_imap_entry* entry, const uint32_t* key, const uint32_t* mask,
+    uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if ((be32(entry->child[i]) & mask[i]) != key[i])
+            return false;
+    }
+    return true;
+}
+
+#ifdef SMOLDTB_INTERRUPT_INFO
+/* 32-bit FNV-1a hash of a masked key, `big_endian` is set when the cells come from the blob. */
+static uint32_t hash_imap_key(const uint32_t* cells, const uint32_t* mask, uint32_t count, bool big_endian)
+{
+    uint32_t hash = 0x811C9DC5;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        hash ^= (big_endian ? be32(cells[i]) : cells[i]) & mask[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static bool imap_entry_less(const void* lhs, const void* rhs)
+{
+    return ((const struct dtb_imap_entry*)lhs)->hash < ((const struct dtb_imap_entry*)rhs)->hash;
+}
+
+/* Decodes a nexus's interrupt-map into the entry pool, sorted by the hash of their masked
+ * child cells. Malformed maps are left empty, as the entries after an error can't be trusted.
+ */
+static void build_interrupt_map(struct dtb_state* state, dtb_node* nexus, dtb_prop* map)
+{
+    const uint32_t addr_cells = get_imap_addr_cells(nexus);
+    const uint32_t int_cells = get_interrupt_cells(nexus);
+    const uint32_t child_cells = addr_cells + int_cells;
+    if (addr_cells > IMAP_MAX_ADDR_CELLS || int_cells > DTB_MAX_INTERRUPT_CELLS)
+        return;
+    uint32_t mask[IMAP_MAX_ADDR_CELLS + DTB_MAX_INTERRUPT_CELLS];
+    read_imap_mask(nexus, child_cells, mask);
+
+    struct dtb_imap_entry* entries = &state->imap_buff[state->imap_alloc_head];
+    const uint32_t total = map->length / FDT_CELL_SIZE;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < total; count++)
+    {
+        if (state->imap_alloc_head + count == state->imap_alloc_max)
+            return;
+        const uint32_t length = decode_imap_entry(state, child_cells, map->first_cell + i, total - i, &entries[count]);
+        if (length == 0)
+        {
+            if (state->ops.on_error)
+                state->ops.on_error("Malformed interrupt-map");
+            return;
+        }
+        entries[count].hash = hash_imap_key(entries[count].child, mask, child_cells, true);
+        i += length;
+    }
+
+    heap_sort(entries, count, sizeof(struct dtb_imap_entry), imap_entry_less);
+    state->imap_alloc_head += count;
+    nexus->interrupt_map = entries;
+    nexus->interrupt_map_count = count;
+}
+
+/* Runs once the whole tree is parsed (so phandles can be resolved): records every node's
+ * interrupt parent and decodes the interrupt-map of each nexus.
+ */
+static void build_interrupt_info(struct dtb_state* state)
+{
+    for (uint32_t i = 0; i < state->node_alloc_head; i++)
+    {
+        dtb_node* node = &state->node_buff[i];
+        node->interrupt_parent = find_interrupt_parent(state, node);
+        dtb_prop* map = dtb_find_prop_interned_ex(state, node, state->atoms.interrupt_map);
+        if (map != NULL)
+            build_interrupt_map(state, node, map);
+    }
+}
+#endif
+
+/* Finds the interrupt-map entry matching a masked key, returns false if there isn't one. */
+static bool find_imap_entry(struct dtb_state* state, dtb_node* nexus, const uint32_t* key, const uint32_t* mask,
+    uint32_t count, struct dtb_imap_entry* entry)
+{
+#ifdef SMOLDTB_INTERRUPT_INFO
+    if (!state->interrupts_stale)
+    {
+        const uint32_t hash = hash_imap_key(key, mask, count, false);
+        uint32_t low = 0;
+        uint32_t high = nexus->interrupt_map_count;
+        while (low < high)
+        {
+            const uint32_t mid = low + (high - low) / 2;
+            if (nexus->interrupt_map[mid].hash < hash)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        for (uint32_t i = low; i < nexus->interrupt_map_count && nexus->interrupt_map[i].hash == hash; i++)
+        {
+            if (imap_entry_matches(&nexus->interrupt_map[i], key, mask, count))
+            {
+                *entry = nexus->interrupt_map[i];
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+
+    dtb_prop* map = dtb_find_prop(nexus, "interrupt-map");
+    const uint32_t total = map->length / FDT_CELL_SIZE;
+    for (uint32_t i = 0; i < total;)
+    {
+        const uint32_t length = decode_imap_entry(state, count, map->first_cell + i, total - i, entry);
+        if (length == 0)
+            return false;
+        if (imap_entry_matches(entry, key, mask, count))
+            return true;
+        i += length;
+    }
+    return false;
+}
+
+/* Reads the `index`th interrupt specifier of a node from 'interrupts-extended', or else from
+ * 'interrupts' (using its interrupt parent). Returns the domain it belongs to, or NULL.
+ */
+static dtb_node* get_interrupt_spec(struct dtb_state* state, dtb_node* node, uint32_t index, uint32_t* spec,
+    uint32_t* spec_cells)
+{
+    dtb_prop* prop = dtb_find_prop(node, "interrupts-extended");
+    if (prop != NULL)
+    {
+        const uint32_t total = prop->length / FDT_CELL_SIZE;
+        for (uint32_t i = 0; i < total;)
+        {
+            dtb_node* domain = dtb_find_phandle_ex(state, be32(prop->first_cell[i]));
+            if (domain == NULL)
+                return NULL;
+            const uint32_t cells = get_interrupt_cells(domain);
+            if (i + 1 + cells > total)
+                return NULL;
+            if (index-- == 0)
+            {
+                if (cells > DTB_MAX_INTERRUPT_CELLS)
+                    return NULL;
+                for (uint32_t j = 0; j < cells; j++)
+                    spec[j] = be32(prop->first_cell[i + 1 + j]);
+                *spec_cells = cells;
+                return domain;
+            }
+            i += 1 + cells;
+        }
+        return NULL;
+    }
+
+    prop = dtb_find_prop(node, "interrupts");
+    if (prop == NULL)
+        return NULL;
+    dtb_node* domain = dtb_get_interrupt_parent_ex(state, node);
+    if (domain == NULL)
+        return NULL;
+    const uint32_t cells = get_interrupt_cells(domain);
+    if (cells > DTB_MAX_INTERRUPT_CELLS || (index + 1) * cells > prop->length / FDT_CELL_SIZE)
+        return NULL;
+    for (uint32_t j = 0; j < cells; j++)
+        spec[j] = be32(prop->first_cell[index * cells + j]);
+    *spec_cells = cells;
+    return domain;
+}
+
+/* Empties the path and ranges caches, when the instance is re-initialized or the tree changes. */
+static void clear_caches(struct dtb_state* state)
+{
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+    uint8_t* cache = (uint8_t*)state->path_cache;
+    for (uint32_t i = 0; i < sizeof(state->path_cache); i++)
+        cache[i] = 0;
+#endif
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+    uint8_t* ranges_cache = (uint8_t*)state->ranges_cache;
+    for (uint32_t i = 0; i < sizeof(state->ranges_cache); i++)
+        ranges_cache[i] = 0;
+#endif
+    (void)state;
+}
+
+/* Zeroes the per-call counters of `dtb_get_stats()`. If `all` is set the counts of nodes
+ * created by lazy parsing are reset as well.
+ */
+static void reset_stats(struct dtb_state* state, bool all)
+{
+#ifdef SMOLDTB_STATS
+    const dtb_call_stats empty = { 0, 0 };
+    state->find_stats = state->compat_stats = state->prop_stats = state->phandle_stats = empty;
+    if (all)
+        state->loaded_nodes = state->loaded_props = 0;
+#endif
+    (void)state;
+    (void)all;
+}
+
+/* Returns true if a block of the blob lies after the header and within 'total_size'. */
+static bool block_fits(uint32_t offset, uint32_t size, uint32_t header_size, uint32_t total_size)
+{
+    return offset >= header_size && offset <= total_size && size <= total_size - offset;
+}
+
+/* Checks that the header describes a blob that fits in `size` bytes (if it's not 0), and that
+ * each block it points to is within the blob. The memory reservations must be terminated (the
+ * number of entries before the terminator is returned in `rsvd_count`), and
+ * the strings block must end with a null so any name inside it is terminated. Version 16 headers
+ * don't have 'size_structs', so the structure block is allowed to take up the rest of the blob.
+ */
+static dtb_error check_header(const struct fdt_header* header, uint32_t size, uint32_t* structs_size, uint32_t* rsvd_count)
+{
+    if (be32(header->magic) != FDT_MAGIC)
+        return DTB_ERR_MAGIC;
+    const uint32_t version = be32(header->version);
+    if (version < FDT_LAST_COMP_VERSION || be32(header->last_comp_version) > FDT_VERSION)
+        return DTB_ERR_VERSION;
+
+    const uint32_t header_size = version >= FDT_VERSION ? sizeof(struct fdt_header) : sizeof(struct fdt_header) - FDT_CELL_SIZE;
+    const uint32_t total_size = be32(header->total_size);
+    if (total_size < header_size || (size != 0 && total_size > size))
+        return DTB_ERR_TRUNCATED;
+
+    const uint32_t structs_offset = be32(header->offset_structs);
+    *structs_size = version >= FDT_VERSION ? be32(header->size_structs) : total_size - structs_offset;
+    if (structs_offset % FDT_CELL_SIZE != 0 || !block_fits(structs_offset, *structs_size, header_size, total_size))
+        return DTB_ERR_LAYOUT;
+
+    const uint32_t strings_offset = be32(header->offset_strings);
+    const uint32_t strings_size = be32(header->size_strings);
+    if (!block_fits(strings_offset, strings_size, header_size, total_size))
+        return DTB_ERR_LAYOUT;
+
+    uint32_t rsvd_offset = be32(header->offset_memmap_rsvd);
+    if (rsvd_offset % sizeof(uint64_t) != 0 || rsvd_offset < header_size)
+        return DTB_ERR_LAYOUT;
+    for (*rsvd_count = 0; true; (*rsvd_count)++)
+    {
+        if (rsvd_offset > total_size || total_size - rsvd_offset < sizeof(struct fdt_reserved_mem_entry))
+            return DTB_ERR_LAYOUT;
+        const struct fdt_reserved_mem_entry* entry = (const void*)((uintptr_t)header + rsvd_offset);
+        if (entry->base == 0 && entry->length == 0)
+            break;
+        rsvd_offset += sizeof(struct fdt_reserved_mem_entry);
+    }
+
+    const char* strings = (const char*)header + strings_offset;
+    if (strings_size > 0 && strings[strings_size - 1] != 0)
+        return DTB_ERR_STRINGS;
+    return DTB_OK;
+}
+
+/* Reads a 64-bit field of a memory reservation entry, which may only be 4-byte aligned. */
+static uint64_t read_rsvd_u64(const uint64_t* field)
+{
+    const uint32_t* cells = (const uint32_t*)field;
+    return ((uint64_t)be32(cells[0]) << 32) | be32(cells[1]);
+}
+
+static bool reg_base_less(const void* lhs, const void* rhs)
+{
+    return ((const dtb_reg*)lhs)->base < ((const dtb_reg*)rhs)->base;
+}
+
+/* Sorts an array of ranges by base, then merges any that overlap or are adjacent (and drops
+ * empty ones) in place. Ranges that would wrap are cut off at the top of the address space.
+ * Returns the number of ranges left.
+ */
+static uint32_t merge_ranges(dtb_reg* ranges, uint32_t count)
+{
+    heap_sort(ranges, count, sizeof(dtb_reg), reg_base_less);
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (ranges[i].size == 0)
+            continue;
+        uint64_t end = ranges[i].base + ranges[i].size;
+        if (end < ranges[i].base)
+            end = ~(uint64_t)0;
+
+        if (merged > 0 && ranges[i].base - ranges[merged - 1].base <= ranges[merged - 1].size)
+        {
+            dtb_reg* last = &ranges[merged - 1];
+            if (end - last->base > last->size)
+                last->size = end - last->base;
+            continue;
+        }
+        ranges[merged].base = ranges[i].base;
+        ranges[merged].size = end - ranges[i].base;
+        merged++;
+    }
+    return merged;
+}
+
+/* Returns true if a node's own 'status' doesn't say it's unavailable. */
+static bool node_is_available(dtb_node* node)
+{
+#ifdef SMOLDTB_STATUS_INFO
+    return load_node(node) && !node->disabled;
+#else
+    dtb_prop* status = dtb_find_prop(node, "status");
+    return status == NULL || status_is_okay(status);
+#endif
+}
+
+/* Returns the child of the root node with exactly this name. This doesn't use `dtb_find()`, so
+ * init doesn't count towards the path cache stats.
+ */
+static dtb_node* find_root_child(struct dtb_state* state, const char* name)
+{
+    if (state->root == NULL || !load_node(state->root))
+        return NULL;
+    for (dtb_node* child = state->root->child; child != NULL; child = child->sibling)
+    {
+        if (strings_eq(child->name, name))
+            return child;
+    }
+    return NULL;
+}
+
+/* Collects the memory reservation block and the 'reg' of each available child of
+ * '/reserved-memory' into one array, sorted by base with overlapping and adjacent ranges merged.
+ * The children's entries are used as-is, '/reserved-memory' is required to have an empty
+ * 'ranges' so they're already physical addresses.
+ */
+static bool build_reserved_ranges(struct dtb_state* state)
+{
+    dtb_node* reserved_memory = find_root_child(state, "reserved-memory");
+    uint32_t count = state->memreserve_count;
+    if (reserved_memory != NULL && load_node(reserved_memory))
+    {
+        for (dtb_node* child = reserved_memory->child; child != NULL; child = child->sibling)
+        {
+            if (node_is_available(child))
+                count += dtb_read_reg(child, NULL);
+        }
+    }
+    if (count == 0)
+        return true;
+
+    dtb_reg* ranges = chunk_alloc(state, count * sizeof(dtb_reg));
+    if (ranges == NULL)
+    {
+        state->error = DTB_ERR_NO_MEMORY;
+        return false;
+    }
+
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < state->memreserve_count; i++, used++)
+    {
+        ranges[used].base = read_rsvd_u64(&state->memreserve[i].base);
+        ranges[used].size = read_rsvd_u64(&state->memreserve[i].length);
+    }
+    if (reserved_memory != NULL)
+    {
+        for (dtb_node* child = reserved_memory->child; child != NULL; child = child->sibling)
+        {
+            if (node_is_available(child))
+                used += dtb_read_reg(child, ranges + used);
+        }
+    }
+
+    state->reserved_ranges = ranges;
+    state->reserved_range_count = merge_ranges(ranges, used);
+    return true;
+}
+
+#ifdef SMOLDTB_TOPOLOGY
+/* Returns true if the node's 'device_type' is this string. */
+static bool node_has_type(dtb_node* node, const char* type)
+{
+    const char* value = dtb_read_prop_string(dtb_find_prop(node, "device_type"), 0);
+    return value != NULL && strings_eq(value, type);
+}
+
+/* Returns true if a node's name is this prefix followed by a number, like the 'clusterN',
+ * 'coreN' and 'threadN' nodes of a 'cpu-map'.
+ */
+static bool name_is_numbered(const char* name, const char* prefix)
+{
+    while (*prefix != 0 && *name == *prefix)
+    {
+        name++;
+        prefix++;
+    }
+    if (*prefix != 0 || *name == 0)
+        return false;
+    for (; *name != 0; name++)
+    {
+        if (*name < '0' || *name > '9')
+            return false;
+    }
+    return true;
+}
+
+/* Records the position of the CPU referenced by a 'cpu-map' leaf ('coreN' or 'threadN'). */
+static void map_cpu(struct dtb_state* state, dtb_node* leaf, uint32_t cluster, uint32_t core, uint32_t thread)
+{
+    uint32_t handle;
+    if (!read_single_cell(dtb_find_prop(leaf, "cpu"), &handle))
+        return;
+    dtb_node* node = dtb_find_phandle_ex(state, handle);
+    for (uint32_t i = 0; i < state->cpu_count; i++)
+    {
+        if (state->cpus[i].node != node)
+            continue;
+        state->cpus[i].cluster = cluster;
+        state->cpus[i].core = core;
+        state->cpus[i].thread = thread;
+        return;
+    }
+}
+
+/* Walks a level of the 'cpu-map'. Sockets and clusters can be nested, only clusters that
+ * directly contain cores are given a cluster index.
+ */
+static void map_cpu_group(struct dtb_state* state, dtb_node* group, uint32_t* next_cluster)
+{
+    if (!load_node(group))
+        return;
+
+    uint32_t cluster = DTB_CPU_NOT_MAPPED;
+    uint32_t core = 0;
+    for (dtb_node* child = group->child; child != NULL; child = child->sibling)
+    {
+        if (name_is_numbered(child->name, "socket") || name_is_numbered(child->name, "cluster"))
+        {
+            map_cpu_group(state, child, next_cluster);
+            continue;
+        }
+        if (!name_is_numbered(child->name, "core") || !load_node(child))
+            continue;
+
+        if (cluster == DTB_CPU_NOT_MAPPED)
+            cluster = (*next_cluster)++;
+        uint32_t thread = 0;
+        for (dtb_node* leaf = child->child; leaf != NULL; leaf = leaf->sibling)
+        {
+            if (name_is_numbered(leaf->name, "thread"))
+                map_cpu(state, leaf, cluster, core, thread++);
+        }
+        if (thread == 0)
+            map_cpu(state, child, cluster, core, 0);
+        core++;
+    }
+}
+
+/* Records the available CPUs and their place in the 'cpu-map', and the merged ranges of the
+ * available memory nodes, so they can be read as flat arrays with `dtb_get_topology()`.
+ */
+static bool build_topology(struct dtb_state* state)
+{
+    state->cpus = NULL;
+    state->cpu_count = 0;
+    state->memory = NULL;
+    state->memory_count = 0;
+
+    dtb_node* cpus = find_root_child(state, "cpus");
+    uint32_t count = 0;
+    if (cpus != NULL && load_node(cpus))
+    {
+        for (dtb_node* child = cpus->child; child != NULL; child = child->sibling)
+        {
+            if (node_has_type(child, "cpu") && node_is_available(child))
+                count++;
+        }
+    }
+    if (count > 0)
+    {
+        state->cpus = chunk_alloc(state, count * sizeof(dtb_cpu));
+        if (state->cpus == NULL)
+        {
+            state->error = DTB_ERR_NO_MEMORY;
+            return false;
+        }
+
+        for (dtb_node* child = cpus->child; child != NULL; child = child->sibling)
+        {
+            if (!node_has_type(child, "cpu") || !node_is_available(child))
+                continue;
+            dtb_cpu* cpu = &state->cpus[state->cpu_count++];
+            cpu->node = child;
+            dtb_prop* reg = dtb_find_prop(child, "reg");
+            if (reg != NULL && cpus->addr_cells > 0 && reg->length >= cpus->addr_cells * FDT_CELL_SIZE)
+                cpu->id = read_cells_u64(reg->first_cell, cpus->addr_cells);
+            cpu->cluster = cpu->core = cpu->thread = DTB_CPU_NOT_MAPPED;
+        }
+
+        dtb_node* map = NULL;
+        for (dtb_node* child = cpus->child; child != NULL; child = child->sibling)
+        {
+            if (strings_eq(child->name, "cpu-map"))
+                map = child;
+        }
+        uint32_t next_cluster = 0;
+        if (map != NULL)
+            map_cpu_group(state, map, &next_cluster);
+    }
+
+    count = 0;
+    for (dtb_node* child = state->root ? state->root->child : NULL; child != NULL; child = child->sibling)
+    {
+        if (node_has_type(child, "memory") && node_is_available(child))
+            count += dtb_read_reg(child, NULL);
+    }
+    if (count == 0)
+        return true;
+
+    state->memory = chunk_alloc(state, count * sizeof(dtb_reg));
+    if (state->memory == NULL)
+    {
+        state->error = DTB_ERR_NO_MEMORY;
+        return false;
+    }
+    uint32_t used = 0;
+    for (dtb_node* child = state->root->child; child != NULL; child = child->sibling)
+    {
+        if (node_has_type(child, "memory") && node_is_available(child))
+            used += dtb_read_reg(child, state->memory + used);
+    }
+    state->memory_count = merge_ranges(state->memory, used);
+    return true;
+}
+#endif
+
+/* Builds the arrays handed out by `dtb_get_reserved_ranges()` and `dtb_get_topology()`. */
+static bool build_views(struct dtb_state* state)
+{
+#ifdef SMOLDTB_TOPOLOGY
+    if (!build_topology(state))
+        return false;
+#endif
+    return build_reserved_ranges(state);
+}
+
+/* Checks the header of the blob at `start` and points an instance at its blocks, releasing any
+ * data from a previous parse.
+ */
+static bool attach_blob(struct dtb_state* state, uintptr_t start, uint32_t size)
+{
+    struct fdt_header* header = (struct fdt_header*)start;
+    uint32_t structs_size, rsvd_count;
+    state->error = check_header(header, size, &structs_size, &rsvd_count);
+    if (state->error != DTB_OK)
+        return report_error(state, state->error);
+
+    state->header = header;
+    state->cells = (const uint32_t*)(start + be32(header->offset_structs));
+    state->cell_count = structs_size / sizeof(uint32_t);
+    state->strings = (const char*)(start + be32(header->offset_strings));
+    state->strings_size = be32(header->size_strings);
+    state->memreserve = (const struct fdt_reserved_mem_entry*)(start + be32(header->offset_memmap_rsvd));
+    state->memreserve_count = rsvd_count;
+    intern_special_atoms(state);
+
+    state->root = NULL;
+    state->phandles_stale = state->compat_stale = state->interrupts_stale = false;
+    state->phandle_duplicates = false;
+    state->max_phandle_known = false;
+    state->max_phandle = 0;
+    state->reserved_ranges = NULL;
+    state->reserved_range_count = 0;
+    free_buffers(state);
+    clear_caches(state);
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+    state->path_cache_hits = state->path_cache_misses = 0;
+#endif
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+    state->ranges_cache_hits = state->ranges_cache_misses = 0;
+#endif
+    reset_stats(state, true);
+    return true;
+}
+
+/* Builds an instance's views once its tree exists. Lookups made while initializing it don't
+ * count towards its stats.
+ */
+static bool finish_init(struct dtb_state* state)
+{
+#ifndef SMOLDTB_LAZY_PARSE
+    //edits keep the phandle table at most half full as well, which needs to know how full it is.
+    state->handle_slots_used = 0;
+    for (uint32_t i = 0; i < state->handle_slot_count; i++)
+    {
+        if (state->handle_lookup[i].handle != 0)
+            state->handle_slots_used++;
+    }
+#endif
+    STAT_PHASE(state, DTB_PHASE_VIEWS, false);
+    const bool built = build_views(state);
+    reset_stats(state, false);
+    if (built)
+        STAT_PHASE(state, DTB_PHASE_VIEWS, true);
+    return built;
+}
+
+#ifndef SMOLDTB_LAZY_PARSE
+/* With `SMOLDTB_STATS` every parsed node points to its instance, which is done once the tree is
+ * complete as workers parse with copies of the instance and restored indexes can't store it.
+ */
+static void set_node_owners(struct dtb_state* state)
+{
+#ifdef SMOLDTB_STATS
+    for (uint32_t i = 0; i < state->node_alloc_head; i++)
+        state->node_buff[i].owner = state;
+#endif
+    (void)state;
+}
+#endif
+
+/* Parses the blob at `start` into an instance, releasing any data from a previous parse. If
+ * `size` isn't 0 it's the size of the buffer holding the blob. If `workers` isn't NULL the
+ * root node's children may be parsed by them.
+ */
+static bool init_state(struct dtb_state* state, uintptr_t start, uint32_t size, const dtb_workers* workers)
+{
+#if DBG
+    __atomic_store_n(&dtb_base, start, __ATOMIC_RELAXED); //instances can be initialized concurrently.
+#endif
+
+    STAT_PHASE(state, DTB_PHASE_HEADER, false);
+    if (!attach_blob(state, start, size))
+        return false;
+    STAT_PHASE(state, DTB_PHASE_HEADER, true);
+
+    STAT_PHASE(state, DTB_PHASE_COUNT, false);
+    struct dtb_split splits[SPLIT_MAX_GROUPS + 1];
+    struct dtb_split_plan plan = { splits, 0, 0, 0 };
+    if (workers != NULL && workers->count > 1)
+    {
+        plan.max_count = workers->count * SPLIT_GROUPS_PER_WORKER + 1;
+        if (plan.max_count > SPLIT_MAX_GROUPS + 1 || plan.max_count < workers->count)
+            plan.max_count = SPLIT_MAX_GROUPS + 1;
+        plan.min_cells = state->cell_count / (plan.max_count - 1);
+    }
+    if (!alloc_buffers(state, plan.max_count > 0 ? &plan : NULL))
+        return false;
+
+#ifdef SMOLDTB_LAZY_PARSE
+    //nodes are only parsed when they're needed, so a blob that has to be checked is walked up front.
+    if (size != 0)
+    {
+        uint32_t node_count, prop_count, handle_count;
+        const dtb_error error = count_tokens(state, &node_count, &prop_count, &handle_count, NULL);
+        if (error != DTB_OK)
+            return report_error(state, error);
+    }
+    STAT_PHASE(state, DTB_PHASE_COUNT, true);
+
+    //only the root node is created up front, everything else is parsed when it's first needed.
+    STAT_PHASE(state, DTB_PHASE_PARSE, false);
+    uint32_t i = 0;
+    while (i < state->cell_count && be32(state->cells[i]) != FDT_BEGIN_NODE && be32(state->cells[i]) != FDT_END)
+        i++;
+    if (i == state->cell_count || be32(state->cells[i]) != FDT_BEGIN_NODE)
+        return true;
+
+    state->node_buff = chunk_alloc(state, sizeof(dtb_node));
+    if (state->node_buff == NULL)
+    {
+        state->error = DTB_ERR_NO_MEMORY;
+        return false;
+    }
+    state->node_alloc_head = 0;
+    state->node_alloc_max = 1;
+    state->root = parse_node_header(state, &i, 2, 1);
+    STAT_ADD(state, loaded_nodes, 1);
+#else
+    STAT_PHASE(state, DTB_PHASE_COUNT, true);
+    STAT_PHASE(state, DTB_PHASE_PARSE, false);
+    dtb_node* last_root = NULL;
+    uint32_t i = 0;
+    while (i < state->cell_count)
+    {
+        const uint32_t token = be32(state->cells[i]);
+        if (token == FDT_END)
+            break;
+        if (token != FDT_BEGIN_NODE)
+        {
+            i++;
+            continue;
+        }
+
+        dtb_node* sub_root;
+        if (state->node_alloc_head == 0 && plan.count > 1)
+        {
+            sub_root = parse_split_root(state, &i, &plan, workers);
+            if (sub_root == NULL)
+                return init_state(state, start, size, NULL);
+        }
+        else
+            sub_root = parse_node(state, &i, 2, 1);
+        if (sub_root == NULL)
+            continue;
+        if (last_root)
+            last_root->sibling = sub_root;
+        else
+            state->root = sub_root;
+        last_root = sub_root;
+    }
+    set_node_owners(state);
+#endif
+    STAT_PHASE(state, DTB_PHASE_PARSE, true);
+
+    STAT_PHASE(state, DTB_PHASE_INDEX, false);
+#ifdef SMOLDTB_COMPAT_INDEX
+    link_compat_index(state);
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    build_interrupt_info(state);
+#endif
+#ifndef SMOLDTB_LAZY_PARSE
+    state->max_phandle_known = true;
+#endif
+    STAT_PHASE(state, DTB_PHASE_INDEX, true);
+    return finish_init(state);
+}
+
+void dtb_init(uintptr_t start, dtb_ops ops)
+{
+    struct dtb_state* state = &default_state;
+    state->ops = ops;
+#ifndef SMOLDTB_STATIC_BUFFER_SIZE
+    if (!state->ops.malloc)
+    {
+        state->error = DTB_ERR_NO_MEMORY;
+        if (state->ops.on_error)
+            state->ops.on_error("ops.malloc is NULL");
+        return;
+    }
+#endif
+
+    init_state(state, start, 0, NULL);
+}
+
+dtb_error dtb_get_error()
+{
+    return default_state.error;
+}
+
+/* Allocates an empty instance, or returns NULL if it couldn't be. */
+static struct dtb_state* alloc_state(dtb_ops ops)
+{
+    if (!ops.malloc)
+    {
+        if (ops.on_error)
+            ops.on_error("ops.malloc is NULL");
+        return NULL;
+    }
+
+    struct dtb_state* state = ops.malloc(sizeof(struct dtb_state));
+    if (state == NULL)
+    {
+        if (ops.on_error)
+            ops.on_error("ops.malloc() failed to allocate parser state.");
+        return NULL;
+    }
+
+    uint8_t* raw = (uint8_t*)state;
+    for (uint32_t i = 0; i < sizeof(struct dtb_state); i++)
+        raw[i] = 0;
+    state->ops = ops;
+    return state;
+}
+
+/* Allocates and parses a new instance. If this fails `error` (if it's not NULL) is set to why. */
+static struct dtb_state* create_state(uintptr_t start, uint32_t size, dtb_ops ops, const dtb_workers* workers,
+    dtb_error* error)
+{
+    if (error)
+        *error = DTB_ERR_NO_MEMORY;
+    struct dtb_state* state = alloc_state(ops);
+    if (state == NULL)
+        return NULL;
+
+    const bool success = init_state(state, start, size, workers);
+    if (error)
+        *error = state->error;
+    if (!success)
+    {
+        dtb_deinit(state);
+        return NULL;
+    }
+    return state;
+}
+
+dtb_state* dtb_init_ex(uintptr_t start, dtb_ops ops)
+{
+    return create_state(start, 0, ops, NULL, NULL);
+}
+
+dtb_state* dtb_init_checked(uintptr_t start, uint32_t size, dtb_ops ops, dtb_error* error)
+{
+    if (size < sizeof(struct fdt_header))
+    {
+        if (error)
+            *error = DTB_ERR_TRUNCATED;
+        if (ops.on_error)
+            ops.on_error(error_messages[DTB_ERR_TRUNCATED]);
+        return NULL;
+    }
+
+    return create_state(start, size, ops, NULL, error);
+}
+
+dtb_state* dtb_init_parallel(uintptr_t start, dtb_ops ops, const dtb_workers* workers)
+{
+    if (workers == NULL || workers->run == NULL)
+    {
+        if (ops.on_error)
+            ops.on_error("No workers to parse with");
+        return NULL;
+    }
+
+    return create_state(start, 0, ops, workers, NULL);
+}
+
+/* Each worker parses whole blobs, taking the next one that hasn't been started until there
+ * are none left. Instances are allocated with the worker's own ops.
+ */
+struct dtb_batch_job
+{
+    const uintptr_t* starts;
+    dtb_state** states;
+    const dtb_workers* workers;
+    dtb_ops ops;
+    uint32_t count;
+    uint32_t next_blob;
+    uint32_t parsed_count;
+};
+
+static void parse_batch_blobs(void* arg, uint32_t worker)
+{
+    struct dtb_batch_job* job = arg;
+    const dtb_ops ops = job->workers->ops ? job->workers->ops[worker] : job->ops;
+    uint32_t index;
+    while ((index = __atomic_fetch_add(&job->next_blob, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        job->states[index] = dtb_init_ex(job->starts[index], ops);
+        if (job->states[index] != NULL)
+            __atomic_fetch_add(&job->parsed_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t dtb_init_batch(const uintptr_t* starts, uint32_t count, dtb_ops ops, const dtb_workers* workers, dtb_state** states)
+{
+    if (workers == NULL || workers->run == NULL || workers->count == 0)
+    {
+        if (ops.on_error)
+            ops.on_error("No workers to parse with");
+        return 0;
+    }
+
+    struct dtb_batch_job job = { starts, states, workers, ops, count, 0, 0 };
+    workers->run(parse_batch_blobs, &job, workers->count);
+    return job.parsed_count;
+}
+
+void dtb_deinit(dtb_state* state)
+{
+    if (state == NULL || state == &default_state)
+        return;
+
+    free_buffers(state);
+    if (state->ops.free)
+        state->ops.free(state, sizeof(struct dtb_state));
+}
+
+dtb_state* dtb_publish(uintptr_t start, dtb_ops ops)
+{
+    if (!ops.retire)
+    {
+        if (ops.on_error)
+            ops.on_error("ops.retire is NULL, the published tree could never be freed");
+        return NULL;
+    }
+
+    struct dtb_state* state = dtb_init_ex(start, ops);
+    if (state == NULL)
+        return NULL;
+
+    //the release half of this makes the fully parsed tree visible before the pointer to it.
+    struct dtb_state* prev = __atomic_exchange_n(&published_state, state, __ATOMIC_ACQ_REL);
+    if (prev != NULL)
+        prev->ops.retire(prev);
+    return state;
+}
+
+dtb_state* dtb_get_published()
+{
+    return __atomic_load_n(&published_state, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the node after `node` in a depth-first walk of the whole tree (or the first node if
+ * `node` is NULL). Lookups use this once the tree has been changed in a way their index can't
+ * be updated for, see the `*_stale` flags in `dtb_state`.
+ */
+static dtb_node* next_node(struct dtb_state* state, dtb_node* node)
+{
+    if (node == NULL)
+        return state->root;
+    if (load_node(node) && node->child != NULL)
+        return node->child;
+    while (node != NULL && node->sibling == NULL)
+        node = node->parent;
+    return node ? node->sibling : NULL;
+}
+
+static bool node_is_compatible(dtb_node* node, const char* str)
+{
+    dtb_prop* compat = dtb_find_prop(node, "compatible");
+    return compat != NULL && list_has_string(compat, str);
+}
+
+dtb_node* dtb_find_compatible_ex(dtb_state* state, dtb_node* start, const char* str)
+{
+    if (state == NULL)
+        return NULL;
+    STAT_ADD(state, compat_stats.calls, 1);
+    if (state->compat_stale)
+    {
+        dtb_node* node = start;
+        uint32_t visited = 0;
+        while ((node = next_node(state, node)) != NULL && !node_is_compatible(node, str))
+            STAT_COUNT(visited);
+        STAT_ADD(state, compat_stats.visited, visited + (node != NULL));
+        return node;
+    }
+
+#ifdef SMOLDTB_COMPAT_INDEX
+    if (state->compat_bucket_count == 0)
+        return NULL;
+
+    const uint32_t hash = string_hash(str);
+    struct dtb_compat_entry* entry = NULL;
+    if (start != NULL)
+        entry = find_compat_entry(state, start, str, hash);
+    if (entry != NULL)
+        entry = entry->next_match; //common case: continuing from the previous match
+    else
+    {
+        uint32_t visited = 0;
+        entry = *find_compat_str(state, str, hash);
+        while (entry != NULL && start != NULL && !node_before(state, start, entry->node))
+        {
+            entry = entry->next_match;
+            STAT_COUNT(visited);
+        }
+        STAT_ADD(state, compat_stats.visited, visited);
+    }
+
+    STAT_ADD(state, compat_stats.visited, entry != NULL);
+    return entry ? entry->node : NULL;
+#elif defined(SMOLDTB_LAZY_PARSE)
+    //nodes only exist once they're needed, so search the blob and load the matching node.
+    uint32_t offset = start ? start->offset : 0;
+    uint32_t node_offset = ~0u;
+    uint32_t checked_offset = start ? start->offset : ~0u;
+    dtb_prop compat;
+    while (find_raw_prop(state, &offset, &node_offset, state->atoms.compatible, DTB_ATOM_INVALID, &compat))
+    {
+        //only a node's first 'compatible' counts, like with `dtb_find_prop()`.
+        if (node_offset == checked_offset)
+            continue;
+        checked_offset = node_offset;
+        STAT_ADD(state, compat_stats.visited, 1);
+        if (!list_has_string(&compat, str))
+            continue;
+
+        //nodes inside pruned subtrees can't be loaded, so the search carries on past them.
+        dtb_node* node = load_node_at(state, node_offset);
+        if (node != NULL)
+            return node;
+    }
+
+    return NULL;
+#else
+    uint32_t begin_index = 0;
+    if (start != NULL)
+    {
+        const uintptr_t offset = (uintptr_t)start - (uintptr_t)state->node_buff;
+        begin_index = offset / sizeof(dtb_node);
+        begin_index++; //we want to start searching AFTER this node.
+    }
+
+    uint32_t i = begin_index;
+    while (i < state->node_alloc_head && !node_is_compatible(&state->node_buff[i], str))
+        i++;
+
+    STAT_ADD(state, compat_stats.visited, i - begin_index + (i < state->node_alloc_head));
+    return i < state->node_alloc_head ? &state->node_buff[i] : NULL;
+#endif
+}
+
+dtb_node* dtb_find_compatible(dtb_node* start, const char* str)
+{
+    return dtb_find_compatible_ex(&default_state, start, str);
+}
+
+dtb_node* dtb_find_compatible_available_ex(dtb_state* state, dtb_node* start, const char* str)
+{
+    dtb_node* node = start;
+    while ((node = dtb_find_compatible_ex(state, node, str)) != NULL && !dtb_is_available(node))
+        ;
+    return node;
+}
+
+dtb_node* dtb_find_compatible_available(dtb_node* start, const char* str)
+{
+    return dtb_find_compatible_available_ex(&default_state, start, str);
+}
+
+static bool is_phandle_prop(const dtb_prop* prop)
+{
+    return strings_eq(prop->name, "phandle") || strings_eq(prop->name, "linux,phandle");
+}
+
+/* Returns whether any of a node's 'phandle' or 'linux,phandle' properties holds `handle`, which
+ * is how the phandle table (and the blob search in lazy mode) sees it.
+ */
+static bool node_has_phandle(dtb_node* node, uint32_t handle)
+{
+    if (!load_node(node))
+        return false;
+    for (uint32_t i = 0; i < node->prop_count; i++)
+    {
+        uint32_t value = 0;
+        if (is_phandle_prop(&node->props[i]) && read_single_cell(&node->props[i], &value) && value == handle)
+            return true;
+    }
+    return false;
+}
+
+dtb_node* dtb_find_phandle_ex(dtb_state* state, uint32_t handle)
+{
+    if (state == NULL || handle == 0 || handle == ~0u)
+        return NULL;
+    STAT_ADD(state, phandle_stats.calls, 1);
+    if (state->phandles_stale)
+    {
+        for (dtb_node* node = next_node(state, NULL); node != NULL; node = next_node(state, node))
+        {
+            STAT_ADD(state, phandle_stats.visited, 1);
+            if (node_has_phandle(node, handle))
+                return node;
+        }
+        return NULL;
+    }
+
+#ifdef SMOLDTB_LAZY_PARSE
+    uint32_t offset = 0;
+    uint32_t node_offset = ~0u;
+    dtb_prop prop;
+    while (find_raw_prop(state, &offset, &node_offset, state->atoms.phandle, state->atoms.linux_phandle, &prop))
+    {
+        STAT_ADD(state, phandle_stats.visited, 1);
+        uint32_t value = 0;
+        read_single_cell(&prop, &value);
+        dtb_node* node = value == handle ? load_node_at(state, node_offset) : NULL;
+        if (node != NULL)
+            return node;
+    }
+    return NULL;
+#else
+    struct dtb_phandle_slot* slot = find_phandle_slot(state, handle);
+#ifdef SMOLDTB_STATS
+    //probing is linear, so the number of slots looked at is the distance from the handle's hash.
+    const uint32_t mask = state->handle_slot_count - 1;
+    STAT_ADD(state, phandle_stats.visited, slot == NULL ? state->handle_slot_count
+        : (((uint32_t)(slot - state->handle_lookup) - hash_phandle(handle)) & mask) + 1);
+#endif
+    if (slot == NULL || slot->handle != handle)
+        return NULL;
+    return slot->node;
+#endif
+}
+
+dtb_node* dtb_find_phandle(uint32_t handle)
+{
+    return dtb_find_phandle_ex(&default_state, handle);
+}
+
+/* Returns whether a child's name matches the name being searched for. `unit_bounds` is the
+ * length of the searched name's unit name, and `has_addr` is set if it includes a unit address.
+ */
+static bool child_name_matches(const char* child_name, const char* name, uint32_t name_bounds,
+    uint32_t unit_bounds, bool has_addr)
+{
+    uint32_t child_name_len = string_find_char(child_name, '@');
+    if (has_addr || child_name_len == ~0u)
+        child_name_len = string_len(child_name);
+
+    const uint32_t bounds = has_addr ? name_bounds : unit_bounds;
+    return child_name_len == bounds && strings_eq_bounded(child_name, name, bounds);
+}
+
+/* Finds a child by name. If `name` includes a unit address it has to match the child's full
+ * name, otherwise only the unit name (the part before the '@') is compared. The number of
+ * children (or child index entries) looked at is added to `visited`.
+ */
+static dtb_node* find_child_internal(dtb_node* start, const char* name, uint32_t name_bounds, uint32_t* visited)
+{
+    if (!load_node(start))
+        return NULL;
+
+    uint32_t unit_bounds = 0;
+    while (unit_bounds < name_bounds && name[unit_bounds] != '@')
+        unit_bounds++;
+    const bool has_addr = unit_bounds < name_bounds;
+
+#ifdef SMOLDTB_CHILD_INDEX
+    if (start->child_index != NULL)
+    {
+        const struct dtb_child_entry* entries = start->child_index;
+        const uint32_t unit_hash = string_hash_bounded(name, unit_bounds);
+        const uint32_t full_hash = has_addr ? string_hash_bounded(name, name_bounds) : 0;
+
+        //find the first entry for this unit name (and full name, if there's a unit address)
+        uint32_t low = 0;
+        uint32_t high = start->child_count;
+        while (low < high)
+        {
+            STAT_COUNT(*visited);
+            const uint32_t mid = low + (high - low) / 2;
+            const bool less = entries[mid].unit_hash < unit_hash
+                || (has_addr && entries[mid].unit_hash == unit_hash && entries[mid].full_hash < full_hash);
+            if (less)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        //searching by unit name has to find the matching child that's earliest in the list.
+        const struct dtb_child_entry* found = NULL;
+        for (uint32_t i = low; i < start->child_count && entries[i].unit_hash == unit_hash; i++)
+        {
+            STAT_COUNT(*visited);
+            if (has_addr && entries[i].full_hash != full_hash)
+                break;
+            if (found != NULL && found->position < entries[i].position)
+                continue;
+            if (child_name_matches(entries[i].node->name, name, name_bounds, unit_bounds, has_addr))
+            {
+                found = &entries[i];
+                if (has_addr)
+                    break;
+            }
+        }
+        return found ? found->node : NULL;
+    }
+#endif
+
+#ifdef SMOLDTB_NODE_NAME_INFO
+    const uint32_t hash = string_hash_bounded(name, unit_bounds);
+    for (dtb_node* scan = start->child; scan != NULL; scan = scan->sibling)
+    {
+        STAT_COUNT(*visited);
+        if (scan->name_hash != hash || scan->unit_name_len != unit_bounds)
+            continue;
+        if (!has_addr)
+        {
+            if (strings_eq_bounded(scan->name, name, unit_bounds))
+                return scan;
+            continue;
+        }
+
+        if (scan->unit_addr_offset != 0 && strings_eq_bounded(scan->name, name, name_bounds)
+            && scan->name[name_bounds] == 0)
+            return scan;
+    }
+#else
+    for (dtb_node* scan = start->child; scan != NULL; scan = scan->sibling)
+    {
+        STAT_COUNT(*visited);
+        if (child_name_matches(scan->name, name, name_bounds, unit_bounds, has_addr))
+            return scan;
+    }
+#endif
+
+    return NULL;
+}
+
+/* Finds a node from the first `len` characters of a path. */
+static dtb_node* find_path_bounded(struct dtb_state* state, const char* name, uint32_t len)
+{
+    uint32_t seg_len;
+    uint32_t visited = 0;
+    dtb_node* scan = state->root;
     while (scan)
     {
-        while (name[0] == '/') {
-            name++;
-        }
+        while (len > 0 && name[0] == '/') {
+            name++;
+            len--;
+        }
+
+        seg_len = 0;
+        while (seg_len < len && name[seg_len] != '/')
+            seg_len++;
+        if (seg_len == 0)
+            break;
+
+        scan = find_child_internal(scan, name, seg_len, &visited);
+        name += seg_len;
+        len -= seg_len;
+    }
+
+    STAT_ADD(state, find_stats.visited, visited);
+    return scan;
+}
+
+static dtb_node* find_path(struct dtb_state* state, const char* name)
+{
+    return find_path_bounded(state, name, string_len(name));
+}
+
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+static struct dtb_path_cache_entry* path_cache_entry(struct dtb_state* state, uint32_t hash)
+{
+    return &state->path_cache[hash & (SMOLDTB_PATH_CACHE_SIZE - 1)];
+}
+
+/* Returns true and sets `node` if the result of looking up `path` is cached. */
+static bool path_cache_lookup(struct dtb_state* state, const char* path, uint32_t len, uint32_t hash, dtb_node** node)
+{
+    struct dtb_path_cache_entry* entry = path_cache_entry(state, hash);
+    const uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0 || (seq & 1) != 0)
+        return false;
+    if (__atomic_load_n(&entry->hash, __ATOMIC_RELAXED) != hash)
+        return false;
+    for (uint32_t i = 0; i <= len; i++)
+    {
+        if (__atomic_load_n(&entry->path[i], __ATOMIC_RELAXED) != path[i])
+            return false;
+    }
+    dtb_node* found = __atomic_load_n(&entry->node, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+        return false;
+    *node = found;
+    return true;
+}
+
+/* Caches the result of a lookup. If another thread is writing the same entry this does
+ * nothing rather than waiting for it.
+ */
+static void path_cache_store(struct dtb_state* state, const char* path, uint32_t len, uint32_t hash, dtb_node* node)
+{
+    struct dtb_path_cache_entry* entry = path_cache_entry(state, hash);
+    uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) != 0)
+        return;
+    if (!__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    __atomic_store_n(&entry->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->node, node, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i <= len; i++)
+        __atomic_store_n(&entry->path[i], path[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+#endif
+
+dtb_node* dtb_find_ex(dtb_state* state, const char* name)
+{
+    if (state == NULL)
+        return NULL;
+    STAT_ADD(state, find_stats.calls, 1);
+
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+    const uint32_t len = string_len(name);
+    if (len < SMOLDTB_PATH_CACHE_KEY_LEN)
+    {
+        const uint32_t hash = string_hash(name);
+        dtb_node* found;
+        if (path_cache_lookup(state, name, len, hash, &found))
+        {
+            __atomic_fetch_add(&state->path_cache_hits, 1, __ATOMIC_RELAXED);
+            return found;
+        }
+
+        __atomic_fetch_add(&state->path_cache_misses, 1, __ATOMIC_RELAXED);
+        found = find_path(state, name);
+        path_cache_store(state, name, len, hash, found);
+        return found;
+    }
+#endif
+
+    return find_path(state, name);
+}
+
+dtb_node* dtb_find(const char* name)
+{
+    return dtb_find_ex(&default_state, name);
+}
+
+dtb_node* dtb_find_child(dtb_node* start, const char* name)
+{
+    if (start == NULL)
+        return NULL;
+
+    uint32_t visited = 0;
+    return find_child_internal(start, name, string_len(name), &visited);
+}
+
+dtb_prop* dtb_find_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL || !load_node(node))
+        return NULL;
+
+    const uint32_t name_len = string_len(name);
+    dtb_prop* found = NULL;
+    uint32_t visited = 0;
+    while (found == NULL && visited < node->prop_count)
+    {
+        dtb_prop* prop = &node->props[visited++];
+        const uint32_t prop_name_len = string_len(prop->name);
+        if (prop_name_len == name_len && strings_eq(prop->name, name))
+            found = prop;
+    }
+
+    STAT_ADD(node->owner, prop_stats.calls, 1);
+    STAT_ADD(node->owner, prop_stats.visited, visited);
+    return found;
+}
+
+dtb_atom dtb_intern_ex(dtb_state* state, const char* name)
+{
+    if (state == NULL || name == NULL || state->strings == NULL)
+        return DTB_ATOM_INVALID;
+    return intern_string(state, name);
+}
+
+dtb_atom dtb_intern(const char* name)
+{
+    return dtb_intern_ex(&default_state, name);
+}
+
+dtb_prop* dtb_find_prop_interned_ex(dtb_state* state, dtb_node* node, dtb_atom atom)
+{
+    if (state == NULL || node == NULL || atom == DTB_ATOM_INVALID || !load_node(node))
+        return NULL;
+
+    if (atom & ATOM_AMBIGUOUS)
+    {
+        for (uint32_t i = 0; i < node->prop_count; i++)
+        {
+            if (prop_is_atom(state, &node->props[i], atom))
+                return &node->props[i];
+        }
+        return NULL;
+    }
+
+    const char* name = state->strings + atom;
+    for (uint32_t i = 0; i < node->prop_count; i++)
+    {
+        if (node->props[i].name == name)
+            return &node->props[i];
+    }
+    return NULL;
+}
+
+dtb_prop* dtb_find_prop_interned(dtb_node* node, dtb_atom atom)
+{
+    return dtb_find_prop_interned_ex(&default_state, node, atom);
+}
+
+/* Looks up several properties with a single pass over the node's properties. Each entry of
+ * `props` is set to the first property with the matching name (or NULL), and the number of
+ * names that were found is returned.
+ */
+uint32_t dtb_find_props(dtb_node* node, const char* const* names, uint32_t count, dtb_prop** props)
+{
+    if (props == NULL)
+        return 0;
+    for (uint32_t i = 0; i < count; i++)
+        props[i] = NULL;
+    if (node == NULL || names == NULL || !load_node(node))
+        return 0;
+
+    uint32_t found = 0;
+    for (uint32_t pi = 0; pi < node->prop_count && found < count; pi++)
+    {
+        dtb_prop* prop = &node->props[pi];
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (props[i] != NULL || names[i] == NULL || !strings_eq(prop->name, names[i]))
+                continue;
+            props[i] = prop;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+uint32_t dtb_find_props_interned_ex(dtb_state* state, dtb_node* node, const dtb_atom* atoms, uint32_t count, dtb_prop** props)
+{
+    if (props == NULL)
+        return 0;
+    for (uint32_t i = 0; i < count; i++)
+        props[i] = NULL;
+    if (state == NULL || node == NULL || atoms == NULL || !load_node(node))
+        return 0;
+
+    uint32_t found = 0;
+    for (uint32_t pi = 0; pi < node->prop_count && found < count; pi++)
+    {
+        dtb_prop* prop = &node->props[pi];
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (props[i] != NULL || atoms[i] == DTB_ATOM_INVALID || !prop_is_atom(state, prop, atoms[i]))
+                continue;
+            props[i] = prop;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+uint32_t dtb_find_props_interned(dtb_node* node, const dtb_atom* atoms, uint32_t count, dtb_prop** props)
+{
+    return dtb_find_props_interned_ex(&default_state, node, atoms, count, props);
+}
+
+dtb_node* dtb_get_sibling(dtb_node* node)
+{
+    if (node == NULL || node->sibling == NULL)
+        return NULL;
+    return node->sibling;
+}
+
+dtb_node* dtb_get_child(dtb_node* node)
+{
+    if (node == NULL || !load_node(node))
+        return NULL;
+    return node->child;
+}
+
+dtb_node* dtb_get_parent(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    return node->parent;
+}
+
+/* Returns the first node from `node` onwards (following sibling pointers) that's available. */
+static dtb_node* skip_unavailable(dtb_node* node)
+{
+    while (node != NULL && !node_is_available(node))
+        node = node->sibling;
+    return node;
+}
+
+dtb_node* dtb_get_available_sibling(dtb_node* node)
+{
+    return skip_unavailable(dtb_get_sibling(node));
+}
+
+dtb_node* dtb_get_available_child(dtb_node* node)
+{
+    return skip_unavailable(dtb_get_child(node));
+}
+
+bool dtb_is_available(dtb_node* node)
+{
+    if (node == NULL)
+        return false;
+    for (; node != NULL; node = node->parent)
+    {
+        if (!node_is_available(node))
+            return false;
+    }
+    return true;
+}
+
+dtb_prop* dtb_get_prop(dtb_node* node, uint32_t index)
+{
+    if (node == NULL || !load_node(node) || index >= node->prop_count)
+        return NULL;
+
+    return &node->props[index];
+}
+
+void dtb_stat_node(dtb_node* node, dtb_node_stat* stat)
+{
+    if (node == NULL)
+        return;
+    load_node(node);
+
+    const bool is_root = node->parent == NULL && node->name[0] == 0;
+    stat->name = is_root ? ROOT_NODE_STR : node->name;
+
+    stat->prop_count = node->prop_count;
+    stat->child_count = node->child_count;
+    stat->sibling_count = node->parent ? node->parent->child_count : 0;
+}
+
+#ifdef SMOLDTB_STATS
+static void load_call_stats(const dtb_call_stats* counters, dtb_call_stats* stats)
+{
+    stats->calls = __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+    stats->visited = __atomic_load_n(&counters->visited, __ATOMIC_RELAXED);
+}
+
+/* Fills in the memory and table usage part of `dtb_get_stats()`. */
+static void get_usage_stats(struct dtb_state* state, dtb_stats* stats)
+{
+    for (struct dtb_chunk* chunk = state->chunks; chunk != NULL; chunk = chunk->prev)
+    {
+        stats->chunk_size += chunk->size;
+        stats->chunk_used += chunk->used;
+    }
+#ifdef SMOLDTB_LAZY_PARSE
+    stats->node_count = __atomic_load_n(&state->loaded_nodes, __ATOMIC_RELAXED);
+    stats->prop_count = __atomic_load_n(&state->loaded_props, __ATOMIC_RELAXED);
+#else
+    stats->arena_size = state->buffer_size;
+    stats->arena_used = state->node_alloc_head * sizeof(dtb_node) + state->prop_alloc_head * sizeof(dtb_prop);
+    if (phandle_table_in_arena(state))
+        stats->arena_used += state->handle_slot_count * sizeof(struct dtb_phandle_slot);
+#ifdef SMOLDTB_COMPAT_INDEX
+    stats->arena_used += state->compat_alloc_head * sizeof(struct dtb_compat_entry)
+        + state->compat_bucket_count * sizeof(void*);
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    stats->arena_used += state->child_entry_alloc_head * sizeof(struct dtb_child_entry);
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    stats->arena_used += state->imap_alloc_head * sizeof(struct dtb_imap_entry);
+#endif
+    stats->node_count = state->node_alloc_head;
+    stats->prop_count = state->prop_alloc_head;
+    stats->phandle_slots = state->handle_slot_count;
+    for (uint32_t i = 0; i < state->handle_slot_count; i++)
+    {
+        if (state->handle_lookup[i].handle != 0)
+            stats->phandle_used++;
+    }
+#endif
+}
+#endif
+
+void dtb_get_stats_ex(dtb_state* state, dtb_stats* stats)
+{
+    if (state == NULL || stats == NULL)
+        return;
+
+    const dtb_stats empty = { 0 };
+    *stats = empty;
+#ifdef SMOLDTB_PATH_CACHE_SIZE
+    stats->path_cache_hits = __atomic_load_n(&state->path_cache_hits, __ATOMIC_RELAXED);
+    stats->path_cache_misses = __atomic_load_n(&state->path_cache_misses, __ATOMIC_RELAXED);
+#endif
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+    stats->ranges_cache_hits = __atomic_load_n(&state->ranges_cache_hits, __ATOMIC_RELAXED);
+    stats->ranges_cache_misses = __atomic_load_n(&state->ranges_cache_misses, __ATOMIC_RELAXED);
+#endif
+#ifdef SMOLDTB_STATS
+    get_usage_stats(state, stats);
+    load_call_stats(&state->find_stats, &stats->find);
+    load_call_stats(&state->compat_stats, &stats->find_compatible);
+    load_call_stats(&state->prop_stats, &stats->find_prop);
+    load_call_stats(&state->phandle_stats, &stats->find_phandle);
+#endif
+}
+
+void dtb_get_stats(dtb_stats* stats)
+{
+    dtb_get_stats_ex(&default_state, stats);
+}
+
+bool dtb_get_memreserve_ex(dtb_state* state, uint32_t index, dtb_reg* entry)
+{
+    if (state == NULL || entry == NULL || index >= state->memreserve_count)
+        return false;
+
+    entry->base = read_rsvd_u64(&state->memreserve[index].base);
+    entry->size = read_rsvd_u64(&state->memreserve[index].length);
+    return true;
+}
+
+bool dtb_get_memreserve(uint32_t index, dtb_reg* entry)
+{
+    return dtb_get_memreserve_ex(&default_state, index, entry);
+}
+
+const dtb_reg* dtb_get_reserved_ranges_ex(dtb_state* state, uint32_t* count)
+{
+    if (count != NULL)
+        *count = state != NULL ? state->reserved_range_count : 0;
+    return state != NULL ? state->reserved_ranges : NULL;
+}
+
+const dtb_reg* dtb_get_reserved_ranges(uint32_t* count)
+{
+    return dtb_get_reserved_ranges_ex(&default_state, count);
+}
+
+bool dtb_get_topology_ex(dtb_state* state, dtb_topology* topology)
+{
+    if (topology == NULL)
+        return false;
+
+    topology->cpus = NULL;
+    topology->cpu_count = 0;
+    topology->memory = NULL;
+    topology->memory_count = 0;
+#ifdef SMOLDTB_TOPOLOGY
+    if (state == NULL || state->root == NULL)
+        return false;
+    topology->cpus = state->cpus;
+    topology->cpu_count = state->cpu_count;
+    topology->memory = state->memory;
+    topology->memory_count = state->memory_count;
+    return true;
+#else
+    (void)state;
+    return false;
+#endif
+}
+
+bool dtb_get_topology(dtb_topology* topology)
+{
+    return dtb_get_topology_ex(&default_state, topology);
+}
+
+bool dtb_cursor_init(dtb_cursor* cursor, uintptr_t start)
+{
+    if (cursor == NULL)
+        return false;
+
+    const struct fdt_header* header = (const struct fdt_header*)start;
+    if (be32(header->magic) != FDT_MAGIC)
+        return false;
+
+    cursor->cells = (const uint32_t*)(start + be32(header->offset_structs));
+    cursor->cell_count = be32(header->size_structs) / sizeof(uint32_t);
+    cursor->strings = (const char*)(start + be32(header->offset_strings));
+    cursor->strings_size = be32(header->size_strings);
+    cursor->offset = 0;
+    cursor->depth = 0;
+    cursor->finished = false;
+    return true;
+}
+
+/* Moves the cursor inside the node whose BEGIN_NODE token is at `offset`, filling in the event for it. */
+static void cursor_enter_node(dtb_cursor* cursor, uint32_t offset, dtb_cursor_event* event)
+{
+    if (event != NULL)
+    {
+        event->type = DTB_EVENT_BEGIN_NODE;
+        event->depth = cursor->depth;
+        event->name = (const char*)(cursor->cells + offset + 1);
+    }
+    cursor->offset = skip_node_name(cursor->cells, offset);
+    cursor->depth++;
+}
+
+/* Produces the next event, returns false once the cursor has left the node it started in (or
+ * reached the end of the structure block).
+ */
+bool dtb_cursor_next(dtb_cursor* cursor, dtb_cursor_event* event)
+{
+    if (cursor == NULL || event == NULL)
+        return false;
+
+    while (!cursor->finished && cursor->offset < cursor->cell_count)
+    {
+        const uint32_t token = be32(cursor->cells[cursor->offset]);
+        if (token == FDT_BEGIN_NODE)
+        {
+            cursor_enter_node(cursor, cursor->offset, event);
+            return true;
+        }
+        else if (token == FDT_PROP)
+        {
+            if (cursor->depth == 0 || cursor->offset + 2 >= cursor->cell_count)
+                break;
+            event->type = DTB_EVENT_PROP;
+            event->depth = cursor->depth - 1;
+            cursor->offset = read_prop(cursor->cells, cursor->strings, cursor->offset, &event->prop);
+            event->name = event->prop.name;
+            return true;
+        }
+        else if (token == FDT_END_NODE)
+        {
+            if (cursor->depth == 0)
+                break;
+            cursor->offset++;
+            cursor->depth--;
+            event->type = DTB_EVENT_END_NODE;
+            event->depth = cursor->depth;
+            event->name = NULL;
+            cursor->finished = cursor->depth == 0;
+            return true;
+        }
+        else if (token == FDT_END)
+            break;
+        else
+            cursor->offset++;
+    }
+
+    cursor->finished = true;
+    return false;
+}
+
+/* Like `dtb_find()`, but walks the blob. Only the tokens of the nodes along the path and their
+ * direct children are read, the subtrees of other children are skipped over.
+ */
+bool dtb_cursor_find(dtb_cursor* cursor, const char* path, dtb_cursor_event* node)
+{
+    if (cursor == NULL || path == NULL)
+        return false;
+
+    const uint32_t* cells = cursor->cells;
+    uint32_t found = 0;
+    while (found < cursor->cell_count && be32(cells[found]) != FDT_BEGIN_NODE)
+    {
+        if (be32(cells[found]) == FDT_END)
+            return false;
+        found++;
+    }
+    if (found >= cursor->cell_count)
+        return false;
+
+    while (true)
+    {
+        while (path[0] == '/')
+            path++;
+        uint32_t seg_len = string_find_char(path, '/');
+        if (seg_len == ~0u)
+            seg_len = string_len(path);
+        if (seg_len == 0)
+            break;
+
+        uint32_t unit_bounds = 0;
+        while (unit_bounds < seg_len && path[unit_bounds] != '@')
+            unit_bounds++;
+        const bool has_addr = unit_bounds < seg_len;
+
+        uint32_t match = ~0u;
+        uint32_t i = skip_node_name(cells, found);
+        while (i < cursor->cell_count && match == ~0u)
+        {
+            const uint32_t token = be32(cells[i]);
+            if (token == FDT_BEGIN_NODE)
+            {
+                if (child_name_matches((const char*)(cells + i + 1), path, seg_len, unit_bounds, has_addr))
+                    match = i;
+                else
+                    i = skip_node(cells, cursor->cell_count, i);
+            }
+            else if (token == FDT_PROP && i + 2 < cursor->cell_count)
+                i = skip_prop(cells, i);
+            else if (token == FDT_NOP)
+                i++;
+            else
+                break;
+        }
+        if (match == ~0u)
+            return false;
+
+        found = match;
+        path += seg_len;
+    }
+
+    cursor->depth = 0;
+    cursor->finished = false;
+    cursor_enter_node(cursor, found, node);
+    return true;
+}
+
+/* Like `dtb_find_compatible()`, searching from the cursor's position onwards (so the node the
+ * cursor is currently in isn't checked).
+ */
+bool dtb_cursor_find_compatible(dtb_cursor* cursor, const char* str, dtb_cursor_event* node)
+{
+    if (cursor == NULL || str == NULL)
+        return false;
+
+    uint32_t node_offset = ~0u;
+    uint32_t i = cursor->offset;
+    while (i < cursor->cell_count)
+    {
+        const uint32_t token = be32(cursor->cells[i]);
+        if (token == FDT_BEGIN_NODE)
+        {
+            node_offset = i;
+            i = skip_node_name(cursor->cells, i);
+            continue;
+        }
+        else if (token == FDT_END)
+            break;
+        else if (token != FDT_PROP)
+        {
+            if (token == FDT_END_NODE)
+                node_offset = ~0u; //properties after a child node belong to no node.
+            i++;
+            continue;
+        }
+
+        if (i + 2 >= cursor->cell_count)
+            break;
+        dtb_prop prop;
+        const uint32_t name_offset = be32(cursor->cells[i + 2]);
+        i = read_prop(cursor->cells, cursor->strings, i, &prop);
+        if (node_offset == ~0u || name_offset >= cursor->strings_size || !strings_eq(prop.name, "compatible"))
+            continue;
+
+        //only the node's first 'compatible' is checked, the same as `dtb_find_compatible()`.
+        const uint32_t checked = node_offset;
+        node_offset = ~0u;
+        if (list_has_string(&prop, str))
+        {
+            cursor->depth = 0;
+            cursor->finished = false;
+            cursor_enter_node(cursor, checked, node);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Converts an array of big-endian cells to native endianness. Properties like 'ranges' and
+ * 'interrupt-map' can have thousands of cells, so this swaps 4 cells at a time where the
+ * target has vector byte shuffles. The scalar loop handles the rest (and everything on other targets).
+ */
+static void extract_cells(const uint32_t* cells, uint32_t count, uint32_t* vals)
+{
+    uint32_t i = 0;
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__ && !defined(SMOLDTB_NO_SIMD)
+#if defined(__SSSE3__)
+    const __m128i shuffle = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i raw = _mm_loadu_si128((const __m128i*)(cells + i));
+        _mm_storeu_si128((__m128i*)(vals + i), _mm_shuffle_epi8(raw, shuffle));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(cells + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); //swap the bytes in each half
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1); //then swap the halves
+        _mm_storeu_si128((__m128i*)(vals + i), v);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4)
+        vst1q_u32(vals + i, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((const uint8_t*)(cells + i)))));
+#endif
+#endif
+    for (; i < count; i++)
+        vals[i] = be32(cells[i]);
+}
+
+const char* dtb_read_prop_string(dtb_prop* prop, uint32_t index)
+{
+    if (prop == NULL)
+        return NULL;
+    
+    const uint8_t* name = (const uint8_t*)prop->first_cell;
+    uint32_t curr_index = 0;
+    for (uint32_t scan = 0; scan < prop->length; scan++)
+    {
+        if (name[scan] == 0)
+        {
+            curr_index++;
+            continue;
+        }
+        if (curr_index == index)
+            return (const char*)&name[scan];
+    }
+
+    return NULL;
+}
+
+uint32_t dtb_read_prop_bytestring(dtb_prop* prop, char* vals)
+{
+    if (prop == NULL)
+        return 0;
+    
+    const uint32_t count = prop->length;
+    if (vals == NULL)
+        return count;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char* base = (char*)prop->first_cell;
+        vals[i] = base[i];
+    }
+
+    return count;
+}
+
+uint32_t dtb_read_prop_cell_array(dtb_prop* prop, uint32_t cell_count, uint32_t* vals)
+{
+    if (prop == NULL || cell_count == 0)
+        return 0;
+    
+    const uint32_t count = prop->length / (cell_count * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    //the values are back to back, so they can be decoded in one go.
+    extract_cells(prop->first_cell, count * cell_count, vals);
+    return count;
+}
+
+/* The cell counts used for a node's 'reg' and its place in its parent's address space come
+ * from the parent, the root's reg uses the defaults from the spec.
+ */
+static void get_parent_cells(dtb_node* node, uint32_t* addr_cells, uint32_t* size_cells)
+{
+    *addr_cells = node->parent ? node->parent->addr_cells : 2;
+    *size_cells = node->parent ? node->parent->size_cells : 1;
+}
+
+uint32_t dtb_read_reg(dtb_node* node, dtb_reg* vals)
+{
+    dtb_prop* prop = dtb_find_prop(node, "reg");
+    if (prop == NULL)
+        return 0;
+
+    uint32_t addr_cells, size_cells;
+    get_parent_cells(node, &addr_cells, &size_cells);
+    const uint32_t entry_cells = addr_cells + size_cells;
+    if (entry_cells == 0)
+        return 0;
+
+    const uint32_t count = prop->length / (entry_cells * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    const uint32_t* cells = prop->first_cell;
+    for (uint32_t i = 0; i < count; i++, cells += entry_cells)
+    {
+        vals[i].base = read_cells_u64(cells, addr_cells);
+        vals[i].size = read_cells_u64(cells + addr_cells, size_cells);
+    }
+
+    return count;
+}
+
+uint32_t dtb_read_ranges(dtb_node* node, const char* name, dtb_range* vals)
+{
+    dtb_prop* prop = dtb_find_prop(node, name ? name : "ranges");
+    if (prop == NULL)
+        return 0;
+
+    uint32_t parent_cells, unused;
+    get_parent_cells(node, &parent_cells, &unused);
+    const uint32_t child_cells = node->addr_cells;
+    const uint32_t size_cells = node->size_cells;
+    const uint32_t entry_cells = child_cells + parent_cells + size_cells;
+    if (entry_cells == 0)
+        return 0;
+
+    const uint32_t count = prop->length / (entry_cells * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    const uint32_t* cells = prop->first_cell;
+    for (uint32_t i = 0; i < count; i++, cells += entry_cells)
+    {
+        vals[i].child_base = read_cells_u64(cells, child_cells);
+        vals[i].parent_base = read_cells_u64(cells + child_cells, parent_cells);
+        vals[i].size = read_cells_u64(cells + child_cells + parent_cells, size_cells);
+    }
+
+    return count;
+}
+
+/* Maps an address through one set of ranges, returns false if no range contains it. */
+static bool apply_ranges(const dtb_range* ranges, uint32_t count, uint64_t* addr)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (*addr >= ranges[i].child_base && *addr - ranges[i].child_base < ranges[i].size)
+        {
+            *addr = *addr - ranges[i].child_base + ranges[i].parent_base;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Maps an address on a bus to the bus's parent address space by decoding its 'ranges'
+ * property directly, one entry at a time.
+ */
+static bool translate_uncached(dtb_node* bus, uint64_t* addr)
+{
+    dtb_prop* prop = dtb_find_prop(bus, "ranges");
+    if (prop == NULL)
+        return false;
+    if (prop->length == 0)
+        return true;
+
+    uint32_t parent_cells, unused;
+    get_parent_cells(bus, &parent_cells, &unused);
+    const uint32_t entry_cells = bus->addr_cells + parent_cells + bus->size_cells;
+    if (entry_cells == 0)
+        return false;
+
+    const uint32_t count = prop->length / (entry_cells * FDT_CELL_SIZE);
+    const uint32_t* cells = prop->first_cell;
+    for (uint32_t i = 0; i < count; i++, cells += entry_cells)
+    {
+        dtb_range range;
+        range.child_base = read_cells_u64(cells, bus->addr_cells);
+        range.parent_base = read_cells_u64(cells + bus->addr_cells, parent_cells);
+        range.size = read_cells_u64(cells + bus->addr_cells + parent_cells, bus->size_cells);
+        if (apply_ranges(&range, 1, addr))
+            return true;
+    }
+    return false;
+}
+
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+static uint32_t hash_node(const dtb_node* node)
+{
+    return (uint32_t)((uintptr_t)node / sizeof(dtb_node)) * 0x9E3779B1u;
+}
+
+/* Returns the published cache entry for a bus, or NULL. If the bus isn't cached and there's
+ * an empty entry it's filled in, unless the bus has too many ranges.
+ */
+static struct dtb_ranges_cache_entry* ranges_cache_get(struct dtb_state* state, dtb_node* bus)
+{
+    const uint32_t mask = SMOLDTB_RANGES_CACHE_SIZE - 1;
+    uint32_t index = hash_node(bus) & mask;
+    for (uint32_t i = 0; i < SMOLDTB_RANGES_CACHE_SIZE; i++, index = (index + 1) & mask)
+    {
+        struct dtb_ranges_cache_entry* entry = &state->ranges_cache[index];
+        dtb_node* cached = __atomic_load_n(&entry->node, __ATOMIC_ACQUIRE);
+        if (cached == bus)
+        {
+            __atomic_fetch_add(&state->ranges_cache_hits, 1, __ATOMIC_RELAXED);
+            return entry;
+        }
+        if (cached != NULL || __atomic_load_n(&entry->claimed, __ATOMIC_RELAXED) != 0)
+            continue;
+
+        __atomic_fetch_add(&state->ranges_cache_misses, 1, __ATOMIC_RELAXED);
+        dtb_prop* prop = dtb_find_prop(bus, "ranges");
+        const uint32_t count = dtb_read_ranges(bus, "ranges", NULL);
+        if (prop != NULL && count > SMOLDTB_RANGES_CACHE_MAX)
+            return NULL;
+
+        uint32_t expected = 0;
+        if (!__atomic_compare_exchange_n(&entry->claimed, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return NULL; //someone else is filling this entry, don't wait for them.
+
+        if (prop == NULL)
+            entry->count = RANGES_UNTRANSLATABLE;
+        else if (prop->length == 0)
+            entry->count = RANGES_IDENTITY;
+        else
+            entry->count = dtb_read_ranges(bus, "ranges", entry->ranges);
+        __atomic_store_n(&entry->node, bus, __ATOMIC_RELEASE);
+        return entry;
+    }
+
+    return NULL;
+}
+#endif
+
+/* Translates an address from a node's 'reg' (which is in the address space of its parent)
+ * to a CPU physical address, by applying the 'ranges' of each bus between it and the root.
+ */
+bool dtb_translate_address_ex(dtb_state* state, dtb_node* node, uint64_t addr, uint64_t* cpu_addr)
+{
+    if (state == NULL || node == NULL || cpu_addr == NULL)
+        return false;
+
+    for (dtb_node* bus = node->parent; bus != NULL && bus->parent != NULL; bus = bus->parent)
+    {
+#ifdef SMOLDTB_RANGES_CACHE_SIZE
+        const struct dtb_ranges_cache_entry* entry = ranges_cache_get(state, bus);
+        if (entry != NULL)
+        {
+            if (entry->count == RANGES_UNTRANSLATABLE)
+                return false;
+            if (entry->count != RANGES_IDENTITY && !apply_ranges(entry->ranges, entry->count, &addr))
+                return false;
+            continue;
+        }
+#endif
+        if (!translate_uncached(bus, &addr))
+            return false;
+    }
+
+    *cpu_addr = addr;
+    return true;
+}
+
+bool dtb_translate_address(dtb_node* node, uint64_t addr, uint64_t* cpu_addr)
+{
+    return dtb_translate_address_ex(&default_state, node, addr, cpu_addr);
+}
+
+uint32_t dtb_get_interrupt_cells(dtb_node* node)
+{
+    if (node == NULL)
+        return 0;
+    return get_interrupt_cells(node);
+}
+
+dtb_node* dtb_get_interrupt_parent_ex(dtb_state* state, dtb_node* node)
+{
+    if (state == NULL || node == NULL)
+        return NULL;
+#ifdef SMOLDTB_INTERRUPT_INFO
+    if (!state->interrupts_stale)
+        return node->interrupt_parent;
+#endif
+    return find_interrupt_parent(state, node);
+}
+
+dtb_node* dtb_get_interrupt_parent(dtb_node* node)
+{
+    return dtb_get_interrupt_parent_ex(&default_state, node);
+}
+
+/* Follows the `index`th interrupt of a node through any nexus nodes to the controller that
+ * receives it, translating the specifier on the way.
+ */
+bool dtb_resolve_interrupt_ex(dtb_state* state, dtb_node* node, uint32_t index, dtb_interrupt* irq)
+{
+    if (state == NULL || node == NULL || irq == NULL)
+        return false;
+
+    uint32_t spec[DTB_MAX_INTERRUPT_CELLS];
+    uint32_t spec_cells = 0;
+    dtb_node* domain = get_interrupt_spec(state, node, index, spec, &spec_cells);
+
+    //the unit address used to match the first interrupt-map is the first cells of the node's
+    //'reg', after that it's the parent unit address from the matching map entry.
+    dtb_prop* reg = dtb_find_prop(node, "reg");
+    const uint32_t* addr = reg ? reg->first_cell : NULL;
+    uint32_t addr_len = reg ? reg->length / FDT_CELL_SIZE : 0;
+
+    for (uint32_t depth = 0; domain != NULL && depth < INTERRUPT_MAX_DEPTH; depth++)
+    {
+        const bool is_nexus = dtb_find_prop(domain, "interrupt-map") != NULL;
+        if (!is_nexus && dtb_find_prop(domain, "interrupt-controller") != NULL)
+        {
+            irq->controller = domain;
+            irq->cell_count = spec_cells;
+            for (uint32_t i = 0; i < spec_cells; i++)
+                irq->cells[i] = spec[i];
+            return true;
+        }
+        if (!is_nexus)
+        {
+            domain = dtb_get_interrupt_parent_ex(state, domain);
+            if (domain == NULL || get_interrupt_cells(domain) != spec_cells)
+                return false;
+            continue;
+        }
+
+        const uint32_t addr_cells = get_imap_addr_cells(domain);
+        const uint32_t child_cells = addr_cells + spec_cells;
+        if (addr_cells > IMAP_MAX_ADDR_CELLS || spec_cells != get_interrupt_cells(domain))
+            return false;
+
+        uint32_t key[IMAP_MAX_ADDR_CELLS + DTB_MAX_INTERRUPT_CELLS];
+        uint32_t mask[IMAP_MAX_ADDR_CELLS + DTB_MAX_INTERRUPT_CELLS];
+        read_imap_mask(domain, child_cells, mask);
+        for (uint32_t i = 0; i < addr_cells; i++)
+            key[i] = (i < addr_len ? be32(addr[i]) : 0) & mask[i];
+        for (uint32_t i = 0; i < spec_cells; i++)
+            key[addr_cells + i] = spec[i] & mask[addr_cells + i];
+
+        struct dtb_imap_entry entry;
+        if (!find_imap_entry(state, domain, key, mask, child_cells, &entry))
+            return false;
+        if (entry.parent_int_cells > DTB_MAX_INTERRUPT_CELLS)
+            return false;
+
+        addr = entry.parent_cells;
+        addr_len = entry.parent_addr_cells;
+        spec_cells = entry.parent_int_cells;
+        for (uint32_t i = 0; i < spec_cells; i++)
+            spec[i] = be32(entry.parent_cells[addr_len + i]);
+        domain = entry.parent;
+    }
+
+    return false;
+}
+
+bool dtb_resolve_interrupt(dtb_node* node, uint32_t index, dtb_interrupt* irq)
+{
+    return dtb_resolve_interrupt_ex(&default_state, node, index, irq);
+}
+
+/* Output position while serializing a tree. The same walk is used to measure the blob (with
+ * `buffer` set to NULL) and to write it, so the two always agree.
+ */
+struct dtb_writer
+{
+    uint8_t* buffer;
+    uint32_t offset;
+};
+
+static void write_bytes(struct dtb_writer* writer, const void* data, uint32_t length)
+{
+    if (writer->buffer != NULL)
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        for (uint32_t i = 0; i < length; i++)
+            writer->buffer[writer->offset + i] = bytes[i];
+    }
+    writer->offset += length;
+}
+
+static void write_cell(struct dtb_writer* writer, uint32_t value)
+{
+    const uint32_t cell = be32(value);
+    write_bytes(writer, &cell, FDT_CELL_SIZE);
+}
+
+/* Pads the output with zeroes up to the next cell boundary. */
+static void write_padding(struct dtb_writer* writer)
+{
+    const uint8_t zeroes[FDT_CELL_SIZE] = { 0 };
+    write_bytes(writer, zeroes, dtb_align_up(writer->offset, FDT_CELL_SIZE) - writer->offset);
+}
+
+/* Returns where a property's name is in the strings block, names from the blob keep their
+ * offsets and added names come after them.
+ */
+static uint32_t get_name_offset(struct dtb_state* state, const char* name)
+{
+    if (name_in_strings(state, name))
+        return (uint32_t)(name - state->strings);
+
+    const struct dtb_added_name* added = (const struct dtb_added_name*)(name - offsetof(struct dtb_added_name, name));
+    return added->offset;
+}
+
+/* Emits a node and everything below it into the structure block. */
+static bool write_node(struct dtb_state* state, struct dtb_writer* writer, dtb_node* node)
+{
+    if (!load_node(node))
+        return false;
+
+    write_cell(writer, FDT_BEGIN_NODE);
+    write_bytes(writer, node->name, string_len(node->name) + 1);
+    write_padding(writer);
+
+    for (uint32_t i = 0; i < node->prop_count; i++)
+    {
+        const dtb_prop* prop = &node->props[i];
+        write_cell(writer, FDT_PROP);
+        write_cell(writer, prop->length);
+        write_cell(writer, get_name_offset(state, prop->name));
+        write_bytes(writer, prop->first_cell, prop->length);
+        write_padding(writer);
+    }
+
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+    {
+        if (!write_node(state, writer, child))
+            return false;
+    }
+
+    write_cell(writer, FDT_END_NODE);
+    return true;
+}
+
+/* Serializes the parsed tree into a new blob: the header, followed by the memory reservation
+ * block, structure block and strings block, in that order. The strings block is the blob's
+ * own (dtc already deduplicates it), followed by any names added by `dtb_set_prop()`.
+ */
+uint32_t dtb_write_ex(dtb_state* state, void* buffer, uint32_t buffer_size)
+{
+    if (state == NULL || state->root == NULL)
+        return 0;
+
+    const uint32_t reserved_count = state->memreserve_count;
+    const uint32_t reserved_offset = dtb_align_up(sizeof(struct fdt_header), sizeof(uint64_t));
+    const uint32_t struct_offset = reserved_offset + (reserved_count + 1) * sizeof(struct fdt_reserved_mem_entry);
+
+    //measure the structure block first, so the size is known before anything is written.
+    struct dtb_writer writer = { NULL, 0 };
+    for (dtb_node* root = state->root; root != NULL; root = root->sibling)
+    {
+        if (!write_node(state, &writer, root))
+            return 0;
+    }
+    write_cell(&writer, FDT_END);
+    const uint32_t struct_size = writer.offset;
+    const uint32_t strings_offset = struct_offset + struct_size;
+    const uint32_t strings_size = state->strings_size + state->added_strings_size;
+    const uint32_t total_size = strings_offset + strings_size;
+    if (buffer == NULL || buffer_size < total_size)
+        return total_size;
+
+    writer.buffer = (uint8_t*)buffer;
+    writer.offset = 0;
+    write_cell(&writer, FDT_MAGIC);
+    write_cell(&writer, total_size);
+    write_cell(&writer, struct_offset);
+    write_cell(&writer, strings_offset);
+    write_cell(&writer, reserved_offset);
+    write_cell(&writer, FDT_VERSION);
+    write_cell(&writer, FDT_LAST_COMP_VERSION);
+    write_cell(&writer, be32(state->header->boot_cpu_id));
+    write_cell(&writer, strings_size);
+    write_cell(&writer, struct_size);
+    while (writer.offset < reserved_offset)
+        write_cell(&writer, 0);
+
+    //reservation entries are already big-endian, so they're copied as they are.
+    write_bytes(&writer, state->memreserve, reserved_count * sizeof(struct fdt_reserved_mem_entry));
+    const struct fdt_reserved_mem_entry terminator = { 0, 0 };
+    write_bytes(&writer, &terminator, sizeof(terminator));
+
+    for (dtb_node* root = state->root; root != NULL; root = root->sibling)
+        write_node(state, &writer, root);
+    write_cell(&writer, FDT_END);
+    write_bytes(&writer, state->strings, state->strings_size);
+    for (const struct dtb_added_name* added = state->added_names; added != NULL; added = added->next)
+        write_bytes(&writer, added->name, string_len(added->name) + 1);
+
+    return total_size;
+}
+
+uint32_t dtb_write(void* buffer, uint32_t buffer_size)
+{
+    return dtb_write_ex(&default_state, buffer, buffer_size);
+}
+
+/* An index is this header followed by a copy of an instance's arena, at `INDEX_ARENA_OFFSET`.
+ * The pointers in the arena are left as addresses: `arena_base` and `blob_base` record where
+ * the arena and blob were when they were last valid, so if neither has moved the index can be
+ * used as it is, and otherwise each pointer is moved by however far its target moved. It's in
+ * the native byte order and struct layout, `layout` records enough of both (and the options that
+ * change the arena) that an index from a different build is refused.
+ */
+#define INDEX_MAGIC 0x534d4958 //"SMIX"
+#define INDEX_VERSION 2
+#define INDEX_FLAG_PHANDLES_STALE (1 << 0)
+#define INDEX_FLAG_COMPAT_STALE (1 << 1)
+#define INDEX_FLAG_INTERRUPTS_STALE (1 << 2)
+#define INDEX_FLAG_PHANDLE_DUPLICATES (1 << 3)
+
+struct dtb_index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t layout;
+    uint32_t flags;
+    uint64_t checksum;
+    uint64_t blob_base;
+    uint64_t arena_base;
+    uint64_t root;
+    uint32_t blob_size;
+    uint32_t arena_size;
+    uint32_t node_count;
+    uint32_t node_used;
+    uint32_t prop_count;
+    uint32_t prop_used;
+    uint32_t handle_slot_count;
+    uint32_t compat_count;
+    uint32_t compat_used;
+    uint32_t child_entry_count;
+    uint32_t child_entry_used;
+    uint32_t imap_count;
+    uint32_t imap_used;
+    uint32_t max_phandle;
+};
+
+#define INDEX_ARENA_OFFSET dtb_align_up(sizeof(struct dtb_index_header), sizeof(uint64_t))
+
+#ifndef SMOLDTB_LAZY_PARSE
+static uint32_t index_layout()
+{
+    uint32_t features = 0;
+#ifdef SMOLDTB_COMPAT_INDEX
+    features |= 1 << 0;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    features |= 1 << 1;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    features |= 1 << 2;
+#endif
+#ifdef SMOLDTB_NODE_NAME_INFO
+    features |= 1 << 3;
+#endif
+#ifdef SMOLDTB_STATUS_INFO
+    features |= 1 << 5;
+#endif
+#ifdef SMOLDTB_PRUNE_DISABLED
+    features |= 1 << 6;
+#endif
+    const uint16_t byte_order = 1;
+    features |= (uint32_t)*(const uint8_t*)&byte_order << 4;
+    return (uint32_t)sizeof(dtb_node) | (uint32_t)sizeof(dtb_prop) << 8 | (uint32_t)sizeof(void*) << 16 | features << 24;
+}
+
+/* A Fletcher-style checksum over the whole blob (a running sum of its cells, and a sum of
+ * those sums so that moved data changes it too), used to tell if an index belongs to a blob.
+ */
+static uint64_t checksum_blob(const uint8_t* blob, uint32_t size)
+{
+    const uint32_t* cells = (const uint32_t*)blob;
+    uint32_t sum = 0;
+    uint32_t sum_of_sums = 0;
+    for (uint32_t i = 0; i < size / FDT_CELL_SIZE; i++)
+    {
+        sum += cells[i];
+        sum_of_sums += sum;
+    }
+    for (uint32_t i = size & ~(FDT_CELL_SIZE - 1); i < size; i++)
+    {
+        sum += blob[i];
+        sum_of_sums += sum;
+    }
+    return (uint64_t)sum_of_sums << 32 | sum;
+}
+
+static void copy_bytes(void* dest, const void* source, uint32_t length)
+{
+    uint8_t* to = (uint8_t*)dest;
+    const uint8_t* from = (const uint8_t*)source;
+    for (uint32_t i = 0; i < length; i++)
+        to[i] = from[i];
+}
+
+/* Moves the pointers in an arena from where the arena and blob were to where they are now.
+ * Pointers into the arena may point one past its end (at the end of an empty array), pointers
+ * into the blob can't. Anything else (memory from the instance's chunks, used once the tree
+ * has been edited, or a damaged index) can't be moved, and fails.
+ */
+struct dtb_relocation
+{
+    uintptr_t old_arena;
+    uintptr_t new_arena;
+    uint32_t arena_size;
+    uintptr_t old_blob;
+    uintptr_t new_blob;
+    uint32_t blob_size;
+    bool failed;
+};
+
+static uintptr_t relocate_pointer(struct dtb_relocation* reloc, uintptr_t value)
+{
+    if (value == 0)
+        return 0;
+    if (value - reloc->old_arena <= reloc->arena_size)
+        return value - reloc->old_arena + reloc->new_arena;
+    if (value - reloc->old_blob < reloc->blob_size)
+        return value - reloc->old_blob + reloc->new_blob;
+    reloc->failed = true;
+    return 0;
+}
+
+/* Relocates the pointer at the same place as `field` (a field in the instance's own arena) in
+ * the copy of the arena at `base`. A copy in a caller's buffer may not be aligned, so it's
+ * accessed bytewise.
+ */
+static void relocate_field(struct dtb_state* state, uint8_t* base, struct dtb_relocation* reloc, const void* field)
+{
+    if (base == state->buffer)
+    {
+        uintptr_t* slot = (uintptr_t*)field;
+        *slot = relocate_pointer(reloc, *slot);
+        return;
+    }
+
+    uint8_t* copy = base + ((const uint8_t*)field - state->buffer);
+    uintptr_t value;
+    copy_bytes(&value, copy, sizeof(value));
+    value = relocate_pointer(reloc, value);
+    copy_bytes(copy, &value, sizeof(value));
+}
+
+/* Relocates every pointer in a copy of the instance's arena. */
+static void relocate_arena(struct dtb_state* state, uint8_t* base, struct dtb_relocation* reloc)
+{
+    for (uint32_t i = 0; i < state->node_alloc_max; i++)
+    {
+        const dtb_node* node = &state->node_buff[i];
+        relocate_field(state, base, reloc, &node->parent);
+        relocate_field(state, base, reloc, &node->sibling);
+        relocate_field(state, base, reloc, &node->child);
+        relocate_field(state, base, reloc, &node->props);
+        relocate_field(state, base, reloc, &node->name);
+#ifdef SMOLDTB_CHILD_INDEX
+        relocate_field(state, base, reloc, &node->child_index);
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+        relocate_field(state, base, reloc, &node->interrupt_parent);
+        relocate_field(state, base, reloc, &node->interrupt_map);
+#endif
+    }
+
+    for (uint32_t i = 0; i < state->prop_alloc_max; i++)
+    {
+        relocate_field(state, base, reloc, &state->prop_buff[i].name);
+        relocate_field(state, base, reloc, &state->prop_buff[i].first_cell);
+    }
+
+    for (uint32_t i = 0; i < state->handle_slot_count; i++)
+        relocate_field(state, base, reloc, &state->handle_lookup[i].node);
+
+#ifdef SMOLDTB_COMPAT_INDEX
+    for (uint32_t i = 0; i < state->compat_alloc_max; i++)
+    {
+        const struct dtb_compat_entry* entry = &state->compat_buff[i];
+        relocate_field(state, base, reloc, &entry->str);
+        relocate_field(state, base, reloc, &entry->node);
+        relocate_field(state, base, reloc, &entry->next_str);
+        relocate_field(state, base, reloc, &entry->next_match);
+    }
+    for (uint32_t i = 0; i < state->compat_bucket_count; i++)
+        relocate_field(state, base, reloc, &state->compat_buckets[i]);
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    for (uint32_t i = 0; i < state->child_entry_alloc_max; i++)
+        relocate_field(state, base, reloc, &state->child_entry_buff[i].node);
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    for (uint32_t i = 0; i < state->imap_alloc_max; i++)
+    {
+        const struct dtb_imap_entry* entry = &state->imap_buff[i];
+        relocate_field(state, base, reloc, &entry->child);
+        relocate_field(state, base, reloc, &entry->parent_cells);
+        relocate_field(state, base, reloc, &entry->parent);
+    }
+#endif
+}
+#endif
+
+/* Marks the index an instance was restored from as unusable, once its tree is edited. The
+ * instance keeps using its arena until it's re-initialized.
+ */
+static void invalidate_index(struct dtb_state* state)
+{
+    if (state->index != NULL)
+        state->index->magic = 0;
+}
+
+/* Copies the instance's arena into `buffer` as an index, so `dtb_init_from_index()` can use it
+ * instead of parsing the blob again. Trees whose nodes or properties have been edited can't be
+ * written this way, since the edits live outside of the arena.
+ */
+uint32_t dtb_write_index_ex(dtb_state* state, void* buffer, uint32_t buffer_size)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    (void)buffer;
+    (void)buffer_size;
+    if (state != NULL && state->ops.on_error)
+        state->ops.on_error("Indexes aren't supported with lazy parsing.");
+    return 0;
+#else
+    if (state == NULL || state->root == NULL)
+        return 0;
+    if (!phandle_table_in_arena(state))
+    {
+        //the table only moves when it grows, which takes an edit that can't be written anyway.
+        if (state->ops.on_error)
+            state->ops.on_error("Tree has been edited, it can't be written as an index.");
+        return 0;
+    }
+
+    const uint32_t total_size = INDEX_ARENA_OFFSET + state->buffer_size;
+    if (buffer == NULL || buffer_size < total_size)
+        return total_size;
+
+    uint8_t* arena = (uint8_t*)buffer + INDEX_ARENA_OFFSET;
+    const uint32_t blob_size = be32(state->header->total_size);
+    struct dtb_relocation reloc = { (uintptr_t)state->buffer, (uintptr_t)arena, state->buffer_size,
+        (uintptr_t)state->header, (uintptr_t)state->header, blob_size, false };
+    copy_bytes(arena, state->buffer, state->buffer_size);
+    relocate_arena(state, arena, &reloc);
+
+    struct dtb_index_header header = { 0 };
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.layout = index_layout();
+    header.flags = (state->phandles_stale ? INDEX_FLAG_PHANDLES_STALE : 0) | (state->compat_stale ? INDEX_FLAG_COMPAT_STALE : 0)
+        | (state->interrupts_stale ? INDEX_FLAG_INTERRUPTS_STALE : 0)
+        | (state->phandle_duplicates ? INDEX_FLAG_PHANDLE_DUPLICATES : 0);
+    header.checksum = checksum_blob((const uint8_t*)state->header, blob_size);
+    header.blob_base = (uintptr_t)state->header;
+    header.arena_base = (uintptr_t)arena;
+    header.root = relocate_pointer(&reloc, (uintptr_t)state->root);
+    header.blob_size = blob_size;
+    header.arena_size = state->buffer_size;
+    header.node_count = state->node_alloc_max;
+    header.node_used = state->node_alloc_head;
+    header.prop_count = state->prop_alloc_max;
+    header.prop_used = state->prop_alloc_head;
+    header.handle_slot_count = state->handle_slot_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    header.compat_count = state->compat_alloc_max;
+    header.compat_used = state->compat_alloc_head;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    header.child_entry_count = state->child_entry_alloc_max;
+    header.child_entry_used = state->child_entry_alloc_head;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    header.imap_count = state->imap_alloc_max;
+    header.imap_used = state->imap_alloc_head;
+#endif
+    header.max_phandle = state->max_phandle;
+    if (reloc.failed)
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Tree has been edited, it can't be written as an index.");
+        return 0;
+    }
+
+    copy_bytes(buffer, &header, sizeof(header));
+    return total_size;
+#endif
+}
+
+uint32_t dtb_write_index(void* buffer, uint32_t buffer_size)
+{
+    return dtb_write_index_ex(&default_state, buffer, buffer_size);
+}
+
+/* Restores an instance from an index written by `dtb_write_index()`, after checking that it
+ * came from this build and that the blob at `start` is the one it was written from. The index
+ * becomes the instance's arena, so if neither it nor the blob has moved since it was last used
+ * all that's left is the checksum, otherwise its pointers are moved in place first.
+ */
+static bool init_from_index(struct dtb_state* state, uintptr_t start, void* index, uint32_t index_size)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    (void)start;
+    (void)index;
+    (void)index_size;
+    return report_error(state, DTB_ERR_INDEX);
+#else
+    struct dtb_index_header* header = (struct dtb_index_header*)index;
+    if (header == NULL || (uintptr_t)index % sizeof(void*) != 0 || index_size < INDEX_ARENA_OFFSET)
+        return report_error(state, DTB_ERR_INDEX);
+    if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || header->layout != index_layout()
+        || header->arena_size > index_size - INDEX_ARENA_OFFSET || header->node_used > header->node_count
+        || header->prop_used > header->prop_count || header->compat_used > header->compat_count
+        || header->child_entry_used > header->child_entry_count || header->imap_used > header->imap_count)
+        return report_error(state, DTB_ERR_INDEX);
+
+    STAT_PHASE(state, DTB_PHASE_HEADER, false);
+    if (!attach_blob(state, start, 0))
+        return false;
+    STAT_PHASE(state, DTB_PHASE_HEADER, true);
+    STAT_PHASE(state, DTB_PHASE_PARSE, false);
+    const uint32_t blob_size = be32(state->header->total_size);
+    if (blob_size != header->blob_size || checksum_blob((const uint8_t*)start, blob_size) != header->checksum)
+        return report_error(state, DTB_ERR_INDEX);
+
+    state->node_alloc_max = header->node_count;
+    state->prop_alloc_max = header->prop_count;
+    state->handle_slot_count = header->handle_slot_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_alloc_max = header->compat_count;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_max = header->child_entry_count;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->imap_alloc_max = header->imap_count;
+#endif
+    uint8_t* arena = (uint8_t*)index + INDEX_ARENA_OFFSET;
+    if (!alloc_arena(state, arena))
+        return false;
+    state->index = header;
+    if (state->buffer_size != header->arena_size)
+        return report_error(state, DTB_ERR_INDEX);
+
+    state->node_alloc_head = header->node_used;
+    state->prop_alloc_head = header->prop_used;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_alloc_head = header->compat_used;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_head = header->child_entry_used;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->imap_alloc_head = header->imap_used;
+#endif
+
+    struct dtb_relocation reloc = { (uintptr_t)header->arena_base, (uintptr_t)arena, header->arena_size,
+        (uintptr_t)header->blob_base, start, blob_size, false };
+    if (reloc.old_arena != reloc.new_arena || reloc.old_blob != reloc.new_blob)
+    {
+        //the index is unusable if this fails partway, so it's marked as such until it's done.
+        header->magic = 0;
+        relocate_arena(state, arena, &reloc);
+        header->root = relocate_pointer(&reloc, (uintptr_t)header->root);
+        if (reloc.failed)
+            return report_error(state, DTB_ERR_INDEX);
+        header->arena_base = (uintptr_t)arena;
+        header->blob_base = start;
+        header->magic = INDEX_MAGIC;
+    }
+
+    state->root = (dtb_node*)(uintptr_t)header->root;
+    if (state->root == NULL || (uintptr_t)state->root - (uintptr_t)arena >= header->node_count * sizeof(dtb_node))
+        return report_error(state, DTB_ERR_INDEX);
+    state->phandles_stale = (header->flags & INDEX_FLAG_PHANDLES_STALE) != 0;
+    state->compat_stale = (header->flags & INDEX_FLAG_COMPAT_STALE) != 0;
+    state->interrupts_stale = (header->flags & INDEX_FLAG_INTERRUPTS_STALE) != 0;
+    state->phandle_duplicates = (header->flags & INDEX_FLAG_PHANDLE_DUPLICATES) != 0;
+    state->max_phandle = header->max_phandle;
+    state->max_phandle_known = true;
+    set_node_owners(state);
+    STAT_PHASE(state, DTB_PHASE_PARSE, true);
+    return finish_init(state);
+#endif
+}
+
+bool dtb_init_from_index(uintptr_t start, void* index, uint32_t index_size, dtb_ops ops)
+{
+    struct dtb_state* state = &default_state;
+    state->ops = ops;
+    return init_from_index(state, start, index, index_size);
+}
+
+dtb_state* dtb_init_from_index_ex(uintptr_t start, void* index, uint32_t index_size, dtb_ops ops)
+{
+    struct dtb_state* state = alloc_state(ops);
+    if (state == NULL)
+        return NULL;
+    if (!init_from_index(state, start, index, index_size))
+    {
+        dtb_deinit(state);
+        return NULL;
+    }
+    return state;
+}
+
+/* Copies `source`'s arena into a new instance for the same blob, the same way an index is
+ * written and restored, so the copy can be edited without changing `source` or parsing the blob
+ * again. Only the pointers into the arena are moved, so a tree whose edits live in its chunks
+ * can't be copied.
+ */
+static bool clone_state(struct dtb_state* state, struct dtb_state* source)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    (void)source;
+    if (state->ops.on_error)
+        state->ops.on_error("Cloning isn't supported with lazy parsing.");
+    return false;
+#else
+    if (source->root == NULL || !phandle_table_in_arena(source))
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Tree is empty or has been edited, it can't be cloned.");
+        return false;
+    }
+    if (!attach_blob(state, (uintptr_t)source->header, 0))
+        return false;
+
+    state->node_alloc_max = source->node_alloc_max;
+    state->prop_alloc_max = source->prop_alloc_max;
+    state->handle_slot_count = source->handle_slot_count;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_alloc_max = source->compat_alloc_max;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_max = source->child_entry_alloc_max;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->imap_alloc_max = source->imap_alloc_max;
+#endif
+    if (!alloc_arena(state, NULL))
+        return false;
+
+    state->node_alloc_head = source->node_alloc_head;
+    state->prop_alloc_head = source->prop_alloc_head;
+#ifdef SMOLDTB_COMPAT_INDEX
+    state->compat_alloc_head = source->compat_alloc_head;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    state->child_entry_alloc_head = source->child_entry_alloc_head;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    state->imap_alloc_head = source->imap_alloc_head;
+#endif
+
+    const uint32_t blob_size = be32(source->header->total_size);
+    struct dtb_relocation reloc = { (uintptr_t)source->buffer, (uintptr_t)state->buffer, source->buffer_size,
+        (uintptr_t)source->header, (uintptr_t)source->header, blob_size, false };
+    copy_bytes(state->buffer, source->buffer, source->buffer_size);
+    relocate_arena(source, state->buffer, &reloc);
+    state->root = (dtb_node*)relocate_pointer(&reloc, (uintptr_t)source->root);
+    if (reloc.failed)
+    {
+        state->root = NULL;
+        if (state->ops.on_error)
+            state->ops.on_error("Tree is empty or has been edited, it can't be cloned.");
+        return false;
+    }
+
+    state->phandles_stale = source->phandles_stale;
+    state->compat_stale = source->compat_stale;
+    state->interrupts_stale = source->interrupts_stale;
+    state->phandle_duplicates = source->phandle_duplicates;
+    state->max_phandle = source->max_phandle;
+    state->max_phandle_known = source->max_phandle_known;
+    set_node_owners(state);
+    return finish_init(state);
+#endif
+}
+
+dtb_state* dtb_clone_ex(dtb_state* source, dtb_ops ops)
+{
+    if (source == NULL)
+        return NULL;
+    struct dtb_state* state = alloc_state(ops);
+    if (state == NULL)
+        return NULL;
+    if (!clone_state(state, source))
+    {
+        dtb_deinit(state);
+        return NULL;
+    }
+    return state;
+}
+
+/* Changes to the tree never modify the blob. New values, names, nodes and property arrays
+ * are allocated from the instance's chunks, and everything else keeps pointing into the blob.
+ */
+static const char* intern_prop_name(struct dtb_state* state, const char* name)
+{
+    const dtb_atom atom = intern_string(state, name);
+    if (atom != DTB_ATOM_INVALID)
+        return state->strings + (atom & ~ATOM_AMBIGUOUS);
+    for (struct dtb_added_name* added = state->added_names; added != NULL; added = added->next)
+    {
+        if (strings_eq(added->name, name))
+            return added->name;
+    }
+
+    const uint32_t name_len = string_len(name);
+    struct dtb_added_name* added = chunk_alloc(state, sizeof(struct dtb_added_name) + name_len + 1);
+    if (added == NULL)
+        return NULL;
+    for (uint32_t i = 0; i < name_len; i++)
+        added->name[i] = name[i];
+    added->offset = state->strings_size + state->added_strings_size;
+    state->added_strings_size += name_len + 1;
+
+    if (state->last_added_name != NULL)
+        state->last_added_name->next = added;
+    else
+        state->added_names = added;
+    state->last_added_name = added;
+    return added->name;
+}
+
+/* Names of the properties the interrupt info recorded by the parser depends on. Its tables are
+ * sized to fit the arena, so changing one of these (or a phandle, which can change what another
+ * node's 'interrupt-parent' or 'interrupt-map' refers to) means they can't be trusted anymore.
+ */
+static const char* const interrupt_props[] =
+{
+    "phandle", "linux,phandle", "#address-cells", "#interrupt-cells",
+    "interrupt-parent", "interrupt-map", "interrupt-map-mask",
+};
+
+/* Returns whether a property is the one the compatible lookups use, a node's first 'compatible'. */
+static bool is_compat_prop(dtb_node* node, const dtb_prop* prop)
+{
+    return strings_eq(prop->name, "compatible") && dtb_find_prop(node, "compatible") == prop;
+}
+
+/* Adds a node's new phandle to the table. If another node already has it, the one that comes
+ * first in the tree should be found, so lookups go back to walking the tree.
+ */
+static void add_phandle_entry(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    uint32_t handle = 0;
+    if (!read_single_cell(prop, &handle) || handle == 0 || handle == ~0u)
+        return;
+    if (handle > state->max_phandle)
+        state->max_phandle = handle;
+    if (state->phandles_stale)
+        return;
+
+#ifdef SMOLDTB_LAZY_PARSE
+    (void)node;
+    state->phandles_stale = true; //the blob the lookups search doesn't have the new value.
+#else
+    struct dtb_phandle_slot* slot = find_phandle_slot(state, handle);
+    if (slot != NULL && slot->handle == handle)
+    {
+        if (slot->node != node)
+            state->phandle_duplicates = state->phandles_stale = true;
+        return;
+    }
+    if ((state->handle_slots_used + 1) * 2 > state->handle_slot_count)
+    {
+        if (!grow_phandle_table(state))
+        {
+            state->phandles_stale = true;
+            return;
+        }
+        slot = find_phandle_slot(state, handle);
+    }
+    slot->handle = handle;
+    slot->node = node;
+    state->handle_slots_used++;
+#endif
+}
+
+/* Takes a phandle a node no longer has out of the table. */
+static void forget_phandle(struct dtb_state* state, dtb_node* node, uint32_t handle)
+{
+    if (handle == 0 || handle == ~0u)
+        return;
+    if (handle == state->max_phandle)
+        state->max_phandle_known = false;
+    if (state->phandles_stale)
+        return;
+
+#ifdef SMOLDTB_LAZY_PARSE
+    (void)node;
+    state->phandles_stale = true;
+#else
+    //if other nodes have the handle too, whichever of them is next in the tree isn't in the table.
+    if (state->phandle_duplicates)
+    {
+        state->phandles_stale = true;
+        return;
+    }
+    struct dtb_phandle_slot* slot = find_phandle_slot(state, handle);
+    if (slot != NULL && slot->handle == handle && slot->node == node)
+        remove_phandle_slot(state, slot);
+#endif
+}
+
+/* Takes the value of a phandle property out of the table, before the property is changed. */
+static void remove_phandle_entry(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    uint32_t handle = 0;
+    if (!read_single_cell(prop, &handle))
+        return;
+
+    //the node keeps the handle if it's in both its 'phandle' and 'linux,phandle'.
+    for (uint32_t i = 0; i < node->prop_count; i++)
+    {
+        dtb_prop* other = &node->props[i];
+        uint32_t other_handle = 0;
+        if (other != prop && is_phandle_prop(other) && read_single_cell(other, &other_handle) && other_handle == handle)
+            return;
+    }
+    forget_phandle(state, node, handle);
+}
+
+/* Takes a node out of the compatible lookups for each string of its 'compatible', before the
+ * property is changed or the node is removed.
+ */
+static void remove_compat_entries(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+#if defined(SMOLDTB_COMPAT_INDEX)
+    if (state->compat_stale)
+        return;
+    uint32_t offset = 0;
+    const char* str;
+    while ((str = next_list_string((const char*)prop->first_cell, prop->length, &offset)) != NULL)
+        unlink_compat_entry(state, node, str);
+#elif defined(SMOLDTB_LAZY_PARSE)
+    (void)node;
+    (void)prop;
+    state->compat_stale = true;
+#else
+    //without an index each node's current 'compatible' is read during the search.
+    (void)state;
+    (void)node;
+    (void)prop;
+#endif
+}
+
+/* Adds a node to the compatible lookups for each distinct string of its new 'compatible'. */
+static void add_changed_compat_entries(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+#if defined(SMOLDTB_COMPAT_INDEX)
+    if (state->compat_stale)
+        return;
+    if (state->compat_bucket_count == 0)
+    {
+        state->compat_stale = true; //the tree had no compatible strings, so the index has no buckets.
+        return;
+    }
+
+    uint32_t offset = 0;
+    const char* str;
+    while ((str = next_list_string((const char*)prop->first_cell, prop->length, &offset)) != NULL)
+    {
+        dtb_prop before = *prop;
+        before.length = (uint32_t)(str - (const char*)prop->first_cell);
+        if (list_has_string(&before, str))
+            continue;
+        if (!link_compat_entry(state, node, str))
+        {
+            state->compat_stale = true;
+            return;
+        }
+    }
+#elif defined(SMOLDTB_LAZY_PARSE)
+    (void)node;
+    (void)prop;
+    state->compat_stale = true;
+#else
+    //without an index the parsed nodes are searched in order, which misses nodes added later.
+    (void)prop;
+    if (node < state->node_buff || node >= state->node_buff + state->node_alloc_head)
+        state->compat_stale = true;
+#endif
+}
+
+/* Takes a property's current value out of the lookup indexes, before it's changed. */
+static void unindex_prop(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    if (is_phandle_prop(prop))
+        remove_phandle_entry(state, node, prop);
+    else if (is_compat_prop(node, prop))
+        remove_compat_entries(state, node, prop);
+}
+
+/* Takes a node and everything below it out of the lookup indexes, before it's removed. */
+static void unindex_subtree(struct dtb_state* state, dtb_node* node)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    //the blob searches would still find the removed nodes.
+    (void)node;
+    state->phandles_stale = state->compat_stale = true;
+#else
+    for (uint32_t i = 0; i < node->prop_count; i++)
+    {
+        dtb_prop* prop = &node->props[i];
+        uint32_t handle = 0;
+        if (is_phandle_prop(prop) && read_single_cell(prop, &handle))
+        {
+            forget_phandle(state, node, handle);
+            state->interrupts_stale = true;
+        }
+        else if (is_compat_prop(node, prop))
+            remove_compat_entries(state, node, prop);
+    }
+#ifndef SMOLDTB_COMPAT_INDEX
+    //without an index the parsed nodes are searched in order, which would include removed ones.
+    if (dtb_find_prop(node, "compatible") != NULL)
+        state->compat_stale = true;
+#endif
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+        unindex_subtree(state, child);
+#endif
+}
+
+/* Returns whether a node sets a cell count itself, rather than inheriting it from its parent.
+ * A node that hasn't been expanded yet in lazy mode doesn't, its own properties are applied
+ * over the inherited count when it is.
+ */
+static bool has_own_cell_count(dtb_node* node, const char* name)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    if (!node->expanded)
+        return false;
+#endif
+    uint32_t cells;
+    dtb_prop* prop = dtb_find_prop(node, name);
+    return prop != NULL && read_single_cell(prop, &cells);
+}
+
+/* Passes a node's cell counts down to the descendants that inherited them from it, after its
+ * '#address-cells' or '#size-cells' changed.
+ */
+static void propagate_cell_counts(dtb_node* node)
+{
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
+    {
+        const bool own_addr = has_own_cell_count(child, "#address-cells");
+        const bool own_size = has_own_cell_count(child, "#size-cells");
+        if (own_addr && own_size)
+            continue;
+        if (!own_addr)
+            child->addr_cells = node->addr_cells;
+        if (!own_size)
+            child->size_cells = node->size_cells;
+        propagate_cell_counts(child);
+    }
+}
+
+/* Like `check_for_special_prop()`, but for properties changed after parsing. */
+static void check_for_changed_prop(struct dtb_state* state, dtb_node* node, dtb_prop* prop)
+{
+    uint32_t cells = 0;
+    if (strings_eq(prop->name, "#address-cells"))
+    {
+        //a value that isn't a single cell is ignored like it is by the parser, so the inherited count is used.
+        node->addr_cells = read_single_cell(prop, &cells) ? cells : (node->parent ? node->parent->addr_cells : 2);
+        propagate_cell_counts(node);
+    }
+    else if (strings_eq(prop->name, "#size-cells"))
+    {
+        node->size_cells = read_single_cell(prop, &cells) ? cells : (node->parent ? node->parent->size_cells : 1);
+        propagate_cell_counts(node);
+    }
+#ifdef SMOLDTB_INTERRUPT_INFO
+    else if (strings_eq(prop->name, "#interrupt-cells"))
+        node->interrupt_cells = read_single_cell(prop, &cells) ? cells : 0;
+#endif
+#ifdef SMOLDTB_STATUS_INFO
+    else if (strings_eq(prop->name, "status"))
+        node->disabled = !status_is_okay(prop);
+#endif
+
+    for (uint32_t i = 0; i < sizeof(interrupt_props) / sizeof(interrupt_props[0]); i++)
+    {
+        if (strings_eq(prop->name, interrupt_props[i]))
+            state->interrupts_stale = true;
+    }
+    if (is_phandle_prop(prop))
+        add_phandle_entry(state, node, prop);
+    else if (is_compat_prop(node, prop))
+        add_changed_compat_entries(state, node, prop);
+    clear_caches(state);
+    invalidate_index(state);
+}
 
-        seg_len = string_find_char(name, '/');
-        if (seg_len == ~0u)
-            seg_len = string_len(name);
-        if (seg_len == 0)
-            return scan;
+/* Sets a property to `length` bytes of new (zeroed) space and returns it for the caller to
+ * fill in, adding the property to the node if it didn't exist.
+ */
+static uint8_t* set_prop_space(struct dtb_state* state, dtb_node* node, const char* name, uint32_t length,
+    dtb_prop** changed)
+{
+    if (state == NULL || node == NULL || name == NULL || !load_node(node))
+        return NULL;
 
-        scan = find_child_internal(scan, name, seg_len);
-        name += seg_len;
+    uint8_t* value = chunk_alloc(state, length > 0 ? length : 1);
+    if (value == NULL)
+        return NULL;
+
+    dtb_prop* prop = NULL;
+    for (uint32_t i = 0; i < node->prop_count && prop == NULL; i++)
+    {
+        if (strings_eq(node->props[i].name, name))
+            prop = &node->props[i];
     }
 
-    return NULL;
-} 
+    if (prop == NULL)
+    {
+        //the properties are stored contiguously, so adding one means moving all of them.
+        const char* interned = intern_prop_name(state, name);
+        if (interned == NULL)
+            return NULL;
+        if (node->prop_count == UINT16_MAX)
+        {
+            if (state->ops.on_error)
+                state->ops.on_error("Node has too many properties, can't add another.");
+            return NULL;
+        }
+        dtb_prop* props = chunk_alloc(state, (node->prop_count + 1) * sizeof(dtb_prop));
+        if (props == NULL)
+            return NULL;
+        for (uint32_t i = 0; i < node->prop_count; i++)
+            props[i] = node->props[i];
+        node->props = props;
+        prop = &props[node->prop_count++];
+        prop->name = interned;
+    }
+    else
+        unindex_prop(state, node, prop);
 
-dtb_node* dtb_find_child(dtb_node* start, const char* name)
+    prop->first_cell = (const uint32_t*)value;
+    prop->length = length;
+    *changed = prop;
+    return value;
+}
+
+bool dtb_set_prop_ex(dtb_state* state, dtb_node* node, const char* name, const void* value, uint32_t length)
 {
-    if (start == NULL)
-        return NULL;
+    dtb_prop* prop;
+    uint8_t* space = set_prop_space(state, node, name, length, &prop);
+    if (space == NULL)
+        return false;
 
-    return find_child_internal(start, name, string_len(name));
+    const uint8_t* bytes = (const uint8_t*)value;
+    for (uint32_t i = 0; i < length; i++)
+        space[i] = bytes[i];
+    check_for_changed_prop(state, node, prop);
+    return true;
 }
 
-dtb_prop* dtb_find_prop(dtb_node* node, const char* name)
+bool dtb_set_prop(dtb_node* node, const char* name, const void* value, uint32_t length)
 {
-    if (node == NULL)
+    return dtb_set_prop_ex(&default_state, node, name, value, length);
+}
+
+bool dtb_set_prop_string_ex(dtb_state* state, dtb_node* node, const char* name, const char* str)
+{
+    if (str == NULL)
+        return false;
+    return dtb_set_prop_ex(state, node, name, str, string_len(str) + 1);
+}
+
+bool dtb_set_prop_string(dtb_node* node, const char* name, const char* str)
+{
+    return dtb_set_prop_string_ex(&default_state, node, name, str);
+}
+
+bool dtb_set_prop_cells_ex(dtb_state* state, dtb_node* node, const char* name, const uint32_t* cells, uint32_t count)
+{
+    dtb_prop* prop;
+    uint32_t* space = (uint32_t*)set_prop_space(state, node, name, count * FDT_CELL_SIZE, &prop);
+    if (space == NULL)
+        return false;
+
+    for (uint32_t i = 0; i < count; i++)
+        space[i] = be32(cells[i]);
+    check_for_changed_prop(state, node, prop);
+    return true;
+}
+
+bool dtb_set_prop_cells(dtb_node* node, const char* name, const uint32_t* cells, uint32_t count)
+{
+    return dtb_set_prop_cells_ex(&default_state, node, name, cells, count);
+}
+
+/* Adds a new, empty node as the last child of `parent`. */
+dtb_node* dtb_add_node_ex(dtb_state* state, dtb_node* parent, const char* name)
+{
+    if (state == NULL || parent == NULL || name == NULL || !load_node(parent))
         return NULL;
 
+    dtb_node* last_child = NULL;
+    for (dtb_node* child = parent->child; child != NULL; child = child->sibling)
+    {
+        if (strings_eq(child->name, name))
+            return NULL;
+        last_child = child;
+    }
+
     const uint32_t name_len = string_len(name);
-    dtb_prop* prop = node->props;
-    while (prop)
+    dtb_node* node = chunk_alloc(state, sizeof(dtb_node));
+    char* node_name = chunk_alloc(state, name_len + 1);
+    if (node == NULL || node_name == NULL)
+        return NULL;
+    for (uint32_t i = 0; i < name_len; i++)
+        node_name[i] = name[i];
+
+    node->name = node_name;
+    node->addr_cells = parent->addr_cells;
+    node->size_cells = parent->size_cells;
+#ifdef SMOLDTB_NODE_NAME_INFO
+    set_name_info(node, name_len);
+#endif
+#if defined(SMOLDTB_LAZY_PARSE) || defined(SMOLDTB_STATS)
+    node->owner = state;
+#endif
+#ifdef SMOLDTB_LAZY_PARSE
+    node->expanded = 1;
+#endif
+#ifdef SMOLDTB_CHILD_INDEX
+    parent->child_index = NULL; //the index is sorted, it's simpler to search the list instead.
+#endif
+    attach_child(parent, node, &last_child);
+#ifdef SMOLDTB_INTERRUPT_INFO
+    node->interrupt_parent = find_interrupt_parent(state, node);
+#endif
+
+    clear_caches(state);
+    invalidate_index(state);
+    return node;
+}
+
+dtb_node* dtb_add_node(dtb_node* parent, const char* name)
+{
+    return dtb_add_node_ex(&default_state, parent, name);
+}
+
+/* Unlinks a node (and everything below it) from the tree, its memory stays allocated until
+ * the instance is re-initialized.
+ */
+bool dtb_remove_node_ex(dtb_state* state, dtb_node* node)
+{
+    if (state == NULL || node == NULL || node->parent == NULL)
+        return false;
+
+    dtb_node* parent = node->parent;
+    dtb_node** link = &parent->child;
+    while (*link != NULL && *link != node)
+        link = &(*link)->sibling;
+    if (*link == NULL)
+        return false;
+
+    unindex_subtree(state, node);
+    *link = node->sibling;
+    parent->child_count--;
+#ifdef SMOLDTB_CHILD_INDEX
+    parent->child_index = NULL;
+#endif
+    node->parent = NULL;
+    node->sibling = NULL;
+
+    clear_caches(state);
+    invalidate_index(state);
+    return true;
+}
+
+bool dtb_remove_node(dtb_node* node)
+{
+    return dtb_remove_node_ex(&default_state, node);
+}
+
+/* Overlays are applied the same way as libfdt does: the overlay's own phandles are moved
+ * past the base tree's largest phandle (including the references listed in
+ * '__local_fixups__'), references to labels in the base tree are filled in from its
+ * '__symbols__' (as listed in '__fixups__'), then each fragment's '__overlay__' node is merged
+ * into its target and the overlay's symbols are added to the base tree's. Values are patched
+ * in the overlay instance (copy-on-write, like any other edit) and copied into the base tree.
+ */
+static uint32_t get_max_phandle(struct dtb_state* state)
+{
+    if (state->max_phandle_known)
+        return state->max_phandle;
+
+    state->max_phandle = 0;
+#ifndef SMOLDTB_LAZY_PARSE
+    if (!state->phandles_stale)
     {
-        const uint32_t prop_name_len = string_len(prop->name);
-        if (prop_name_len == name_len && strings_eq(prop->name, name))
-            return prop;
-        prop = prop->next;
+        for (uint32_t i = 0; i < state->handle_slot_count; i++)
+        {
+            if (state->handle_lookup[i].handle > state->max_phandle)
+                state->max_phandle = state->handle_lookup[i].handle;
+        }
+        state->max_phandle_known = true;
+        return state->max_phandle;
+    }
+#endif
+    for (dtb_node* node = next_node(state, NULL); node != NULL && load_node(node); node = next_node(state, node))
+    {
+        for (uint32_t i = 0; i < node->prop_count; i++)
+        {
+            uint32_t handle = 0;
+            if (is_phandle_prop(&node->props[i]) && read_single_cell(&node->props[i], &handle) && handle != ~0u
+                && handle > state->max_phandle)
+                state->max_phandle = handle;
+        }
     }
+    state->max_phandle_known = true;
+    return state->max_phandle;
+}
 
-    return NULL;
+/* Returns whether a property's value is still in the blob, rather than a copy owned by the
+ * instance which can be changed in place.
+ */
+static bool value_in_blob(struct dtb_state* state, const dtb_prop* prop)
+{
+    const uintptr_t start = (uintptr_t)state->header;
+    const uintptr_t value = (uintptr_t)prop->first_cell;
+    return value >= start && value < start + be32(state->header->total_size);
 }
 
-dtb_node* dtb_get_sibling(dtb_node* node)
+/* Returns whether there's a whole cell at `offset` bytes into a property's value. */
+static bool cell_in_prop(const dtb_prop* prop, uint32_t offset)
 {
-    if (node == NULL || node->sibling == NULL)
-        return NULL;
-    return node->sibling;
+    return prop->length >= FDT_CELL_SIZE && offset <= prop->length - FDT_CELL_SIZE;
 }
 
-dtb_node* dtb_get_child(dtb_node* node)
+/* Sets the cell at `offset` bytes into a property's value. */
+static bool patch_prop_cell(struct dtb_state* state, dtb_node* node, dtb_prop* prop, uint32_t offset, uint32_t value)
 {
-    if (node == NULL)
-        return NULL;
-    return node->child;
+    if (!cell_in_prop(prop, offset))
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay fixup is outside of its property.");
+        return false;
+    }
+
+    unindex_prop(state, node, prop);
+    uint8_t* bytes = (uint8_t*)prop->first_cell;
+    if (value_in_blob(state, prop))
+    {
+        bytes = chunk_alloc(state, prop->length);
+        if (bytes == NULL)
+            return false;
+        for (uint32_t i = 0; i < prop->length; i++)
+            bytes[i] = ((const uint8_t*)prop->first_cell)[i];
+        prop->first_cell = (const uint32_t*)bytes;
+    }
+
+    for (uint32_t i = 0; i < FDT_CELL_SIZE; i++)
+        bytes[offset + i] = (uint8_t)(value >> ((FDT_CELL_SIZE - 1 - i) * 8));
+    check_for_changed_prop(state, node, prop);
+    return true;
 }
 
-dtb_node* dtb_get_parent(dtb_node* node)
+static uint32_t read_prop_cell_at(const dtb_prop* prop, uint32_t offset)
 {
-    if (node == NULL)
-        return NULL;
-    return node->parent;
+    const uint8_t* bytes = (const uint8_t*)prop->first_cell + offset;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
 }
 
-dtb_prop* dtb_get_prop(dtb_node* node, uint32_t index)
+static dtb_node* find_child_exact(dtb_node* node, const char* name)
 {
-    if (node == NULL)
+    if (!load_node(node))
         return NULL;
-    
-    dtb_prop* prop = node->props;
-    while (prop != NULL)
+    for (dtb_node* child = node->child; child != NULL; child = child->sibling)
     {
-        if (index == 0)
-            return prop;
+        if (strings_eq(child->name, name))
+            return child;
+    }
+    return NULL;
+}
 
-        index--;
-        prop = prop->next;
+/* Moves every phandle defined in the overlay up by `delta`, or only checks that they can be
+ * moved if `patch` is false.
+ */
+static bool adjust_overlay_phandles(struct dtb_state* overlay, uint32_t delta, bool patch)
+{
+    for (dtb_node* node = next_node(overlay, NULL); node != NULL; node = next_node(overlay, node))
+    {
+        if (!load_node(node))
+            return false;
+        for (uint32_t i = 0; i < node->prop_count; i++)
+        {
+            dtb_prop* prop = &node->props[i];
+            if (!strings_eq(prop->name, "phandle") && !strings_eq(prop->name, "linux,phandle"))
+                continue;
+            if (prop->length != FDT_CELL_SIZE)
+                return false;
+            const uint32_t handle = read_prop_cell_at(prop, 0);
+            if (handle == 0 || handle == ~0u)
+                continue;
+            if (handle + delta < handle)
+                return false;
+            if (patch && !patch_prop_cell(overlay, node, prop, 0, handle + delta))
+                return false;
+        }
     }
+    return true;
+}
 
-    return NULL;
+/* Walks a '__local_fixups__' node and the overlay node it mirrors together. Each property
+ * lists the offsets of phandle references in the matching property of the overlay node.
+ */
+static bool apply_local_fixups(struct dtb_state* overlay, dtb_node* fixups, dtb_node* node, uint32_t delta, bool patch)
+{
+    if (!load_node(fixups) || !load_node(node))
+        return false;
+
+    for (uint32_t i = 0; i < fixups->prop_count; i++)
+    {
+        dtb_prop* offsets = &fixups->props[i];
+        dtb_prop* prop = dtb_find_prop(node, offsets->name);
+        if (prop == NULL)
+            return false;
+        for (uint32_t j = 0; j + FDT_CELL_SIZE <= offsets->length; j += FDT_CELL_SIZE)
+        {
+            const uint32_t offset = read_prop_cell_at(offsets, j);
+            if (!cell_in_prop(prop, offset))
+                return false;
+            if (patch && !patch_prop_cell(overlay, node, prop, offset, read_prop_cell_at(prop, offset) + delta))
+                return false;
+        }
+    }
+
+    for (dtb_node* child = fixups->child; child != NULL; child = child->sibling)
+    {
+        dtb_node* target = find_child_exact(node, child->name);
+        if (target == NULL || !apply_local_fixups(overlay, child, target, delta, patch))
+            return false;
+    }
+    return true;
 }
 
-void dtb_stat_node(dtb_node* node, dtb_node_stat* stat)
+/* Reads the offset at the end of a fixup reference: one or more decimal digits and nothing else. */
+static bool parse_fixup_offset(const char* str, uint32_t* offset)
 {
-    if (node == NULL)
-        return;
+    if (*str == 0)
+        return false;
 
-    stat->name = ( node == state.root ) ? ROOT_NODE_STR : node->name;
+    *offset = 0;
+    for (; *str != 0; str++)
+    {
+        if (*str < '0' || *str > '9' || *offset > (UINT32_MAX - 9) / 10)
+            return false;
+        *offset = *offset * 10 + (uint32_t)(*str - '0');
+    }
+    return true;
+}
 
-    stat->prop_count = 0;
-    dtb_prop* prop = node->props;
-    while (prop != NULL)
+/* Finds the cell a "path:property:offset" reference from '__fixups__' points to. */
+static bool parse_fixup_ref(struct dtb_state* state, struct dtb_state* overlay, const char* ref,
+    dtb_node** node, dtb_prop** prop, uint32_t* offset)
+{
+    const uint32_t path_len = string_find_char(ref, ':');
+    const char* prop_name = ref + path_len + 1;
+    const uint32_t name_len = path_len != ~0u ? string_find_char(prop_name, ':') : ~0u;
+    if (name_len >= 256 || !parse_fixup_offset(prop_name + name_len + 1, offset))
     {
-        prop = prop->next;
-        stat->prop_count++;
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay has a malformed __fixups__ reference.");
+        return false;
     }
 
-    stat->child_count = 0;
-    dtb_node* child = node->child;
-    while (child != NULL)
+    char name[256];
+    for (uint32_t ni = 0; ni < name_len; ni++)
+        name[ni] = prop_name[ni];
+    name[name_len] = 0;
+
+    *node = find_path_bounded(overlay, ref, path_len);
+    *prop = *node ? dtb_find_prop(*node, name) : NULL;
+    if (*prop == NULL)
     {
-        child = child->sibling;
-        stat->child_count++;
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay __fixups__ names a property that isn't in the overlay.");
+        return false;
     }
+    if (!cell_in_prop(*prop, *offset))
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay fixup is outside of its property.");
+        return false;
+    }
+    return true;
+}
 
-    stat->sibling_count = 0;
-    if (node->parent)
+/* Returns the phandle of the node a label in the base tree's '__symbols__' refers to. */
+static bool get_label_handle(struct dtb_state* state, const char* label, uint32_t* handle)
+{
+    dtb_node* symbols = dtb_find_ex(state, "/__symbols__");
+    const char* path = symbols ? dtb_read_prop_string(dtb_find_prop(symbols, label), 0) : NULL;
+    dtb_node* node = path ? dtb_find_ex(state, path) : NULL;
+    dtb_prop* prop = node ? dtb_find_prop(node, "phandle") : NULL;
+    if (prop == NULL && node != NULL)
+        prop = dtb_find_prop(node, "linux,phandle");
+    if (prop == NULL || !read_single_cell(prop, handle))
     {
-        dtb_node* prime = node->parent->child;
-        while (prime != NULL)
-        {
-            prime = prime->sibling;
-            stat->sibling_count++;
-        }
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay references a label that isn't in the base tree.");
+        return false;
     }
+    return true;
 }
 
-static void extract_cells(const uint32_t* cells, uint32_t count, uint32_t* vals)
+/* Fills in references to the base tree's labels, or only checks that they can be filled in if
+ * `patch` is false. Each property of '__fixups__' is named after a label, and its value is a
+ * list of "path:property:offset" strings where it's referenced.
+ */
+static bool apply_fixups(struct dtb_state* state, struct dtb_state* overlay, dtb_node* fixups, bool patch)
 {
-    for (uint32_t i = 0; i < count; i++)
-        vals[i] = be32(cells[i]);
+    if (!load_node(fixups))
+        return false;
+
+    for (uint32_t i = 0; i < fixups->prop_count; i++)
+    {
+        dtb_prop* refs = &fixups->props[i];
+        uint32_t handle = 0;
+        if (!get_label_handle(state, refs->name, &handle))
+            return false;
+
+        const char* ref;
+        for (uint32_t ri = 0; (ref = dtb_read_prop_string(refs, ri)) != NULL; ri++)
+        {
+            dtb_node* node;
+            dtb_prop* prop;
+            uint32_t offset;
+            if (!parse_fixup_ref(state, overlay, ref, &node, &prop, &offset))
+                return false;
+            if (patch && !patch_prop_cell(overlay, node, prop, offset, handle))
+                return false;
+        }
+    }
+    return true;
 }
 
-const char* dtb_read_prop_string(dtb_prop* prop, uint32_t index)
+/* Returns the node a fragment applies to, from its 'target' phandle or 'target-path'. A
+ * 'target' listed in '__fixups__' is resolved from the label, so a fragment's target can be
+ * found before the fixups are applied.
+ */
+static dtb_node* get_fragment_target(struct dtb_state* state, struct dtb_state* overlay, dtb_node* fragment)
 {
-    if (prop == NULL)
-        return NULL;
-    
-    const uint8_t* name = (const uint8_t*)prop->first_cell;
-    uint32_t curr_index = 0;
-    for (uint32_t scan = 0; scan < prop->length; scan++)
+    uint32_t handle = 0;
+    dtb_prop* target = dtb_find_prop(fragment, "target");
+    if (target != NULL)
     {
-        if (name[scan] == 0)
+        if (!read_single_cell(target, &handle))
+            return NULL;
+
+        dtb_node* fixups = find_child_exact(overlay->root, "__fixups__");
+        for (uint32_t i = 0; fixups != NULL && i < fixups->prop_count; i++)
         {
-            curr_index++;
-            continue;
+            const char* ref;
+            for (uint32_t ri = 0; (ref = dtb_read_prop_string(&fixups->props[i], ri)) != NULL; ri++)
+            {
+                dtb_node* node;
+                dtb_prop* prop;
+                uint32_t offset;
+                if (!parse_fixup_ref(state, overlay, ref, &node, &prop, &offset) || prop != target || offset != 0)
+                    continue;
+                if (!get_label_handle(state, fixups->props[i].name, &handle))
+                    return NULL;
+            }
         }
-        if (curr_index == index)
-            return (const char*)&name[scan];
+        return dtb_find_phandle_ex(state, handle);
     }
 
-    return NULL;
+    const char* path = dtb_read_prop_string(dtb_find_prop(fragment, "target-path"), 0);
+    return path ? dtb_find_ex(state, path) : NULL;
 }
 
-uint32_t dtb_read_prop_bytestring(dtb_prop* prop, char* vals)
+/* Copies the properties and children of an '__overlay__' node into the target. */
+static bool merge_overlay_node(struct dtb_state* state, dtb_node* target, dtb_node* source)
 {
-    if (prop == NULL)
-        return 0;
-    
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop->first_cell - 2);
-    const uint32_t count = be32(fdtprop->length);
-    if (vals == NULL)
-        return count;
+    if (!load_node(source))
+        return false;
 
-    for (uint32_t i = 0; i < count; i++)
+    for (uint32_t i = 0; i < source->prop_count; i++)
     {
-        const char* base = (char*)prop->first_cell;
-        vals[i] = base[i];
+        const dtb_prop* prop = &source->props[i];
+        if (!dtb_set_prop_ex(state, target, prop->name, prop->first_cell, prop->length))
+            return false;
     }
 
-    return count;
+    for (dtb_node* child = source->child; child != NULL; child = child->sibling)
+    {
+        dtb_node* existing = find_child_exact(target, child->name);
+        if (existing == NULL)
+            existing = dtb_add_node_ex(state, target, child->name);
+        if (existing == NULL || !merge_overlay_node(state, existing, child))
+            return false;
+    }
+    return true;
 }
 
-uint32_t dtb_read_prop_cell_array(dtb_prop* prop, uint32_t cell_count, uint32_t* vals)
+/* Returns the length of a node's full path, writing it to `path` if that's not NULL. */
+static uint32_t get_node_path(const dtb_node* node, char* path)
 {
-    if (prop == NULL || cell_count == 0)
+    if (node->parent == NULL)
         return 0;
-    
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop->first_cell - 2);
-    const uint32_t count = be32(fdtprop->length) / (cell_count * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
 
-    for (uint32_t i = 0; i < count; i++)
+    uint32_t length = get_node_path(node->parent, path);
+    if (path != NULL)
+        path[length] = '/';
+    length++;
+    for (const char* name = node->name; *name != 0; name++, length++)
     {
-        const uint32_t* base = prop->first_cell + i * cell_count;
-        extract_cells(base, cell_count, vals + i * cell_count);
+        if (path != NULL)
+            path[length] = *name;
     }
+    return length;
+}
 
-    return count;
+/* Adds the overlay's labels to the base tree's '__symbols__', or only checks that they can be
+ * added if `patch` is false. Labels inside a fragment have paths like
+ * "/fragment@0/__overlay__/node", which are rewritten to be below the target.
+ */
+static bool merge_overlay_symbols(struct dtb_state* state, struct dtb_state* overlay, bool patch)
+{
+    dtb_node* symbols = dtb_find_ex(overlay, "/__symbols__");
+    if (symbols == NULL || !load_node(symbols) || symbols->prop_count == 0)
+        return true;
+
+    dtb_node* base_symbols = NULL;
+    if (patch)
+    {
+        base_symbols = dtb_find_ex(state, "/__symbols__");
+        if (base_symbols == NULL)
+            base_symbols = dtb_add_node_ex(state, state->root, "__symbols__");
+        if (base_symbols == NULL)
+            return false;
+    }
+
+    static const char overlay_name[] = "/__overlay__";
+    const uint32_t overlay_name_len = sizeof(overlay_name) - 1;
+    for (uint32_t i = 0; i < symbols->prop_count; i++)
+    {
+        dtb_prop* symbol = &symbols->props[i];
+        const char* path = dtb_read_prop_string(symbol, 0);
+        if (path == NULL || path[0] != '/')
+            return false;
+
+        //split the path into the fragment, the __overlay__ node and whatever is below it.
+        const uint32_t fragment_len = string_find_char(path + 1, '/');
+        if (fragment_len == ~0u || !strings_eq_bounded(path + 1 + fragment_len, overlay_name, overlay_name_len))
+            continue; //labels outside of fragments aren't merged into the base tree.
+        const char* rest = path + 1 + fragment_len + overlay_name_len;
+        if (*rest != 0 && *rest != '/')
+            continue;
+
+        dtb_node* fragment = find_path_bounded(overlay, path, fragment_len + 1);
+        dtb_node* target = fragment ? get_fragment_target(state, overlay, fragment) : NULL;
+        if (target == NULL)
+            return false;
+        if (!patch)
+            continue;
+
+        //the target's path is empty for the root, in which case the label is for "/" itself.
+        const uint32_t target_len = get_node_path(target, NULL);
+        const uint32_t rest_len = string_len(rest);
+        const uint32_t length = target_len + rest_len > 0 ? target_len + rest_len : 1;
+        dtb_prop* prop;
+        char* value = (char*)set_prop_space(state, base_symbols, symbol->name, length + 1, &prop);
+        if (value == NULL)
+            return false;
+        value[0] = '/';
+        get_node_path(target, value);
+        for (uint32_t ri = 0; ri < rest_len; ri++)
+            value[target_len + ri] = rest[ri];
+        check_for_changed_prop(state, base_symbols, prop);
+    }
+    return true;
+}
+
+/* Checks everything applying an overlay depends on, so a bad overlay is rejected before either
+ * tree is changed and the same instance can still be applied to another tree.
+ */
+static bool check_overlay(struct dtb_state* state, struct dtb_state* overlay, uint32_t delta)
+{
+    if (!adjust_overlay_phandles(overlay, delta, false))
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay has a malformed or too large phandle.");
+        return false;
+    }
+    dtb_node* local_fixups = find_child_exact(overlay->root, "__local_fixups__");
+    if (local_fixups != NULL && !apply_local_fixups(overlay, local_fixups, overlay->root, delta, false))
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay has malformed __local_fixups__.");
+        return false;
+    }
+    dtb_node* fixups = find_child_exact(overlay->root, "__fixups__");
+    if (fixups != NULL && !apply_fixups(state, overlay, fixups, false))
+        return false;
+
+    for (dtb_node* fragment = overlay->root->child; fragment != NULL; fragment = fragment->sibling)
+    {
+        if (find_child_exact(fragment, "__overlay__") != NULL && get_fragment_target(state, overlay, fragment) == NULL)
+        {
+            if (state->ops.on_error)
+                state->ops.on_error("Overlay fragment has no valid target.");
+            return false;
+        }
+    }
+    if (!merge_overlay_symbols(state, overlay, false))
+    {
+        if (state->ops.on_error)
+            state->ops.on_error("Overlay has a malformed __symbols__ node.");
+        return false;
+    }
+    return true;
+}
+
+bool dtb_apply_overlay_ex(dtb_state* state, dtb_state* overlay)
+{
+    if (state == NULL || overlay == NULL || state->root == NULL || overlay->root == NULL)
+        return false;
+
+    const uint32_t delta = get_max_phandle(state);
+    if (!check_overlay(state, overlay, delta))
+        return false;
+
+    //from here on only running out of memory can stop the overlay being applied.
+    dtb_node* local_fixups = find_child_exact(overlay->root, "__local_fixups__");
+    dtb_node* fixups = find_child_exact(overlay->root, "__fixups__");
+    if (!adjust_overlay_phandles(overlay, delta, true))
+        return false;
+    if (local_fixups != NULL && !apply_local_fixups(overlay, local_fixups, overlay->root, delta, true))
+        return false;
+    if (fixups != NULL && !apply_fixups(state, overlay, fixups, true))
+        return false;
+
+    for (dtb_node* fragment = overlay->root->child; fragment != NULL; fragment = fragment->sibling)
+    {
+        dtb_node* contents = find_child_exact(fragment, "__overlay__");
+        if (contents == NULL)
+            continue;
+        dtb_node* target = get_fragment_target(state, overlay, fragment);
+        if (target == NULL || !merge_overlay_node(state, target, contents))
+            return false;
+    }
+    return merge_overlay_symbols(state, overlay, true);
+}
+
+bool dtb_apply_overlay(dtb_state* overlay)
+{
+    return dtb_apply_overlay_ex(&default_state, overlay);
 }
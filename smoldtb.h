@@ -2,17 +2,23 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 typedef struct dtb_node_t dtb_node;
 typedef struct dtb_prop_t dtb_prop;
+typedef struct dtb_state dtb_state;
+
+/* An interned property name, see `dtb_intern()`. */
+typedef uint32_t dtb_atom;
+#define DTB_ATOM_INVALID (~(dtb_atom)0)
 
 /* The 'fdt_*' structs represent data layouts taken directly from the device tree
  * specification. In contrast the 'dtb_*' structs are for the parser.
  *
- * The public API only supports a single (global) active parser, but internally everything
- * is stored within an instance of the 'dtb_state' struct. This should make it easy
- * to support multiple parser instances in the future if needed. Or if you're here to
- * hack that support in, it should hopefully require minimal effort.
+ * All parser data is stored within an instance of the 'dtb_state' struct. The original API
+ * operates on a single (global) instance, while the `_ex` functions take an instance created
+ * by `dtb_init_ex()`, so any number of trees can be parsed at the same time. Functions that
+ * only take a node or property work with nodes from any instance.
  */
 struct fdt_header
 {
@@ -42,12 +48,15 @@ struct fdt_property
 
 /* The tree is represented in horizontal slices, where all child nodes are represented
  * in a singly-linked list. Only a pointer to the first child is stored in the parent, and
- * the list is build using the node->sibling pointer.
+ * the list is build using the node->sibling pointer. Children are listed in the same order
+ * as they appear in the blob, and nodes are allocated in pre-order (depth first).
  * For reference the pointer building the tree are:
  * - parent: go up one level
  * - sibling: the next node on this level. To access the previous node, access the parent and then
  *            the child pointer and iterate to just before the target.
  * - child: the first child node.
+ * - props: the node's properties, which are stored contiguously (`prop_count` of them).
+ * Nodes with many children can also have a sorted index of them, see `SMOLDTB_CHILD_INDEX`.
  */
 struct dtb_node_t
 {
@@ -59,24 +68,160 @@ struct dtb_node_t
     const char* name;
     uint8_t addr_cells;
     uint8_t size_cells;
+    uint16_t prop_count;
+    uint32_t child_count;
+#ifdef SMOLDTB_CHILD_INDEX
+    struct dtb_child_entry* child_index; //NULL unless the node has enough children to index.
+#endif
+#ifdef SMOLDTB_NODE_NAME_INFO
+    /* Precomputed by the parser for faster child lookups: the length of the unit name (before
+     * the '@'), the offset of the unit address (0 if there's none), and a hash of the unit name.
+     */
+    uint16_t unit_name_len;
+    uint16_t unit_addr_offset;
+    uint32_t name_hash;
+#endif
+#ifdef SMOLDTB_INTERRUPT_INFO
+    /* Recorded by the parser for interrupt resolution: the node's effective interrupt parent,
+     * its '#interrupt-cells', and its decoded 'interrupt-map' if it's an interrupt nexus.
+     */
+    dtb_node* interrupt_parent;
+    struct dtb_imap_entry* interrupt_map;
+    uint32_t interrupt_map_count;
+    uint32_t interrupt_cells;
+#endif
+#ifdef SMOLDTB_STATUS_INFO
+    uint8_t disabled; //recorded by the parser, set if the node's own 'status' isn't "okay".
+#endif
+#if defined(SMOLDTB_LAZY_PARSE) || defined(SMOLDTB_STATS)
+    dtb_state* owner; //the instance the node belongs to.
+#endif
+#ifdef SMOLDTB_LAZY_PARSE
+    /* The offset (in cells) of the node's BEGIN_NODE token, so its properties and children
+     * can be parsed the first time they're accessed.
+     */
+    uint32_t offset;
+    uint8_t expanded;
+#endif
 };
 
-/* Similar to nodes, properties are stored a singly linked list. */
+/* Properties are stored in an array per node, in the order they appear in the blob. */
 struct dtb_prop_t
 {
     const char* name;
     const uint32_t* first_cell;
     uint32_t length;
-    dtb_prop* next;
 };
 
+/* A cursor walks the structure block of a blob directly, without parsing it into nodes or
+ * allocating anything: all of its state is in this struct, which can live on the stack. Each
+ * call to `dtb_cursor_next()` produces one event.
+ */
+typedef enum
+{
+    DTB_EVENT_BEGIN_NODE,
+    DTB_EVENT_PROP,
+    DTB_EVENT_END_NODE,
+} dtb_event_type;
+
+typedef struct
+{
+    const uint32_t* cells;
+    const char* strings;
+    uint32_t cell_count;
+    uint32_t strings_size;
+    uint32_t offset; //the next token to read
+    uint32_t depth; //number of nodes the cursor is inside of
+    bool finished;
+} dtb_cursor;
+
+/* `depth` is the depth of the node the event belongs to, relative to where the cursor started.
+ * `name` is the node or property name (NULL for END_NODE), and for PROP events `prop` can be
+ * passed to the `dtb_read_prop_*()` functions.
+ */
+typedef struct
+{
+    dtb_event_type type;
+    uint32_t depth;
+    const char* name;
+    dtb_prop prop;
+} dtb_cursor_event;
+
+/* Why a blob couldn't be parsed, see `dtb_init_checked()` and `dtb_get_error()`. */
+typedef enum
+{
+    DTB_OK,
+    DTB_ERR_MAGIC, //the header doesn't start with the FDT magic number.
+    DTB_ERR_VERSION, //the blob's version isn't compatible with version 17.
+    DTB_ERR_TRUNCATED, //'total_size' is smaller than the header, or larger than the buffer.
+    DTB_ERR_LAYOUT, //a block is misaligned or outside of 'total_size', or the memory reservations aren't terminated.
+    DTB_ERR_STRINGS, //the strings block doesn't end with a terminated string.
+    DTB_ERR_BAD_TOKEN, //the structure block has an unknown token.
+    DTB_ERR_BAD_NAME, //a node name runs past the end of the structure block.
+    DTB_ERR_BAD_PROP, //a property runs past the end of the structure block, or its name is outside the strings block.
+    DTB_ERR_STRUCTURE, //nodes aren't nested properly, or the structure block has no FDT_END token.
+    DTB_ERR_NO_MEMORY, //memory for the parser couldn't be allocated.
+    DTB_ERR_INDEX, //an index passed to `dtb_init_from_index()` doesn't match the blob or this build.
+    DTB_ERR_TOO_LARGE, //the parsed tree would need an arena of 4GB or more.
+} dtb_error;
+
+/* A function to call for each property with a given name while the tree is parsed, see the
+ * "Property Hooks" section of the readme. `arg` is passed to it unchanged.
+ */
+typedef struct
+{
+    const char* name;
+    void (*func)(dtb_node* node, dtb_prop* prop, void* arg);
+    void* arg;
+} dtb_prop_hook;
+
+/* The steps of initializing a parser, reported to `dtb_ops.on_phase` when the library is
+ * compiled with `SMOLDTB_STATS`.
+ */
+typedef enum
+{
+    DTB_PHASE_HEADER, //checking the header and releasing anything from a previous parse.
+    DTB_PHASE_COUNT, //sizing the tree and allocating the arena for it.
+    DTB_PHASE_PARSE, //creating the nodes and properties, or restoring them from an index.
+    DTB_PHASE_INDEX, //linking the compatible index and interrupt info.
+    DTB_PHASE_VIEWS, //building the reserved ranges and topology.
+} dtb_phase;
+
 typedef struct
 {
     void* (*malloc)(uint32_t length);
     void (*free)(void* ptr, uint32_t length);
     void (*on_error)(const char* why);
+    /* Called by `dtb_publish()` with the tree it replaced. Readers may still be using the old
+     * tree, so it should be passed to `dtb_deinit()` only after they're done with it.
+     */
+    void (*retire)(dtb_state* old);
+    /* Optional, `prop_hook_count` hooks to run while parsing. Only the first
+     * `SMOLDTB_MAX_PROP_HOOKS` are used (8 by default, at most 24 since the hooks share a 64 slot
+     * table with the parser's own names), any others are reported through `on_error()`. The
+     * array must stay valid as long as the instance.
+     */
+    const dtb_prop_hook* prop_hooks;
+    uint32_t prop_hook_count;
+    /* Optional, called at the start (`done` is false) and end of each phase of initializing a
+     * parser, e.g. to time them. Only used when compiled with `SMOLDTB_STATS`.
+     */
+    void (*on_phase)(dtb_phase phase, bool done);
 } dtb_ops;
 
+/* Lets the parser spread work over several threads, see `dtb_init_parallel()` and
+ * `dtb_init_batch()`. `run()` must call `job(arg, worker)` once for each worker from 0 up to
+ * `count`, each call can happen on a different thread at the same time, and only return once
+ * all of the calls have returned. `ops` is optional, if it's set it points to an array of `count`
+ * operation sets and each worker uses its own one, e.g. so they can allocate from separate arenas.
+ */
+typedef struct
+{
+    uint32_t count;
+    void (*run)(void (*job)(void* arg, uint32_t worker), void* arg, uint32_t count);
+    const dtb_ops* ops;
+} dtb_workers;
+
 typedef struct
 {
     const char* name;
@@ -85,21 +230,179 @@ typedef struct
     uint32_t sibling_count;
 } dtb_node_stat;
 
+/* A decoded entry of a 'reg' property, see `dtb_read_reg()`. */
+typedef struct
+{
+    uint64_t base;
+    uint64_t size;
+} dtb_reg;
+
+/* A CPU under '/cpus', see `dtb_get_topology()`. `cluster` counts the clusters of the
+ * 'cpu-map' that contain cores in the order they appear, `core` is the position of the CPU's
+ * core within its cluster and `thread` the position within that core (0 if the core has no
+ * threads). CPUs that the 'cpu-map' doesn't mention (or if there's no map) have all three set
+ * to `DTB_CPU_NOT_MAPPED`.
+ */
+#define DTB_CPU_NOT_MAPPED (~(uint32_t)0)
+
+typedef struct
+{
+    dtb_node* node;
+    uint64_t id; //the first address in its 'reg': a hart id, MPIDR or similar.
+    uint32_t cluster;
+    uint32_t core;
+    uint32_t thread;
+} dtb_cpu;
+
+/* The arrays recorded when built with `SMOLDTB_TOPOLOGY`: every available CPU in the order
+ * they appear under '/cpus', and the ranges of every available memory node, sorted by base and
+ * merged where they overlap or touch.
+ */
+typedef struct
+{
+    const dtb_cpu* cpus;
+    uint32_t cpu_count;
+    const dtb_reg* memory;
+    uint32_t memory_count;
+} dtb_topology;
+
+/* A decoded entry of a 'ranges' (or 'dma-ranges') property, see `dtb_read_ranges()`. */
+typedef struct
+{
+    uint64_t child_base;
+    uint64_t parent_base;
+    uint64_t size;
+} dtb_range;
+
+/* The largest interrupt specifier `dtb_resolve_interrupt()` can handle. */
+#define DTB_MAX_INTERRUPT_CELLS 4
+
+/* An interrupt specifier as seen by the interrupt controller that receives it. */
+typedef struct
+{
+    dtb_node* controller;
+    uint32_t cell_count;
+    uint32_t cells[DTB_MAX_INTERRUPT_CELLS];
+} dtb_interrupt;
+
+/* Counters describing how the parser has been used, see `dtb_get_stats()`. Counters for
+ * features that weren't compiled in are always zero.
+ */
+typedef struct
+{
+    size_t calls;
+    size_t visited; //the nodes, properties or table slots looked at by those calls.
+} dtb_call_stats;
+
+typedef struct
+{
+    size_t path_cache_hits;
+    size_t path_cache_misses;
+    size_t ranges_cache_hits;
+    size_t ranges_cache_misses;
+
+    /* Only counted when compiled with `SMOLDTB_STATS`, see the "Instrumentation" section of
+     * the readme.
+     */
+    size_t arena_size; //bytes allocated up front for the parsed tree and its indexes.
+    size_t arena_used;
+    size_t chunk_size; //bytes allocated afterwards, for edits and lazily parsed nodes.
+    size_t chunk_used;
+    size_t node_count; //nodes and properties parsed from the blob (so far, with lazy parsing).
+    size_t prop_count;
+    size_t phandle_slots; //the size of the phandle table, and how many slots hold a phandle.
+    size_t phandle_used;
+    dtb_call_stats find;
+    dtb_call_stats find_compatible;
+    dtb_call_stats find_prop;
+    dtb_call_stats find_phandle;
+} dtb_stats;
+
 void dtb_init(uintptr_t start, dtb_ops ops);
+dtb_state* dtb_init_ex(uintptr_t start, dtb_ops ops);
+dtb_state* dtb_init_checked(uintptr_t start, uint32_t size, dtb_ops ops, dtb_error* error);
+dtb_error dtb_get_error();
+void dtb_deinit(dtb_state* state);
+dtb_state* dtb_init_parallel(uintptr_t start, dtb_ops ops, const dtb_workers* workers);
+uint32_t dtb_init_batch(const uintptr_t* starts, uint32_t count, dtb_ops ops, const dtb_workers* workers, dtb_state** states);
+dtb_state* dtb_publish(uintptr_t start, dtb_ops ops);
+dtb_state* dtb_get_published();
+bool dtb_init_from_index(uintptr_t start, void* index, uint32_t index_size, dtb_ops ops);
+dtb_state* dtb_init_from_index_ex(uintptr_t start, void* index, uint32_t index_size, dtb_ops ops);
+dtb_state* dtb_clone_ex(dtb_state* source, dtb_ops ops);
 
 dtb_node* dtb_find_compatible(dtb_node* node, const char* str);
+dtb_node* dtb_find_compatible_available(dtb_node* node, const char* str);
 dtb_node* dtb_find_phandle(uint32_t handle);
 dtb_node* dtb_find(const char* path);
 dtb_node* dtb_find_child(dtb_node* node, const char* name);
 dtb_prop* dtb_find_prop(dtb_node* node, const char* name);
+dtb_atom dtb_intern(const char* name);
+dtb_prop* dtb_find_prop_interned(dtb_node* node, dtb_atom atom);
+uint32_t dtb_find_props(dtb_node* node, const char* const* names, uint32_t count, dtb_prop** props);
+uint32_t dtb_find_props_interned(dtb_node* node, const dtb_atom* atoms, uint32_t count, dtb_prop** props);
+
+dtb_node* dtb_find_compatible_ex(dtb_state* state, dtb_node* node, const char* str);
+dtb_node* dtb_find_compatible_available_ex(dtb_state* state, dtb_node* node, const char* str);
+dtb_node* dtb_find_phandle_ex(dtb_state* state, uint32_t handle);
+dtb_node* dtb_find_ex(dtb_state* state, const char* path);
+dtb_atom dtb_intern_ex(dtb_state* state, const char* name);
+dtb_prop* dtb_find_prop_interned_ex(dtb_state* state, dtb_node* node, dtb_atom atom);
+uint32_t dtb_find_props_interned_ex(dtb_state* state, dtb_node* node, const dtb_atom* atoms, uint32_t count, dtb_prop** props);
 
 dtb_node* dtb_get_sibling(dtb_node* node);
 dtb_node* dtb_get_child(dtb_node* node);
 dtb_node* dtb_get_parent(dtb_node* node);
+dtb_node* dtb_get_available_sibling(dtb_node* node);
+dtb_node* dtb_get_available_child(dtb_node* node);
+bool dtb_is_available(dtb_node* node);
 dtb_prop* dtb_get_prop(dtb_node* node, uint32_t index);
 void dtb_stat_node(dtb_node* node, dtb_node_stat* stat);
+void dtb_get_stats(dtb_stats* stats);
+void dtb_get_stats_ex(dtb_state* state, dtb_stats* stats);
+bool dtb_get_memreserve(uint32_t index, dtb_reg* entry);
+bool dtb_get_memreserve_ex(dtb_state* state, uint32_t index, dtb_reg* entry);
+const dtb_reg* dtb_get_reserved_ranges(uint32_t* count);
+const dtb_reg* dtb_get_reserved_ranges_ex(dtb_state* state, uint32_t* count);
+bool dtb_get_topology(dtb_topology* topology);
+bool dtb_get_topology_ex(dtb_state* state, dtb_topology* topology);
+
+bool dtb_cursor_init(dtb_cursor* cursor, uintptr_t start);
+bool dtb_cursor_next(dtb_cursor* cursor, dtb_cursor_event* event);
+bool dtb_cursor_find(dtb_cursor* cursor, const char* path, dtb_cursor_event* node);
+bool dtb_cursor_find_compatible(dtb_cursor* cursor, const char* str, dtb_cursor_event* node);
 
 const char* dtb_read_prop_string(dtb_prop* prop, uint32_t index);
 uint32_t dtb_read_prop_bytestring(dtb_prop* prop, char* vals);
 uint32_t dtb_read_prop_cell_array(dtb_prop* prop, uint32_t cell_count, uint32_t* vals);
+uint32_t dtb_read_reg(dtb_node* node, dtb_reg* vals);
+uint32_t dtb_read_ranges(dtb_node* node, const char* name, dtb_range* vals);
+
+bool dtb_translate_address(dtb_node* node, uint64_t addr, uint64_t* cpu_addr);
+bool dtb_translate_address_ex(dtb_state* state, dtb_node* node, uint64_t addr, uint64_t* cpu_addr);
+
+uint32_t dtb_get_interrupt_cells(dtb_node* node);
+dtb_node* dtb_get_interrupt_parent(dtb_node* node);
+dtb_node* dtb_get_interrupt_parent_ex(dtb_state* state, dtb_node* node);
+bool dtb_resolve_interrupt(dtb_node* node, uint32_t index, dtb_interrupt* irq);
+bool dtb_resolve_interrupt_ex(dtb_state* state, dtb_node* node, uint32_t index, dtb_interrupt* irq);
+
+bool dtb_set_prop(dtb_node* node, const char* name, const void* value, uint32_t length);
+bool dtb_set_prop_string(dtb_node* node, const char* name, const char* str);
+bool dtb_set_prop_cells(dtb_node* node, const char* name, const uint32_t* cells, uint32_t count);
+dtb_node* dtb_add_node(dtb_node* parent, const char* name);
+bool dtb_remove_node(dtb_node* node);
+bool dtb_set_prop_ex(dtb_state* state, dtb_node* node, const char* name, const void* value, uint32_t length);
+bool dtb_set_prop_string_ex(dtb_state* state, dtb_node* node, const char* name, const char* str);
+bool dtb_set_prop_cells_ex(dtb_state* state, dtb_node* node, const char* name, const uint32_t* cells, uint32_t count);
+dtb_node* dtb_add_node_ex(dtb_state* state, dtb_node* parent, const char* name);
+bool dtb_remove_node_ex(dtb_state* state, dtb_node* node);
+
+bool dtb_apply_overlay(dtb_state* overlay);
+bool dtb_apply_overlay_ex(dtb_state* state, dtb_state* overlay);
+
+uint32_t dtb_write(void* buffer, uint32_t buffer_size);
+uint32_t dtb_write_ex(dtb_state* state, void* buffer, uint32_t buffer_size);
+uint32_t dtb_write_index(void* buffer, uint32_t buffer_size);
+uint32_t dtb_write_index_ex(dtb_state* state, void* buffer, uint32_t buffer_size);
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -19,6 +20,64 @@ void* dtb_malloc(uint32_t length)
     return malloc(length);
 }
 
+void dtb_free(void* ptr, uint32_t length)
+{
+    (void)length;
+    free(ptr);
+}
+
+void dtb_retire(dtb_state* old)
+{
+    //no other threads are reading, so the old tree can be released immediately.
+    dtb_deinit(old);
+}
+
+void dtb_count_prop(dtb_node* node, dtb_prop* prop, void* arg)
+{
+    (void)node;
+    (void)prop;
+    (*(uint32_t*)arg)++;
+}
+
+uint32_t phases_done = 0;
+
+void dtb_count_phase(dtb_phase phase, bool done)
+{
+    (void)phase;
+    if (done)
+        phases_done++;
+}
+
+void dtb_run_workers(void (*job)(void* arg, uint32_t worker), void* arg, uint32_t count)
+{
+    //readfdt is single threaded, so the workers just take turns.
+    for (uint32_t i = 0; i < count; i++)
+        job(arg, i);
+}
+
+uint32_t to_be32(uint32_t value)
+{
+    return (uint32_t)B(value, 0) << 24 | (uint32_t)B(value, 1) << 16 | (uint32_t)B(value, 2) << 8 | B(value, 3);
+}
+
+uint32_t dup_blob[30];
+
+/* Fills `cells` (30 of them) with a blob whose strings block isn't deduplicated, so some names
+ * appear at more than one offset: a root node with a 'reg' and a 'zz' property.
+ */
+void build_dup_strings_blob(uint32_t* cells)
+{
+    const char strings[] = "reg\0reg\0zz\0zz";
+    const uint32_t header[10] = { 0xd00dfeed, 120, 56, 104, 40, 17, 16, 0, sizeof(strings), 48 };
+    const uint32_t structs[12] = { 1, 0, 3, 4, 0, 1, 3, 4, 11, 2, 2, 9 };
+    memset(cells, 0, 30 * sizeof(uint32_t));
+    for (uint32_t i = 0; i < 10; i++)
+        cells[i] = to_be32(header[i]);
+    for (uint32_t i = 0; i < 12; i++)
+        cells[14 + i] = to_be32(structs[i]);
+    memcpy(&cells[26], strings, sizeof(strings));
+}
+
 void print_node(dtb_node* node, uint32_t indent)
 {
     const uint32_t indent_scale = 2;
@@ -78,10 +137,15 @@ void display_file(const char* filename)
         return;
     }
 
-    dtb_ops ops;
+    dtb_ops ops = { 0 };
     ops.malloc = dtb_malloc;
+    ops.free = dtb_free;
     ops.on_error = dtb_on_error;
+    ops.retire = dtb_retire;
     dtb_init((uintptr_t)buffer, ops);
+    //for parsing that's expected to fail.
+    dtb_ops ops_quiet = ops;
+    ops_quiet.on_error = NULL;
 
 #if 0
     dtb_node *root = dtb_find("/");
@@ -111,7 +175,7 @@ void display_file(const char* filename)
         if (node != NULL) {
             prop = dtb_find_prop(node, "phandle");
             if (prop != NULL) {
-                dtb_read_prop_cell_array(prop, node->addr_cells, &val);
+                dtb_read_prop_cell_array(prop, 1, &val);
                 printf("cpus->cpu: phandle %u\n", val);
             }
         }
@@ -124,7 +188,7 @@ void display_file(const char* filename)
                 if (node != NULL) {
                     prop = dtb_find_prop(node, "cpu");
                     if (prop != NULL) {
-                        dtb_read_prop_cell_array(prop, node->addr_cells, &val);
+                        dtb_read_prop_cell_array(prop, 1, &val);
                         node = dtb_find_phandle(val);
                         if (node != NULL) {
                             printf("cpu-map->cluster0->core1: cpu %u, node %s\n", val, node->name);
@@ -140,7 +204,274 @@ void display_file(const char* filename)
         node = dtb_find_compatible(node, "ns16550a");
         if (node != NULL) {
             printf("compatible ns16550a: %s\n", node->name);
+            dtb_reg reg;
+            uint64_t cpu_addr;
+            if (dtb_read_reg(node, NULL) == 1 && dtb_read_reg(node, &reg) == 1
+                && dtb_translate_address(node, reg.base, &cpu_addr))
+                printf("%s reg: base 0x%lx, size 0x%lx, cpu address 0x%lx\n", node->name,
+                    (unsigned long)reg.base, (unsigned long)reg.size, (unsigned long)cpu_addr);
+        }
+    }
+
+    node = dtb_find("/soc/virtio_mmio@10003000");
+    if (node != NULL) {
+        prop = dtb_find_prop(node, "interrupts");
+        if (prop != NULL && dtb_read_prop_cell_array(prop, 2, NULL) == 1) {
+            uint32_t irq[2];
+            dtb_read_prop_cell_array(prop, 2, irq);
+            printf("virtio_mmio@10003000: interrupt %u %u\n", irq[0], irq[1]);
+        }
+
+        dtb_interrupt resolved;
+        if (dtb_resolve_interrupt(node, 0, &resolved) && resolved.cell_count == 2)
+            printf("virtio_mmio@10003000: resolved to %s, cells %u %u\n", resolved.controller->name,
+                resolved.cells[0], resolved.cells[1]);
+    }
+
+    node = dtb_find("/soc/pci");
+    if (node != NULL) {
+        prop = dtb_find_prop(node, "interrupt-map");
+        const uint32_t cell_count = dtb_read_prop_cell_array(prop, 1, NULL);
+        uint32_t* cells = malloc(cell_count * sizeof(uint32_t));
+        if (cells != NULL && cell_count > 0) {
+            dtb_read_prop_cell_array(prop, 1, cells);
+            uint32_t sum = 0;
+            for (uint32_t i = 0; i < cell_count; i++)
+                sum = sum * 31 + cells[i];
+            printf("pci interrupt-map: %u cells, hash %08x\n", cell_count, sum);
         }
+        free(cells);
+    }
+
+    node = dtb_find("/soc/pci");
+    const uint32_t range_count = dtb_read_ranges(node, "ranges", NULL);
+    if (range_count > 0) {
+        dtb_range ranges[range_count];
+        dtb_read_ranges(node, "ranges", ranges);
+        printf("pci ranges: %u entries, last 0x%lx -> 0x%lx size 0x%lx\n", range_count,
+            (unsigned long)ranges[range_count - 1].child_base, (unsigned long)ranges[range_count - 1].parent_base,
+            (unsigned long)ranges[range_count - 1].size);
+    }
+
+    const dtb_atom compatible = dtb_intern("compatible");
+    uint32_t compat_count = 0;
+    node = NULL;
+    while ((node = dtb_find_compatible(node, "virtio,mmio")) != NULL) {
+        if (dtb_find_prop_interned(node, compatible) != NULL)
+            compat_count++;
+    }
+    printf("compatible virtio,mmio: %u nodes\n", compat_count);
+
+    node = dtb_find("/soc/virtio_mmio@10003000");
+    if (node != NULL) {
+        const char* names[] = { "reg", "interrupts", "status", "compatible" };
+        dtb_atom atoms[4];
+        dtb_prop* props[4];
+        for (uint32_t i = 0; i < 4; i++)
+            atoms[i] = dtb_intern(names[i]);
+        const uint32_t by_name = dtb_find_props(node, names, 4, props);
+        const uint32_t by_atom = dtb_find_props_interned(node, atoms, 4, props);
+        if (props[1] == dtb_find_prop(node, "interrupts"))
+            printf("batch: %u and %u of 4 properties\n", by_name, by_atom);
+    }
+
+    dtb_cursor cursor;
+    dtb_cursor_event event;
+    if (dtb_cursor_init(&cursor, (uintptr_t)buffer) && dtb_cursor_find(&cursor, "/soc/virtio_mmio@10003000", &event)) {
+        const char* name = event.name;
+        uint32_t prop_count = 0;
+        while (dtb_cursor_next(&cursor, &event)) {
+            if (event.type == DTB_EVENT_PROP && event.depth == 0)
+                prop_count++;
+        }
+
+        compat_count = 0;
+        dtb_cursor_init(&cursor, (uintptr_t)buffer);
+        while (dtb_cursor_find_compatible(&cursor, "virtio,mmio", NULL))
+            compat_count++;
+        printf("cursor: %s has %u properties, %u virtio,mmio nodes\n", name, prop_count, compat_count);
+    }
+
+    dtb_state* instance = dtb_init_ex((uintptr_t)buffer, ops);
+    if (instance != NULL) {
+        node = dtb_find_ex(instance, "cpus/cpu-map/cluster0/core1");
+        prop = dtb_find_prop_interned_ex(instance, node, dtb_intern_ex(instance, "cpu"));
+        if (prop != NULL) {
+            dtb_read_prop_cell_array(prop, 1, &val);
+            node = dtb_find_phandle_ex(instance, val);
+            if (node != NULL && node != dtb_find_phandle(val))
+                printf("instance: cpu %u, node %s\n", val, node->name);
+        }
+        dtb_deinit(instance);
+    }
+
+    const uint32_t blob_size = dtb_write(NULL, 0);
+    void* blob = malloc(blob_size);
+    if (blob != NULL && dtb_write(blob, blob_size) == blob_size) {
+        instance = dtb_init_ex((uintptr_t)blob, ops);
+        if (instance != NULL) {
+            dtb_node_stat stat = { 0 };
+            dtb_stat_node(dtb_find_ex(instance, "/soc/pci"), &stat);
+            printf("written: %u bytes, pci has %u properties, rewritten %u bytes\n", blob_size,
+                stat.prop_count, dtb_write_ex(instance, NULL, 0));
+            dtb_deinit(instance);
+        }
+    }
+    free(blob);
+
+    instance = dtb_init_ex((uintptr_t)buffer, ops);
+    if (instance != NULL) {
+        const uint32_t mem_reg[4] = { 0, 0x80000000, 0, 0x10000000 };
+        node = dtb_add_node_ex(instance, dtb_find_ex(instance, "/chosen"), "guest");
+        const bool changed = dtb_set_prop_string_ex(instance, dtb_find_ex(instance, "/chosen"), "bootargs", "quiet")
+            && dtb_set_prop_cells_ex(instance, dtb_find_ex(instance, "/memory@80000000"), "reg", mem_reg, 4)
+            && dtb_set_prop_string_ex(instance, node, "guest-name", "vm0")
+            && dtb_remove_node_ex(instance, dtb_find_ex(instance, "/soc/virtio_mmio@10004000"));
+
+        const uint32_t edited_size = dtb_write_ex(instance, NULL, 0);
+        void* edited = malloc(edited_size);
+        dtb_state* reparsed = NULL;
+        if (changed && edited != NULL && dtb_write_ex(instance, edited, edited_size) == edited_size)
+            reparsed = dtb_init_ex((uintptr_t)edited, ops);
+        if (reparsed != NULL) {
+            dtb_reg reg = { 0 };
+            dtb_read_reg(dtb_find_ex(reparsed, "/memory@80000000"), &reg);
+            prop = dtb_find_prop(dtb_find_ex(reparsed, "/chosen/guest"), "guest-name");
+            printf("edited: bootargs %s, memory size 0x%lx, guest %s, %s\n",
+                dtb_read_prop_string(dtb_find_prop(dtb_find_ex(reparsed, "/chosen"), "bootargs"), 0),
+                (unsigned long)reg.size, prop ? dtb_read_prop_string(prop, 0) : "missing",
+                dtb_find_ex(reparsed, "/soc/virtio_mmio@10004000") ? "not removed" : "removed");
+            dtb_deinit(reparsed);
+        }
+        free(edited);
+        dtb_deinit(instance);
+    }
+
+    //a name added by an edit isn't in the strings block, even when the atom looked up is ambiguous.
+    build_dup_strings_blob(dup_blob);
+    instance = dtb_init_ex((uintptr_t)dup_blob, ops);
+    if (instance != NULL) {
+        const uint32_t added_value = 3;
+        node = dtb_find_ex(instance, "/");
+        dtb_set_prop_cells_ex(instance, node, "brand-new-name-0", &added_value, 1);
+        const dtb_atom atoms[2] = { dtb_intern_ex(instance, "zz"), dtb_intern_ex(instance, "reg") };
+        dtb_prop* props[2];
+        const uint32_t found = dtb_find_props_interned_ex(instance, node, atoms, 2, props);
+        if (props[0] == dtb_find_prop(node, "zz"))
+            printf("added names: %u of 2 properties, %s\n", found,
+                dtb_find_prop(node, "brand-new-name-0") ? "added found" : "added missing");
+        dtb_deinit(instance);
+    }
+
+    dtb_error checked_error, truncated_error;
+    instance = dtb_init_checked((uintptr_t)buffer, sb.st_size, ops_quiet, &checked_error);
+    dtb_state* truncated = dtb_init_checked((uintptr_t)buffer, dtb_write(NULL, 0) / 2, ops_quiet, &truncated_error);
+    if (instance != NULL && truncated == NULL)
+        printf("checked: error %d, truncated error %d\n", checked_error, truncated_error);
+    dtb_deinit(instance);
+
+    dtb_reg reservation;
+    uint32_t reserved_count;
+    const dtb_reg* reserved = dtb_get_reserved_ranges(&reserved_count);
+    printf("reserved: %s, %u ranges%s\n", dtb_get_memreserve(0, &reservation) ? "memreserve" : "no memreserve",
+        reserved_count, reserved == NULL ? "" : " listed");
+
+    //only recorded when built with SMOLDTB_TOPOLOGY.
+    dtb_topology topology;
+    if (dtb_get_topology(&topology) && topology.cpu_count > 1 && topology.memory_count > 0) {
+        printf("topology: %u cpus, cpu %lu in cluster %u core %u, %u memory ranges from 0x%lx\n",
+            topology.cpu_count, (unsigned long)topology.cpus[1].id, topology.cpus[1].cluster,
+            topology.cpus[1].core, topology.memory_count, (unsigned long)topology.memory[0].base);
+    }
+
+    uint32_t hook_counts[2] = { 0, 0 };
+    const dtb_prop_hook hooks[2] =
+    {
+        { "status", dtb_count_prop, &hook_counts[0] },
+        { "interrupt-parent", dtb_count_prop, &hook_counts[1] },
+    };
+    dtb_ops ops_hooked = ops;
+    ops_hooked.prop_hooks = hooks;
+    ops_hooked.prop_hook_count = 2;
+    instance = dtb_init_ex((uintptr_t)buffer, ops_hooked);
+    //with lazy parsing the hooks run as nodes are loaded, writing the tree loads all of them.
+    if (instance != NULL && dtb_write_ex(instance, NULL, 0) == blob_size)
+        printf("hooks: %u status, %u interrupt-parent\n", hook_counts[0], hook_counts[1]);
+    dtb_deinit(instance);
+
+    instance = dtb_init_ex((uintptr_t)buffer, ops);
+    if (instance != NULL) {
+        node = dtb_find_ex(instance, "/soc/uart@10000000");
+        const bool was_available = dtb_find_compatible_available_ex(instance, NULL, "ns16550a") == node;
+        dtb_set_prop_string_ex(instance, node, "status", "disabled");
+        uint32_t cpu_count = 0;
+        for (dtb_node* cpu = dtb_get_available_child(dtb_find_ex(instance, "/cpus")); cpu != NULL;
+            cpu = dtb_get_available_sibling(cpu))
+            cpu_count++;
+        if (was_available && node != NULL && !dtb_is_available(node))
+            printf("status: uart disabled, available ns16550a: %s, /cpus has %u available children\n",
+                dtb_find_compatible_available_ex(instance, NULL, "ns16550a") ? "found" : "none", cpu_count);
+        dtb_deinit(instance);
+    }
+
+    //indexes can't be written with lazy parsing.
+    instance = dtb_init_ex((uintptr_t)buffer, ops_quiet);
+    const uint32_t index_size = dtb_write_index_ex(instance, NULL, 0);
+    void* index = index_size != 0 ? malloc(index_size) : NULL;
+    if (index != NULL && dtb_write_index_ex(instance, index, index_size) == index_size) {
+        dtb_deinit(instance);
+        instance = dtb_init_from_index_ex((uintptr_t)buffer, index, index_size, ops);
+        node = dtb_find_ex(instance, "/soc/uart@10000000");
+        if (instance != NULL && node != NULL && dtb_find_phandle_ex(instance, val) != NULL)
+            printf("index: restored, uart %s, same tree %s\n", dtb_read_prop_string(dtb_find_prop(node, "compatible"), 0),
+                dtb_write_ex(instance, NULL, 0) == blob_size ? "yes" : "no");
+    }
+    dtb_deinit(instance);
+    free(index);
+
+#ifdef SMOLDTB_STATS
+    //only counted when the library is built with SMOLDTB_STATS.
+    dtb_ops ops_phases = ops;
+    ops_phases.on_phase = dtb_count_phase;
+    instance = dtb_init_ex((uintptr_t)buffer, ops_phases);
+    if (instance != NULL) {
+        dtb_find_prop(dtb_find_compatible_ex(instance, NULL, "ns16550a"), "reg");
+        dtb_find_phandle_ex(instance, val);
+        dtb_find_ex(instance, "/cpus/cpu-map/cluster0/core1");
+        dtb_stats stats;
+        dtb_get_stats_ex(instance, &stats);
+        printf("stats: %u phases, %zu nodes, %zu props, arena %zu/%zu, phandles %zu/%zu, "
+            "find %zu/%zu, compatible %zu/%zu, prop %zu/%zu, phandle %zu/%zu\n", phases_done,
+            stats.node_count, stats.prop_count, stats.arena_used, stats.arena_size, stats.phandle_used,
+            stats.phandle_slots, stats.find.calls, stats.find.visited, stats.find_compatible.calls,
+            stats.find_compatible.visited, stats.find_prop.calls, stats.find_prop.visited,
+            stats.find_phandle.calls, stats.find_phandle.visited);
+        dtb_deinit(instance);
+    }
+#endif
+
+    dtb_workers workers = { 4, dtb_run_workers, NULL };
+    instance = dtb_init_parallel((uintptr_t)buffer, ops, &workers);
+    if (instance != NULL) {
+        const uintptr_t starts[3] = { (uintptr_t)buffer, (uintptr_t)buffer, (uintptr_t)buffer };
+        dtb_state* batch[3] = { NULL, NULL, NULL };
+        const uint32_t batch_count = dtb_init_batch(starts, 3, ops, &workers, batch);
+        node = dtb_find_phandle_ex(instance, val);
+        dtb_node* uart = dtb_find_compatible_ex(instance, NULL, "ns16550a");
+        if (node != NULL && uart != NULL && batch[2] != NULL && dtb_write_ex(batch[2], NULL, 0) == blob_size)
+            printf("parallel: cpu %u, node %s, compatible ns16550a: %s, batch %u of 3\n", val, node->name,
+                uart->name, batch_count);
+        for (uint32_t i = 0; i < 3; i++)
+            dtb_deinit(batch[i]);
+        dtb_deinit(instance);
+    }
+
+    dtb_state* first = dtb_publish((uintptr_t)buffer, ops);
+    dtb_state* second = dtb_publish((uintptr_t)buffer, ops);
+    if (first != NULL && second != NULL && dtb_get_published() == second) {
+        node = dtb_find_compatible_ex(second, NULL, "ns16550a");
+        if (node != NULL)
+            printf("published: compatible ns16550a: %s\n", node->name);
     }
 
     munmap(buffer, sb.st_size);